@@ -0,0 +1,94 @@
+/**
+ * @file atomic.h
+ * @brief Atomic memory accesses
+ *
+ * Thin wrappers around the compiler atomic built-ins.
+ */
+
+/***********************************************************************
+ *  Copyright © 2007 Rémi Denis-Courmont.                              *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifndef LIBTEREDO_ATOMIC_H
+# define LIBTEREDO_ATOMIC_H
+
+# if !defined (__GNUC__)
+#  error Atomic built-ins are required.
+# endif
+
+/**
+ * Loads a value atomically, without any ordering constraint.
+ */
+# define teredo_atomic_load(p) __atomic_load_n (p, __ATOMIC_RELAXED)
+
+/**
+ * Stores a value atomically, without any ordering constraint.
+ */
+# define teredo_atomic_store(p, v) __atomic_store_n (p, v, __ATOMIC_RELAXED)
+
+/**
+ * Loads a value atomically, with acquire semantics.
+ */
+# define teredo_atomic_load_acquire(p) __atomic_load_n (p, __ATOMIC_ACQUIRE)
+
+/**
+ * Stores a value atomically, with release semantics.
+ */
+# define teredo_atomic_store_release(p, v) \
+	__atomic_store_n (p, v, __ATOMIC_RELEASE)
+
+/**
+ * Replaces a value atomically, without any ordering constraint.
+ * @return the previous value.
+ */
+# define teredo_atomic_exchange(p, v) \
+	__atomic_exchange_n (p, v, __ATOMIC_RELAXED)
+
+/**
+ * Adds to a value atomically, without any ordering constraint.
+ */
+# define teredo_atomic_add(p, v) \
+	(void)__atomic_add_fetch (p, v, __ATOMIC_RELAXED)
+
+/**
+ * Adds to a value atomically, without any ordering constraint.
+ * @return the new value.
+ */
+# define teredo_atomic_add_fetch(p, v) \
+	__atomic_add_fetch (p, v, __ATOMIC_RELAXED)
+
+/**
+ * Subtracts from a value atomically, without any ordering constraint.
+ */
+# define teredo_atomic_sub(p, v) \
+	(void)__atomic_sub_fetch (p, v, __ATOMIC_RELAXED)
+
+/**
+ * Acquire memory barrier: orders prior loads before subsequent accesses.
+ */
+# define teredo_atomic_fence_acquire() __atomic_thread_fence (__ATOMIC_ACQUIRE)
+
+/**
+ * Release memory barrier: orders prior accesses before subsequent stores.
+ */
+# define teredo_atomic_fence_release() __atomic_thread_fence (__ATOMIC_RELEASE)
+
+/**
+ * Full memory barrier.
+ */
+# define teredo_atomic_fence() __atomic_thread_fence (__ATOMIC_SEQ_CST)
+
+#endif /* ifndef LIBTEREDO_ATOMIC_H */
@@ -26,6 +26,32 @@
 # include <sys/types.h>
 # include <netinet/in.h>
 
+/**
+ * Updates an Internet checksum after a part of the checksummed data was
+ * rewritten (RFC 1624), without summing the whole data again.
+ * The rewritten part must start on an even byte offset within the data, and
+ * its length must be even. The buffers need not be aligned.
+ *
+ * @param cksum checksum before the rewrite
+ * @param old previous value of the rewritten part
+ * @param new new value of the rewritten part
+ * @param len byte length of the rewritten part
+ *
+ * @return the checksum after the rewrite.
+ */
+uint16_t teredo_cksum_adjust (uint16_t cksum, const void *old,
+                              const void *new, size_t len);
+
+/**
+ * Selects the checksum implementation, for testing and benchmarking.
+ * By default, the fastest one supported by the CPU is used.
+ *
+ * @param name "scalar", "sse2", "avx2", "neon", or NULL for the default.
+ *
+ * @return 0 on success, -1 if not supported by this build or CPU.
+ */
+int teredo_cksum_select (const char *name);
+
 /**
  * Computes an ICMPv6 over IPv6 packet checksum.
  * Jumbo datagrams not supported (but you don't care, do you?).
@@ -0,0 +1,304 @@
+/*
+ * cksum.c - Internet checksum engine
+ *
+ * See RFC 1071 and RFC 1624 for more information
+ */
+
+/***********************************************************************
+ *  Copyright © 2007 Rémi Denis-Courmont.                              *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <string.h> // memcpy(), strcmp()
+#include <stdbool.h>
+#include <inttypes.h>
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/ip6.h>
+#include <netinet/icmp6.h>
+#ifdef HAVE_X86_DISPATCH
+# include <immintrin.h>
+#endif
+#ifdef __ARM_NEON
+# include <arm_neon.h>
+#endif
+
+#include "teredo.h"
+#include "teredo-udp.h"
+#include "checksum.h"
+#include "atomic.h"
+
+/*
+ * The one's complement sum does not depend on the byte order, as long as
+ * the words are loaded and the result is stored in the same order. So the
+ * data is summed in host byte order, 32 or 64 bits at a time, and the sum
+ * is folded down to 16 bits at the end. The carries are accumulated in the
+ * upper half of the wider words, and added back when folding (2^16 is one,
+ * modulo 2^16 - 1).
+ *
+ * All engines return an unfolded partial sum, with the buffer treated as
+ * starting on an even byte boundary, and padded with a nul byte if its
+ * length is odd. Buffers of up to 4 GiB are supported.
+ */
+typedef uint64_t (*sum_fn) (const uint8_t *, size_t);
+
+/* 64-bits one's complement addition */
+static inline uint64_t add64 (uint64_t a, uint64_t b)
+{
+	a += b;
+	return a + (a < b);
+}
+
+
+static inline uint16_t fold64 (uint64_t sum)
+{
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	return sum;
+}
+
+
+static uint64_t sum_scalar (const uint8_t *p, size_t len)
+{
+	uint64_t sum = 0, w[4];
+
+	for (; len >= sizeof (w); p += sizeof (w), len -= sizeof (w))
+	{
+		memcpy (w, p, sizeof (w));
+		sum = add64 (sum, w[0]);
+		sum = add64 (sum, w[1]);
+		sum = add64 (sum, w[2]);
+		sum = add64 (sum, w[3]);
+	}
+
+	for (; len >= sizeof (w[0]); p += sizeof (w[0]), len -= sizeof (w[0]))
+	{
+		memcpy (w, p, sizeof (w[0]));
+		sum = add64 (sum, w[0]);
+	}
+
+	/* Remaining bytes, padded with nul bytes */
+	w[0] = 0;
+	memcpy (w, p, len);
+	return add64 (sum, w[0]);
+}
+
+
+#ifdef HAVE_X86_DISPATCH
+/* Zero-extends 32-bits words to 64-bits lanes, which cannot overflow */
+__attribute__ ((target ("sse2")))
+static uint64_t sum_sse2 (const uint8_t *p, size_t len)
+{
+	const __m128i zero = _mm_setzero_si128 ();
+	__m128i acc0 = zero, acc1 = zero;
+
+	for (; len >= 32; p += 32, len -= 32)
+	{
+		__m128i v0 = _mm_loadu_si128 ((const __m128i *)p);
+		__m128i v1 = _mm_loadu_si128 ((const __m128i *)(p + 16));
+
+		acc0 = _mm_add_epi64 (acc0, _mm_unpacklo_epi32 (v0, zero));
+		acc1 = _mm_add_epi64 (acc1, _mm_unpackhi_epi32 (v0, zero));
+		acc0 = _mm_add_epi64 (acc0, _mm_unpacklo_epi32 (v1, zero));
+		acc1 = _mm_add_epi64 (acc1, _mm_unpackhi_epi32 (v1, zero));
+	}
+
+	uint64_t lanes[2];
+	_mm_storeu_si128 ((__m128i *)lanes, _mm_add_epi64 (acc0, acc1));
+	return add64 (add64 (lanes[0], lanes[1]), sum_scalar (p, len));
+}
+
+
+__attribute__ ((target ("avx2")))
+static uint64_t sum_avx2 (const uint8_t *p, size_t len)
+{
+	const __m256i zero = _mm256_setzero_si256 ();
+	__m256i acc0 = zero, acc1 = zero;
+
+	for (; len >= 64; p += 64, len -= 64)
+	{
+		__m256i v0 = _mm256_loadu_si256 ((const __m256i *)p);
+		__m256i v1 = _mm256_loadu_si256 ((const __m256i *)(p + 32));
+
+		acc0 = _mm256_add_epi64 (acc0, _mm256_unpacklo_epi32 (v0, zero));
+		acc1 = _mm256_add_epi64 (acc1, _mm256_unpackhi_epi32 (v0, zero));
+		acc0 = _mm256_add_epi64 (acc0, _mm256_unpacklo_epi32 (v1, zero));
+		acc1 = _mm256_add_epi64 (acc1, _mm256_unpackhi_epi32 (v1, zero));
+	}
+
+	uint64_t lanes[4];
+	_mm256_storeu_si256 ((__m256i *)lanes, _mm256_add_epi64 (acc0, acc1));
+
+	uint64_t sum = add64 (add64 (lanes[0], lanes[1]),
+	                      add64 (lanes[2], lanes[3]));
+	return add64 (sum, sum_scalar (p, len));
+}
+#endif
+
+
+#ifdef __ARM_NEON
+/* Pairwise adds 32-bits words into 64-bits lanes */
+static uint64_t sum_neon (const uint8_t *p, size_t len)
+{
+	uint64x2_t acc0 = vdupq_n_u64 (0), acc1 = acc0;
+
+	for (; len >= 32; p += 32, len -= 32)
+	{
+		acc0 = vpadalq_u32 (acc0, vreinterpretq_u32_u8 (vld1q_u8 (p)));
+		acc1 = vpadalq_u32 (acc1, vreinterpretq_u32_u8 (vld1q_u8 (p + 16)));
+	}
+
+	acc0 = vaddq_u64 (acc0, acc1);
+	return add64 (add64 (vgetq_lane_u64 (acc0, 0), vgetq_lane_u64 (acc0, 1)),
+	              sum_scalar (p, len));
+}
+#endif
+
+
+/**
+ * @return the fastest engine supported by the CPU.
+ */
+static sum_fn sum_best (void)
+{
+#if defined (HAVE_X86_DISPATCH)
+	__builtin_cpu_init ();
+	if (__builtin_cpu_supports ("avx2"))
+		return sum_avx2;
+	if (__builtin_cpu_supports ("sse2"))
+		return sum_sse2;
+#elif defined (__ARM_NEON)
+	/* NEON is available whenever the compiler allows it */
+	return sum_neon;
+#endif
+	return sum_scalar;
+}
+
+
+static uint64_t sum_auto (const uint8_t *p, size_t len);
+
+/* Selected engine (atomic) */
+static sum_fn sum_impl = sum_auto;
+
+/* Selects the engine on first use */
+static uint64_t sum_auto (const uint8_t *p, size_t len)
+{
+	sum_fn fn = sum_best ();
+
+	teredo_atomic_store (&sum_impl, fn);
+	return fn (p, len);
+}
+
+
+int teredo_cksum_select (const char *name)
+{
+	sum_fn fn = NULL;
+
+	if (name == NULL)
+		fn = sum_best ();
+	else
+	if (!strcmp (name, "scalar"))
+		fn = sum_scalar;
+#ifdef HAVE_X86_DISPATCH
+	else
+	if (!strcmp (name, "sse2") && __builtin_cpu_supports ("sse2"))
+		fn = sum_sse2;
+	else
+	if (!strcmp (name, "avx2") && __builtin_cpu_supports ("avx2"))
+		fn = sum_avx2;
+#endif
+#ifdef __ARM_NEON
+	else
+	if (!strcmp (name, "neon"))
+		fn = sum_neon;
+#endif
+
+	if (fn == NULL)
+		return -1;
+
+	teredo_atomic_store (&sum_impl, fn);
+	return 0;
+}
+
+
+/**
+ * Computes the one's complement sum of a scatter-gather array.
+ * A buffer starting on an odd byte boundary is summed as if it were even,
+ * then the bytes of its sum are swapped.
+ */
+static uint64_t sum_iov (uint64_t sum, const struct iovec *iov, size_t n)
+{
+	sum_fn fn = teredo_atomic_load (&sum_impl);
+	bool odd = false;
+
+	for (; n > 0; iov++, n--)
+	{
+		size_t len = iov->iov_len;
+		if (len == 0)
+			continue;
+
+		uint64_t s = fn (iov->iov_base, len);
+		if (odd)
+		{
+			uint16_t f = fold64 (s);
+			s = (uint16_t)((f >> 8) | (f << 8));
+		}
+		sum = add64 (sum, s);
+		odd ^= len & 1;
+	}
+	return sum;
+}
+
+
+uint16_t
+teredo_cksum (const void *src, const void *dst, uint8_t protocol,
+              const struct iovec *data, size_t n)
+{
+	size_t plen = 0;
+	for (size_t i = 0; i < n; i++)
+		plen += data[i].iov_len;
+
+	/* IPv6 pseudo-header (an even number of bytes) */
+	uint32_t pseudo[2] = { htonl (plen), htonl (protocol) };
+	sum_fn fn = teredo_atomic_load (&sum_impl);
+	uint64_t sum = fn (src, 16);
+
+	sum = add64 (sum, fn (dst, 16));
+	sum = add64 (sum, fn ((const uint8_t *)pseudo, sizeof (pseudo)));
+
+	return ~fold64 (sum_iov (sum, data, n));
+}
+
+
+uint16_t
+teredo_cksum_adjust (uint16_t cksum, const void *old, const void *new,
+                     size_t len)
+{
+	sum_fn fn = teredo_atomic_load (&sum_impl);
+
+	/* RFC 1624, equation 3: HC' = ~(~HC + ~m + m') */
+	uint64_t sum = (uint16_t)~cksum;
+	sum = add64 (sum, (uint16_t)~fold64 (fn (old, len)));
+	sum = add64 (sum, fn (new, len));
+
+	return ~fold64 (sum);
+}
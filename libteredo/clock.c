@@ -1,5 +1,5 @@
 /*
- * clock.c - Fast-lookup 1Hz clock
+ * clock.c - Fast-lookup lock-less clock
  */
 
 /***********************************************************************
@@ -24,122 +24,70 @@
 #endif
 
 #include <time.h>
-#include <signal.h>
 #include <stdbool.h>
-#include <string.h>
-#include <limits.h> // DELAYTIMER_MAX
 
-#include <sys/types.h>
-#include <sys/time.h>
 #include <unistd.h> // _POSIX_*
-#include <pthread.h>
 
 #include "clock.h"
-#include "debug.h"
+#include "atomic.h"
 
-#ifdef HAVE_TIMER_CREATE
-typedef struct clock_data_t
-{
-	timer_t           handle;
-	teredo_clock_t    value;
-	bool              active;
-} clock_data_t;
-
-
-static void clock_tick (union sigval val)
-{
-	clock_data_t *context = (clock_data_t *)(val.sival_ptr);
-
-	int orun = timer_getoverrun (context->handle);
-	context->value += 1 + orun;
-
-#ifdef DELAYTIMER_MAX
-	if (orun == DELAYTIMER_MAX)
-		/* We have a big problem, let next caller fix it */
-		context->active = false;
+/*
+ * The clock is read directly from the system, which does not involve any
+ * lock nor, on most systems, any system call (the coarse monotonic clock is
+ * served from a page shared with the kernel). It is only as precise as the
+ * kernel tick, which is much more than enough for peers expiration.
+ */
+static teredo_clock_source clock_source = NULL; /* atomic */
+#ifdef CLOCK_MONOTONIC_COARSE
+static bool coarse_missing = false; /* atomic */
 #endif
 
-	if (!context->active)
-	{
-		struct itimerspec it =
-		{
-			.it_value = { .tv_sec = 0, .tv_nsec = 0 },
-		};
-		timer_settime (context->handle, 0, &it, NULL);
-	}
-
-	context->active = false;
-}
-
 
-unsigned long teredo_clock (void)
+static void clock_now (struct timespec *ts)
 {
-	static clock_data_t clk =
-	{
-		.value = 0,
-		.active = false
-	};
-	static struct
-	{
-		pthread_mutex_t lock;
-		clockid_t       id;
-		bool            present;
-	} priv = { PTHREAD_MUTEX_INITIALIZER, CLOCK_REALTIME, false };
-
-	teredo_clock_t value;
-
-	pthread_mutex_lock (&priv.lock);
-	if (!priv.present)
+	teredo_clock_source source = teredo_atomic_load (&clock_source);
+	if (source != NULL)
 	{
-		struct sigevent ev;
-
-		memset (&ev, 0, sizeof (ev));
-		ev.sigev_notify = SIGEV_THREAD;
-		ev.sigev_value.sival_ptr = &clk;
-		ev.sigev_notify_function = clock_tick;
-
-#if (_POSIX_CLOCK_SELECTION - 0 >= 0) && (_POSIX_MONOTONIC_CLOCK - 0 >= 0)
-		/* Run-time POSIX monotonic clock detection */
-		struct timespec res;
-		if (clock_getres (CLOCK_MONOTONIC, &res) == 0)
-			priv.id = CLOCK_MONOTONIC;
-#endif
-
-		if (timer_create (priv.id, &ev, &clk.handle) == 0)
-			priv.present = true;
+		source (ts);
+		return;
 	}
 
-	if (!clk.active)
+#ifdef CLOCK_MONOTONIC_COARSE
+	/* Run-time coarse clock detection (Linux 2.6.32 and later) */
+	if (!teredo_atomic_load (&coarse_missing))
 	{
-		struct itimerspec it;
+		if (clock_gettime (CLOCK_MONOTONIC_COARSE, ts) == 0)
+			return;
+		teredo_atomic_store (&coarse_missing, true);
+	}
+#endif
+#if (_POSIX_MONOTONIC_CLOCK - 0 >= 0)
+	if (clock_gettime (CLOCK_MONOTONIC, ts) == 0)
+		return;
+#endif
+	clock_gettime (CLOCK_REALTIME, ts);
+}
 
-		clock_gettime (priv.id, &it.it_value);
-		clk.value = it.it_value.tv_sec;
 
-		if (priv.present)
-		{
-			it.it_value.tv_sec++;
-			it.it_value.tv_nsec = 0;
-			it.it_interval.tv_sec = 1;
-			it.it_interval.tv_nsec = 0;
+teredo_clock_t teredo_clock (void)
+{
+	struct timespec ts;
 
-			clk.active = true;
-			timer_settime (clk.handle, TIMER_ABSTIME, &it, NULL);
-		}
-	}
+	clock_now (&ts);
+	return ts.tv_sec;
+}
 
-	value = clk.value;
-	pthread_mutex_unlock (&priv.lock);
 
-	return value;
-}
-#else
-unsigned long teredo_clock (void)
+teredo_clock_ms_t teredo_clock_ms (void)
 {
 	struct timespec ts;
 
-	clock_gettime (CLOCK_REALTIME, &ts);
-	return ts.tv_sec;
+	clock_now (&ts);
+	return ts.tv_sec * (teredo_clock_ms_t)1000 + ts.tv_nsec / 1000000;
 }
-#endif
 
+
+void teredo_clock_set_source (teredo_clock_source source)
+{
+	teredo_atomic_store (&clock_source, source);
+}
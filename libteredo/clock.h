@@ -32,19 +32,49 @@
 # define LIBTEREDO_CLOCK_H
 
 /**
- * Low-precision clock time value
+ * Low-precision clock time value (seconds)
  */
 typedef unsigned long teredo_clock_t;
 
+/**
+ * Clock time value in milliseconds
+ */
+typedef unsigned long long teredo_clock_ms_t;
+
+struct timespec;
+
+/**
+ * Time source callback: stores the current time.
+ */
+typedef void (*teredo_clock_source) (struct timespec *now);
+
 # ifdef __cplusplus
 extern "C" {
 # endif
 
 /**
- * @return current clock value; undefined if the clock is not running.
+ * Reads the clock. Thread-safe and lock-less.
+ * @return current clock value, in seconds since an arbitrary origin.
  */
 teredo_clock_t teredo_clock (void);
 
+/**
+ * Reads the clock with millisecond resolution. Thread-safe and lock-less.
+ * The resolution is actually that of the system tick (typically 1 to 10
+ * milliseconds).
+ * @return current clock value, in milliseconds since the same origin as
+ * teredo_clock().
+ */
+teredo_clock_ms_t teredo_clock_ms (void);
+
+/**
+ * Replaces the system clock with another time source, such as a fake clock
+ * for deterministic tests. Thread-safe.
+ *
+ * @param source time source callback, or NULL for the system clock.
+ */
+void teredo_clock_set_source (teredo_clock_source source);
+
 # ifdef __cplusplus
 }
 # endif /* ifdef __cplusplus */
@@ -0,0 +1,252 @@
+/*
+ * ebr.c - Epoch-based memory reclamation
+ */
+
+/***********************************************************************
+ *  Copyright © 2007 Rémi Denis-Courmont.                              *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdbool.h>
+#include <stdlib.h> /* malloc() / free() */
+#include <time.h>
+#include <limits.h> /* ULONG_MAX */
+#include <assert.h>
+#include <pthread.h>
+
+#include "ebr.h"
+#include "atomic.h"
+#include "debug.h"
+
+/*
+ * There is a global epoch counter. A thread in a read-side section
+ * announces the epoch it observed when entering. The epoch can only move
+ * forward once all threads in a read-side section have observed it.
+ * Hence an object retired during epoch E cannot be seen by any reader once
+ * the epoch has reached E + 2.
+ */
+
+typedef struct teredo_ebr_thread
+{
+	struct teredo_ebr_thread *next;
+	unsigned long state; /* observed epoch << 1 | active (atomic) */
+	bool used;
+} teredo_ebr_thread;
+
+static struct
+{
+	pthread_mutex_t lock; /* protects threads and limbo */
+	teredo_ebr_thread *threads;
+	teredo_ebr_node *limbo;
+	unsigned long epoch; /* atomic */
+} ebr = { PTHREAD_MUTEX_INITIALIZER, NULL, NULL, 0 };
+
+static pthread_key_t ebr_key;
+static pthread_once_t ebr_once = PTHREAD_ONCE_INIT;
+
+
+static void ebr_thread_exit (void *data)
+{
+	teredo_ebr_thread *th = (teredo_ebr_thread *)data;
+
+	pthread_mutex_lock (&ebr.lock);
+	teredo_atomic_store_release (&th->state, 0);
+	th->used = false;
+	pthread_mutex_unlock (&ebr.lock);
+}
+
+
+static void ebr_key_create (void)
+{
+	(void)pthread_key_create (&ebr_key, ebr_thread_exit);
+}
+
+
+/**
+ * @return the calling thread record, registering it if needed.
+ */
+static teredo_ebr_thread *ebr_thread (void)
+{
+	if (pthread_once (&ebr_once, ebr_key_create))
+		return NULL;
+
+	teredo_ebr_thread *th = pthread_getspecific (ebr_key);
+	if (th != NULL)
+		return th;
+
+	pthread_mutex_lock (&ebr.lock);
+	/* Records of terminated threads are recycled */
+	for (th = ebr.threads; th != NULL; th = th->next)
+		if (!th->used)
+			break;
+
+	if (th == NULL)
+	{
+		th = malloc (sizeof (*th));
+		if (th != NULL)
+		{
+			th->state = 0;
+			th->next = ebr.threads;
+			ebr.threads = th;
+		}
+	}
+
+	if (th != NULL)
+	{
+		if (pthread_setspecific (ebr_key, th) == 0)
+			th->used = true;
+		else
+			th = NULL;
+	}
+	pthread_mutex_unlock (&ebr.lock);
+	return th;
+}
+
+
+int teredo_ebr_enter (void)
+{
+	teredo_ebr_thread *th = ebr_thread ();
+	if (th == NULL)
+		return -1;
+
+	assert (!(th->state & 1));
+	unsigned long epoch = teredo_atomic_load (&ebr.epoch);
+	teredo_atomic_store (&th->state, (epoch << 1) | 1);
+	/* The announcement must be visible before any shared data is read */
+	teredo_atomic_fence ();
+	return 0;
+}
+
+
+void teredo_ebr_leave (void)
+{
+	teredo_ebr_thread *th = pthread_getspecific (ebr_key);
+
+	assert (th != NULL);
+	assert (th->state & 1);
+	teredo_atomic_store_release (&th->state, 0);
+}
+
+
+void teredo_ebr_retire (teredo_ebr_node *node,
+                        void (*release) (teredo_ebr_node *))
+{
+	node->release = release;
+	/* The object removal must be visible before the epoch is read */
+	teredo_atomic_fence ();
+
+	pthread_mutex_lock (&ebr.lock);
+	node->epoch = teredo_atomic_load (&ebr.epoch);
+	node->next = ebr.limbo;
+	ebr.limbo = node;
+	pthread_mutex_unlock (&ebr.lock);
+}
+
+
+typedef struct teredo_ebr_block
+{
+	teredo_ebr_node node; /* must be first */
+	void *ptr;
+} teredo_ebr_block;
+
+
+static void ebr_free_block (teredo_ebr_node *node)
+{
+	teredo_ebr_block *b = (teredo_ebr_block *)node;
+
+	free (b->ptr);
+	free (b);
+}
+
+
+void teredo_ebr_free (void *ptr)
+{
+	if (ptr == NULL)
+		return;
+
+	/* The header is allocated separately, as the block is opaque */
+	teredo_ebr_block *b = malloc (sizeof (*b));
+	if (b == NULL)
+	{
+		teredo_ebr_barrier ();
+		free (ptr);
+		return;
+	}
+
+	b->ptr = ptr;
+	teredo_ebr_retire (&b->node, ebr_free_block);
+}
+
+
+/**
+ * Advances the epoch if possible, and releases retired objects accordingly.
+ * Must be called with the lock held.
+ *
+ * @return the current epoch.
+ */
+static unsigned long ebr_collect_locked (void)
+{
+	unsigned long epoch = teredo_atomic_load (&ebr.epoch);
+
+	for (const teredo_ebr_thread *th = ebr.threads; th != NULL; th = th->next)
+	{
+		unsigned long state = teredo_atomic_load_acquire (&th->state);
+
+		if ((state & 1) && ((state >> 1) != (epoch & (ULONG_MAX >> 1))))
+			goto release; /* a reader lags behind */
+	}
+	teredo_atomic_store (&ebr.epoch, ++epoch);
+
+release:
+	for (teredo_ebr_node **pp = &ebr.limbo, *node; (node = *pp) != NULL;)
+	{
+		if (epoch - node->epoch >= 2)
+		{
+			*pp = node->next;
+			node->release (node);
+		}
+		else
+			pp = &node->next;
+	}
+	return epoch;
+}
+
+
+void teredo_ebr_collect (void)
+{
+	pthread_mutex_lock (&ebr.lock);
+	ebr_collect_locked ();
+	pthread_mutex_unlock (&ebr.lock);
+}
+
+
+void teredo_ebr_barrier (void)
+{
+	pthread_mutex_lock (&ebr.lock);
+	unsigned long target = teredo_atomic_load (&ebr.epoch) + 2;
+
+	while ((long)(ebr_collect_locked () - target) < 0)
+	{
+		/* Waits for lagging readers */
+		pthread_mutex_unlock (&ebr.lock);
+		nanosleep (&(struct timespec){ 0, 1000000 }, NULL);
+		pthread_mutex_lock (&ebr.lock);
+	}
+	pthread_mutex_unlock (&ebr.lock);
+}
@@ -0,0 +1,88 @@
+/**
+ * @file ebr.h
+ * @brief Epoch-based memory reclamation
+ *
+ * Lets threads read shared data structures without locking, while other
+ * threads remove objects from them. Readers enclose their accesses between
+ * teredo_ebr_enter() and teredo_ebr_leave(). Writers retire the objects
+ * they removed; retired objects are only released once every thread that
+ * could still see them has left its read-side section.
+ */
+
+/***********************************************************************
+ *  Copyright © 2007 Rémi Denis-Courmont.                              *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifndef LIBTEREDO_EBR_H
+# define LIBTEREDO_EBR_H
+
+typedef struct teredo_ebr_node teredo_ebr_node;
+
+/**
+ * Retired object header, to be embedded in retired objects.
+ */
+struct teredo_ebr_node
+{
+	teredo_ebr_node *next;
+	void (*release) (teredo_ebr_node *);
+	unsigned long epoch;
+};
+
+# ifdef __cplusplus
+extern "C" {
+# endif
+
+/**
+ * Enters a read-side section in the calling thread. Must not be nested.
+ * @return 0 on success, -1 on memory error (the section was not entered).
+ */
+int teredo_ebr_enter (void);
+
+/**
+ * Leaves a read-side section in the calling thread.
+ */
+void teredo_ebr_leave (void);
+
+/**
+ * Retires an object, which must not be reachable by new readers anymore.
+ * @param node header embedded in the object
+ * @param release callback to release the object, called once no readers
+ * can see it anymore (from any thread, with an internal lock held)
+ */
+void teredo_ebr_retire (teredo_ebr_node *node,
+                        void (*release) (teredo_ebr_node *));
+
+/**
+ * Releases a malloc()'ed memory block once no readers can see it.
+ */
+void teredo_ebr_free (void *ptr);
+
+/**
+ * Releases retired objects that no readers can see anymore.
+ * Should be called regularly.
+ */
+void teredo_ebr_collect (void);
+
+/**
+ * Waits until all objects retired so far are released.
+ * Must not be called from a read-side section.
+ */
+void teredo_ebr_barrier (void);
+
+# ifdef __cplusplus
+}
+# endif /* ifdef __cplusplus */
+#endif /* ifndef LIBTEREDO_EBR_H */
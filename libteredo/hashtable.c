@@ -0,0 +1,236 @@
+/*
+ * hashtable.c - Robin Hood hash table for 16-bytes keys
+ */
+
+/***********************************************************************
+ *  Copyright © 2007 Rémi Denis-Courmont.                              *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h> /* calloc() / free() */
+#include <assert.h>
+#include <inttypes.h>
+
+#include "hashtable.h"
+#include "atomic.h"
+
+#define HTAB_MIN_SIZE 16
+
+
+void teredo_htab_init (teredo_htab *t, size_t keyoff)
+{
+	t->slots = NULL;
+	t->mask = 0;
+	t->count = 0;
+	t->keyoff = keyoff;
+	t->release = free;
+}
+
+
+void teredo_htab_destroy (teredo_htab *t)
+{
+	void (*release) (void *) = t->release;
+
+	release (t->slots);
+	teredo_htab_init (t, t->keyoff);
+	t->release = release;
+}
+
+
+static inline bool
+htab_match (const teredo_htab *t, const teredo_hslot *s, uint32_t hash,
+            const void *key)
+{
+	return (s->hash == hash)
+	    && !memcmp ((const uint8_t *)s->item + t->keyoff, key,
+	                TEREDO_HTAB_KEY_LEN);
+}
+
+
+/**
+ * @return the distance of the item in slot @p i from its ideal slot.
+ */
+static inline uint32_t htab_dist (const teredo_htab *t, uint32_t i)
+{
+	return (i - t->slots[i].hash) & t->mask;
+}
+
+
+/**
+ * @return the slot index of the key, or -1 if not found.
+ */
+static long htab_lookup (const teredo_htab *t, uint32_t hash,
+                         const void *key)
+{
+	if (t->slots == NULL)
+		return -1;
+
+	for (uint32_t i = hash & t->mask, d = 0;; i = (i + 1) & t->mask, d++)
+	{
+		const teredo_hslot *s = t->slots + i;
+
+		/* Robin Hood invariant: the key would have displaced this item */
+		if ((s->item == NULL) || (htab_dist (t, i) < d))
+			return -1;
+		if (htab_match (t, s, hash, key))
+			return i;
+	}
+}
+
+
+void *teredo_htab_find (const teredo_htab *t, uint32_t hash, const void *key)
+{
+	long i = htab_lookup (t, hash, key);
+	return (i != -1) ? t->slots[i].item : NULL;
+}
+
+
+void *teredo_htab_find_lockless (const teredo_htab *t, uint32_t hash,
+                                 const void *key)
+{
+	/* The mask is published after the slots, and never shrinks */
+	uint32_t mask = teredo_atomic_load_acquire (&t->mask);
+	teredo_hslot *slots = teredo_atomic_load_acquire (&t->slots);
+
+	if (slots == NULL)
+		return NULL;
+
+	/* No Robin Hood early exit: items might be moving */
+	for (uint32_t i = hash & mask, n = 0; n <= mask; i = (i + 1) & mask, n++)
+	{
+		const uint8_t *item = teredo_atomic_load (&slots[i].item);
+
+		if (item == NULL)
+			break;
+		if ((teredo_atomic_load (&slots[i].hash) == hash)
+		 && !memcmp (item + t->keyoff, key, TEREDO_HTAB_KEY_LEN))
+			return (void *)item;
+	}
+	return NULL;
+}
+
+
+void teredo_htab_prefetch (const teredo_htab *t, uint32_t hash)
+{
+	uint32_t mask = teredo_atomic_load_acquire (&t->mask);
+	teredo_hslot *slots = teredo_atomic_load_acquire (&t->slots);
+
+	/* A prefetch never faults, even if the slots were freed meanwhile */
+#ifdef __GNUC__
+	if (slots != NULL)
+		__builtin_prefetch (slots + (hash & mask));
+#else
+	(void)mask; (void)slots;
+#endif
+}
+
+
+static void htab_place (teredo_htab *t, teredo_hslot e)
+{
+	for (uint32_t i = e.hash & t->mask, d = 0;; i = (i + 1) & t->mask, d++)
+	{
+		teredo_hslot *s = t->slots + i;
+
+		if (s->item == NULL)
+		{
+			*s = e;
+			return;
+		}
+
+		/* Steal from the rich: swap with items closer to their home */
+		uint32_t sd = htab_dist (t, i);
+		if (sd < d)
+		{
+			teredo_hslot tmp = *s;
+			*s = e;
+			e = tmp;
+			d = sd;
+		}
+	}
+}
+
+
+static int htab_resize (teredo_htab *t, uint32_t size)
+{
+	teredo_hslot *old = t->slots;
+	uint32_t oldsize = (old != NULL) ? (t->mask + 1) : 0;
+
+	assert (size > t->count);
+	teredo_hslot *slots = calloc (size, sizeof (*slots));
+	if (slots == NULL)
+		return -1;
+
+	/* Lock-less readers must never see the new mask with the old slots */
+	teredo_atomic_store_release (&t->slots, slots);
+	teredo_atomic_store_release (&t->mask, size - 1);
+
+	for (uint32_t i = 0; i < oldsize; i++)
+		if (old[i].item != NULL)
+			htab_place (t, old[i]);
+
+	t->release (old);
+	return 0;
+}
+
+
+int teredo_htab_insert (teredo_htab *t, uint32_t hash, void *item)
+{
+	assert (item != NULL);
+	assert (htab_lookup (t, hash, (uint8_t *)item + t->keyoff) == -1);
+
+	/* Keep the load factor below 7/8 */
+	uint32_t size = (t->slots != NULL) ? (t->mask + 1) : 0;
+	if ((t->count + 1) * 8 > size * 7)
+	{
+		if (size >= UINT32_C(0x80000000)
+		 || htab_resize (t, size ? (size * 2) : HTAB_MIN_SIZE))
+			return -1;
+	}
+
+	htab_place (t, (teredo_hslot){ .item = item, .hash = hash });
+	t->count++;
+	return 0;
+}
+
+
+void *teredo_htab_remove (teredo_htab *t, uint32_t hash, const void *key)
+{
+	long l = htab_lookup (t, hash, key);
+	if (l == -1)
+		return NULL;
+
+	uint32_t i = l;
+	void *item = t->slots[i].item;
+
+	/* Backward shift deletion: no tombstones */
+	for (;;)
+	{
+		uint32_t j = (i + 1) & t->mask;
+
+		if ((t->slots[j].item == NULL) || (htab_dist (t, j) == 0))
+			break;
+		t->slots[i] = t->slots[j];
+		i = j;
+	}
+	t->slots[i].item = NULL;
+	t->count--;
+	return item;
+}
@@ -0,0 +1,118 @@
+/**
+ * @file hashtable.h
+ * @brief Open addressing hash table for 16-bytes keys
+ *
+ * This is a Robin Hood hash table with backward shift deletion.
+ * Items are not copied: the table stores pointers to caller-allocated
+ * items, each of which embeds its key at a fixed offset. Hash values
+ * are computed by the caller (preferably with a keyed hash function).
+ * The table is not thread-safe.
+ */
+
+/***********************************************************************
+ *  Copyright © 2007 Rémi Denis-Courmont.                              *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifndef LIBTEREDO_HASHTABLE_H
+# define LIBTEREDO_HASHTABLE_H
+
+# define TEREDO_HTAB_KEY_LEN 16
+
+typedef struct teredo_hslot
+{
+	void *item;
+	uint32_t hash;
+} teredo_hslot;
+
+typedef struct teredo_htab
+{
+	teredo_hslot *slots;
+	uint32_t mask;
+	uint32_t count;
+	size_t keyoff;
+	void (*release) (void *); /**< releases old slots (default: free) */
+} teredo_htab;
+
+# ifdef __cplusplus
+extern "C" {
+# endif
+
+/**
+ * Initializes an empty table. Never fails.
+ *
+ * @param keyoff byte offset of the key within items.
+ */
+void teredo_htab_init (teredo_htab *t, size_t keyoff);
+
+/**
+ * Releases the table memory (but not the items).
+ */
+void teredo_htab_destroy (teredo_htab *t);
+
+/**
+ * Looks an item up.
+ *
+ * @param hash hash value of the key
+ * @param key key (TEREDO_HTAB_KEY_LEN bytes)
+ *
+ * @return the item, or NULL if not found.
+ */
+void *teredo_htab_find (const teredo_htab *t, uint32_t hash,
+                        const void *key);
+
+/**
+ * Looks an item up without locking, concurrently with changes to the table.
+ * The slots must be released through a deferred release function (see
+ * teredo_htab::release). Items might be missed while the table is changed.
+ *
+ * @param hash hash value of the key
+ * @param key key (TEREDO_HTAB_KEY_LEN bytes)
+ *
+ * @return the item, or NULL if not found.
+ */
+void *teredo_htab_find_lockless (const teredo_htab *t, uint32_t hash,
+                                 const void *key);
+
+/**
+ * Prefetches the first slot where an item with a given hash would be.
+ * Can be used concurrently with modifications of the table, without
+ * any synchronization.
+ */
+void teredo_htab_prefetch (const teredo_htab *t, uint32_t hash);
+
+/**
+ * Inserts an item, which must not already be in the table.
+ *
+ * @param hash hash value of the key embedded in the item
+ *
+ * @return 0 on success, -1 on memory error.
+ */
+int teredo_htab_insert (teredo_htab *t, uint32_t hash, void *item);
+
+/**
+ * Removes an item.
+ *
+ * @param hash hash value of the key
+ * @param key key (TEREDO_HTAB_KEY_LEN bytes)
+ *
+ * @return the removed item, or NULL if not found.
+ */
+void *teredo_htab_remove (teredo_htab *t, uint32_t hash, const void *key);
+
+# ifdef __cplusplus
+}
+# endif /* ifdef __cplusplus */
+#endif /* ifndef LIBTEREDO_HASHTABLE_H */
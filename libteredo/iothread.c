@@ -28,6 +28,9 @@
 #include <assert.h>
 #include <inttypes.h>
 #include <pthread.h>
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+# include <sched.h>
+#endif
 
 #include "iothread.h"
 #include "teredo-udp.h" // teredo_close()
@@ -76,6 +79,25 @@ teredo_iothread *teredo_iothread_start (teredo_iothread_proc proc,
 }
 
 
+int teredo_iothread_bind (teredo_iothread *io, unsigned cpu)
+{
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+	cpu_set_t set;
+
+	if (cpu >= CPU_SETSIZE)
+		return -1;
+
+	CPU_ZERO (&set);
+	CPU_SET (cpu, &set);
+	return pthread_setaffinity_np (io->thread, sizeof (set), &set) ? -1 : 0;
+#else
+	(void)io;
+	(void)cpu;
+	return -1;
+#endif
+}
+
+
 void teredo_iothread_stop (teredo_iothread *io, bool close)
 {
 	pthread_cancel (io->thread);
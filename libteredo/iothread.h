@@ -42,6 +42,16 @@ typedef void *(*teredo_iothread_proc) (void *opaque, int fd);
 teredo_iothread *teredo_iothread_start (teredo_iothread_proc proc,
                                                void *opaque, int fd);
 
+/**
+ * Restrict an IO thread to a single CPU.
+ *
+ * @param io the IO thread to bind.
+ * @param cpu index of the CPU to run the thread on.
+ *
+ * @return 0 on success, -1 on error or if not supported.
+ */
+int teredo_iothread_bind (teredo_iothread *io, unsigned cpu);
+
 /**
  * Stop an IO thread and destroy the teredo_iothread object.
  *
@@ -40,13 +40,12 @@
 #include <sys/socket.h> /* AF_INET */
 #include <netinet/in.h> /* struct in6_addr */
 #include <netinet/ip6.h> /* struct ip6_hdr */
-#include <netdb.h> /* getaddrinfo(), gai_strerror() */
+#include <arpa/inet.h> /* inet_ntop() */
+#include <netdb.h> /* gai_strerror() */
 #include <syslog.h>
 #include <stdlib.h> /* malloc(), free() */
 #include <errno.h> /* EINTR */
 #include <pthread.h>
-#include <arpa/nameser.h>
-#include <resolv.h> /* res_init() */
 
 #include "teredo.h"
 #include "teredo-udp.h"
@@ -54,7 +53,9 @@
 
 #include "security.h"
 #include "maintain.h"
+#include "resolver.h"
 #include "v4global.h" // is_ipv4_global_unicast()
+#include "atomic.h"
 #include "debug.h"
 
 static inline void gettime (struct timespec *now)
@@ -73,15 +74,65 @@ static inline void gettime (struct timespec *now)
 }
 
 
+/*
+ * Router advertisements are handed off from the receive threads to the
+ * maintenance thread through a bounded queue, so that receive threads never
+ * wait for the maintenance thread. Advertisements are copied, as the
+ * receive buffer is reused as soon as teredo_maintenance_process() returns.
+ */
+#define MAINTENANCE_QUEUE_SIZE 4 /* must be a power of two */
+#define MAINTENANCE_RA_SIZE 1280 /* larger advertisements are dropped */
+
+typedef struct teredo_ra
+{
+	size_t ip6_len;
+	uint32_t orig_ipv4;
+	uint32_t dest_ipv4;
+	bool auth_fail;
+	uint8_t auth_nonce[8];
+	union
+	{
+		uint64_t align[1];
+		uint8_t fill[MAINTENANCE_RA_SIZE];
+	} buf;
+} teredo_ra;
+
+/*
+ * Router solicitations are sent to the primary and secondary server
+ * addresses at once. The first valid advertisement is used, and the other
+ * server is kept as a hot standby: its advertisements are remembered.
+ * If the server in use leaves a round unanswered, the whole qualification
+ * delay is waited out. After as many unanswered rounds in a row as the
+ * qualification retries, the client switches to a standby that answered
+ * the last round, instead of taking the tunnel down. It switches earlier
+ * only if the standby gives the same Teredo address.
+ */
+#define MAINTENANCE_SERVERS 2
+
+typedef struct teredo_server
+{
+	char *name; /* NULL: primary server address plus one */
+	teredo_resolver *resolver; /* caches the server address */
+	uint32_t ip; /* 0 if unknown or unusable */
+	int error; /* last resolution error, to log changes only */
+	uint8_t nonce[8]; /* of the pending solicitation */
+	bool answered; /* since the pending solicitation */
+	unsigned misses; /* consecutive unanswered solicitations */
+	teredo_state state; /* from the last valid advertisement */
+} teredo_server;
+
 struct teredo_maintenance
 {
 	pthread_t thread;
-	pthread_mutex_t outer;
-	pthread_mutex_t inner;
+	pthread_mutex_t outer; /* serializes receive threads */
+	pthread_mutex_t inner; /* protects the wake-up condition */
 	pthread_cond_t received;
-	pthread_cond_t processed;
 
-	const teredo_packet *incoming;
+	/* single consumer ring (the maintenance thread) */
+	unsigned long head, tail; /* atomic */
+	teredo_ra queue[MAINTENANCE_QUEUE_SIZE];
+	teredo_packet incoming; /* advertisement being processed */
+	bool requalify; /* atomic: network changed */
 
 	int fd;
 	struct
@@ -90,7 +141,8 @@ struct teredo_maintenance
 		teredo_state_cb cb;
 		void *opaque;
 	} state;
-	char *server;
+	teredo_server servers[MAINTENANCE_SERVERS];
+	unsigned active; /* server in use (if the tunnel is up) */
 
 	unsigned qualification_delay;
 	unsigned qualification_retries;
@@ -99,30 +151,6 @@ struct teredo_maintenance
 };
 
 
-/**
- * Resolves an IPv4 address (thread-safe).
- *
- * @return 0 on success, or an error value as defined for getaddrinfo().
- */
-static int getipv4byname (const char *restrict name, uint32_t *restrict ipv4)
-{
-	struct addrinfo hints =
-	{
-		.ai_family = AF_INET,
-		.ai_socktype = SOCK_DGRAM
-	}, *res;
-
-	int val = getaddrinfo (name, NULL, &hints, &res);
-	if (val)
-		return val;
-
-	*ipv4 = ((const struct sockaddr_in *)(res->ai_addr))->sin_addr.s_addr;
-	freeaddrinfo (res);
-
-	return 0;
-}
-
-
 /**
  * Checks and parses a received Router Advertisement.
  *
@@ -130,8 +158,8 @@ static int getipv4byname (const char *restrict name, uint32_t *restrict ipv4)
  */
 static int
 maintenance_recv (const teredo_packet *restrict packet, uint32_t server_ip,
-                  const uint8_t *restrict nonce, bool cone,
-                  teredo_state *restrict state)
+                  uint32_t primary_ip, const uint8_t *restrict nonce,
+                  bool cone, teredo_state *restrict state)
 {
 	assert (packet->auth_present);
 
@@ -145,9 +173,11 @@ maintenance_recv (const teredo_packet *restrict packet, uint32_t server_ip,
 		return EACCES;
 	}
 
+	/* The secondary address of a server advertises the primary one */
 	if (teredo_parse_ra (packet, &state->addr, cone, &state->mtu)
 	/* TODO: try to work-around incorrect server IP */
-	 || (state->addr.teredo.server_ip != server_ip))
+	 || ((state->addr.teredo.server_ip != server_ip)
+	  && (state->addr.teredo.server_ip != primary_ip)))
 		return EINVAL;
 
 	/* Valid router advertisement received! */
@@ -156,39 +186,213 @@ maintenance_recv (const teredo_packet *restrict packet, uint32_t server_ip,
 }
 
 
+static void
+cleanup_unlock (void *o)
+{
+	(void)pthread_mutex_unlock ((pthread_mutex_t *)o);
+}
+
+
+static bool queue_empty (teredo_maintenance *m)
+{
+	return m->head == teredo_atomic_load_acquire (&m->tail);
+}
+
+
 /**
- * Waits until the clock reaches deadline or a RS packet is received.
- * @return 0 if a packet was received, ETIMEDOUT if deadline was reached.
+ * Waits until the clock reaches deadline, a RS packet is received, or
+ * requalification is requested. A received packet is dequeued into
+ * m->incoming.
+ * @return 0 if a packet was received, EAGAIN if requalification was
+ * requested, ETIMEDOUT if deadline was reached.
  */
 static int wait_reply (teredo_maintenance *restrict m,
                        const struct timespec *restrict deadline)
 {
-	while (m->incoming == NULL)
+	pthread_mutex_lock (&m->inner);
+	pthread_cleanup_push (cleanup_unlock, &m->inner);
+	for (int val = 0; queue_empty (m) && (val != ETIMEDOUT)
+	                  && !teredo_atomic_load (&m->requalify);)
+		val = pthread_cond_timedwait (&m->received, &m->inner, deadline);
+	pthread_cleanup_pop (1);
+
+	if (queue_empty (m))
+		return teredo_atomic_exchange (&m->requalify, false)
+			? EAGAIN : ETIMEDOUT;
+
+	const teredo_ra *ra = m->queue + (m->head & (MAINTENANCE_QUEUE_SIZE - 1));
+	teredo_packet *p = &m->incoming;
+
+	p->ip6 = (struct ip6_hdr *)p->buf.fill;
+	p->ip6_len = ra->ip6_len;
+	memcpy (p->buf.fill, ra->buf.fill, ra->ip6_len);
+	p->source_port = htons (IPPORT_TEREDO);
+	p->orig_ipv4 = ra->orig_ipv4;
+	p->dest_ipv4 = ra->dest_ipv4;
+	p->auth_present = true;
+	p->auth_fail = ra->auth_fail;
+	memcpy (p->auth_nonce, ra->auth_nonce, sizeof (p->auth_nonce));
+
+	/* the slot can be reused */
+	teredo_atomic_store_release (&m->head, m->head + 1);
+	return 0;
+}
+
+
+/**
+ * Waits until the clock reaches deadline and ignore any RS packet received
+ * in the mean time.
+ * @return true if the wait was interrupted by a requalification request.
+ */
+static bool wait_reply_ignore (teredo_maintenance *restrict m,
+                               const struct timespec *restrict deadline)
+{
+	int val;
+
+	while ((val = wait_reply (m, deadline)) == 0);
+	return val == EAGAIN;
+}
+
+
+/**
+ * Matches the received Router Advertisement with a pending solicitation,
+ * and records it for the server that sent it.
+ * @return the index of that server, -1 if the advertisement is not valid.
+ */
+static int maintenance_match (teredo_maintenance *m)
+{
+	for (unsigned i = 0; i < MAINTENANCE_SERVERS; i++)
 	{
-		switch (pthread_cond_timedwait (&m->received, &m->inner, deadline))
+		teredo_server *srv = m->servers + i;
+		teredo_state newst;
+
+		if (srv->ip == 0)
+			continue;
+
+		newst.mtu = 1280;
+		newst.up = true;
+		if (maintenance_recv (&m->incoming, srv->ip, m->servers[0].ip,
+		                      srv->nonce, false, &newst) == 0)
 		{
-			case 0:
-				break;
-			case ETIMEDOUT:
-				return ETIMEDOUT;
+			srv->state = newst;
+			srv->answered = true;
+			return i;
 		}
 	}
-	return 0; // dead code
+	return -1;
 }
 
 
 /**
- * Waits until the clock reaches deadline and ignore any RS packet received
- * in the mean time.
+ * Waits until the clock reaches deadline, and records advertisements from
+ * standby servers in the mean time.
+ * @return true if the wait was interrupted by a requalification request.
  */
-static void wait_reply_ignore (teredo_maintenance *restrict m,
-                               const struct timespec *restrict deadline)
+static bool wait_reply_standby (teredo_maintenance *restrict m,
+                                const struct timespec *restrict deadline)
+{
+	int val;
+
+	while ((val = wait_reply (m, deadline)) == 0)
+		(void)maintenance_match (m);
+	return val == EAGAIN;
+}
+
+
+/**
+ * Updates the server addresses from the resolvers cache. Only waits for the
+ * DNS on the very first resolution, until the restart delay.
+ * @return false if no server address is usable.
+ */
+static bool maintenance_resolve (teredo_maintenance *m)
 {
-	while (wait_reply (m, deadline) == 0)
+	teredo_state *c_state = &m->state.state;
+	uint32_t first = 0;
+	struct timespec deadline;
+
+	gettime (&deadline);
+	deadline.tv_sec += m->restart_delay;
+
+	for (unsigned i = 0; i < MAINTENANCE_SERVERS; i++)
 	{
-		m->incoming = NULL;
-		pthread_cond_signal (&m->processed);
+		teredo_server *srv = m->servers + i;
+		uint32_t ip = srv->ip;
+		int val = 0;
+
+		/* Counts the solicitations of the last round left unanswered */
+		if (srv->ip != 0)
+			srv->misses = srv->answered ? 0 : (srv->misses + 1);
+
+		if (srv->resolver != NULL)
+		{
+			/* The address is kept as long as the name resolves to it,
+			 * unless the server stopped answering. */
+			if (srv->misses >= m->qualification_retries)
+			{
+				teredo_resolver_skip (srv->resolver, &ip);
+				srv->misses = 0;
+			}
+			val = teredo_resolver_get (srv->resolver, &ip, &deadline);
+
+			/* Prefers another address than the primary server's */
+			if ((val == 0) && (i > 0) && (ip == m->servers[0].ip))
+				teredo_resolver_skip (srv->resolver, &ip);
+		}
+		else
+			ip = (m->servers[0].ip != 0)
+				? htonl (ntohl (m->servers[0].ip) + 1) : 0;
+
+		if (val)
+		{
+			/* DNS resolution failed */
+			if (val != srv->error)
+				syslog (LOG_ERR,
+				        _("Cannot resolve Teredo server address \"%s\": %s"),
+				        srv->name, gai_strerror (val));
+			ip = 0;
+		}
+		else
+		if ((ip != 0) && !is_ipv4_global_unicast (ip))
+		{
+			val = -1;
+			if (val != srv->error)
+				syslog (LOG_ERR,
+				        _("Teredo server has a non global IPv4 address."));
+			ip = 0;
+		}
+		srv->error = val;
+
+		/* Both names may well point to the same server */
+		if ((i > 0) && (ip == m->servers[0].ip))
+			ip = 0;
+
+		if (ip != srv->ip)
+		{
+			/* The server in use left the DNS or stopped answering */
+			if (c_state->up && (m->active == i))
+			{
+				syslog (LOG_NOTICE, _("Teredo server address changed"));
+				c_state->up = false;
+				m->state.cb (c_state, m->state.opaque);
+			}
+			srv->ip = ip;
+			srv->answered = false;
+		}
+
+		if (first == 0)
+			first = ip;
 	}
+
+	if (first == 0)
+		return false;
+
+	if (!c_state->up && (c_state->addr.teredo.server_ip != first))
+	{
+		/* Tells Teredo client about the new server's IP */
+		c_state->addr.teredo.server_ip = first;
+		m->state.cb (c_state, m->state.opaque);
+	}
+	return true;
 }
 
 
@@ -214,13 +418,6 @@ checkTimeDrift (struct timespec *ts)
 }
 
 
-static void
-cleanup_unlock (void *o)
-{
-	(void)pthread_mutex_unlock ((pthread_mutex_t *)o);
-}
-
-
 /*
  * Implementation notes:
  * - Optional Teredo interval determination procedure was never implemented.
@@ -241,9 +438,8 @@ cleanup_unlock (void *o)
 static inline LIBTEREDO_NORETURN
 void maintenance_thread (teredo_maintenance *m)
 {
-	struct timespec deadline = { 0, 0 };
+	struct timespec deadline;
 	teredo_state *c_state = &m->state.state;
-	uint32_t server_ip = 0;
 	unsigned count = 0;
 	enum
 	{
@@ -251,84 +447,100 @@ void maintenance_thread (teredo_maintenance *m)
 		TERR_BLACKHOLE
 	} last_error = TERR_NONE;
 
-	pthread_mutex_lock (&m->inner);
+	gettime (&deadline);
 
 	/*
 	 * Qualification/maintenance procedure
 	 */
-	pthread_cleanup_push (cleanup_unlock, &m->inner);
 	for (;;)
 	{
-		/* Resolve server IPv4 addresses */
-		while (server_ip == 0)
+		/* Get the cached server IPv4 addresses */
+		if (!maintenance_resolve (m))
 		{
-			/* FIXME: mutex kept while resolving - very bad */
-			int val = getipv4byname (m->server, &server_ip);
-			gettime (&deadline);
-	
-			if (val)
-			{
-				/* DNS resolution failed */
-				syslog (LOG_ERR,
-				        _("Cannot resolve Teredo server address \"%s\": %s"),
-				        m->server, gai_strerror (val));
-			}
-			else
-			if (!is_ipv4_global_unicast (server_ip))
-			{
-				syslog (LOG_ERR,
-				        _("Teredo server has a non global IPv4 address."));
-			}
-			else
-			{
-				/* DNS resolution succeeded */
-				/* Tells Teredo client about the new server's IP */
-				assert (!c_state->up);
-				c_state->addr.teredo.server_ip = server_ip;
-				m->state.cb (c_state, m->state.opaque);
-				break; /* Done! */
-			}
-
 			/* wait some time before next resolution attempt */
+			gettime (&deadline);
 			deadline.tv_sec += m->restart_delay;
-			server_ip = 0;
-			wait_reply_ignore (m, &deadline);
+			(void)wait_reply_ignore (m, &deadline);
+			gettime (&deadline);
+			continue;
 		}
 
-		/* SEND ROUTER SOLICATION */
+		/* SEND ROUTER SOLICATIONS (to all servers at once) */
 		do
 			deadline.tv_sec += m->qualification_delay;
 		while (!checkTimeDrift (&deadline));
 
-		uint8_t nonce[8];
-		teredo_get_nonce (deadline.tv_sec, server_ip, htons (IPPORT_TEREDO),
-		                  nonce);
-		teredo_send_rs (m->fd, server_ip, nonce, false);
+		for (unsigned i = 0; i < MAINTENANCE_SERVERS; i++)
+		{
+			teredo_server *srv = m->servers + i;
 
-		int val = 0;
-		teredo_state newst;
-		newst.mtu = 1280;
-		newst.up = true;
+			srv->answered = false;
+			if (srv->ip == 0)
+				continue;
+
+			teredo_get_nonce (deadline.tv_sec, srv->ip,
+			                  htons (IPPORT_TEREDO), srv->nonce);
+			teredo_send_rs (m->fd, srv->ip, srv->nonce, false);
+		}
+
+		/* RECEIVE ROUTER ADVERTISEMENTS */
+		/* (the first valid one, or the one from the server in use) */
+		bool done = false;
+		int val;
 
-		/* RECEIVE ROUTER ADVERTISEMENT */
 		do
 		{
 			val = wait_reply (m, &deadline);
-			if (val)
-				continue; // time out
-
-			/* check received packet */
-			val = maintenance_recv (m->incoming, server_ip,
-			                        nonce, false, &newst);
-			m->incoming = NULL;
-			pthread_cond_signal (&m->processed);
+			if (val == 0)
+			{
+				int i = maintenance_match (m);
+				done = (i >= 0)
+				    && (!c_state->up || ((unsigned)i == m->active));
+			}
 		}
-		while ((val != 0) && (val != ETIMEDOUT));
+		while (!done && (val == 0));
+
+		if (val == EAGAIN)
+		{
+			/* Network changed: solicits again right away */
+			count = 0;
+			gettime (&deadline);
+			continue;
+		}
+
+		/*
+		 * The server address is part of the Teredo address, so the server
+		 * in use is kept until it has missed as many rounds as it takes to
+		 * declare a loss. Only then does a standby that answered take over,
+		 * unless it gives the very same Teredo address.
+		 */
+		int chosen = -1;
+		if (c_state->up && m->servers[m->active].answered)
+			chosen = m->active;
+		else
+			for (unsigned i = 0; i < MAINTENANCE_SERVERS; i++)
+			{
+				const teredo_server *srv = m->servers + i;
+
+				if (!srv->answered)
+					continue;
+
+				teredo_state newst = srv->state;
+				newst.addr.teredo.flags = c_state->addr.teredo.flags;
+
+				if (!c_state->up
+				 || ((count + 1) >= m->qualification_retries)
+				 || IN6_ARE_ADDR_EQUAL (&c_state->addr.ip6, &newst.addr.ip6))
+				{
+					chosen = i;
+					break;
+				}
+			}
 
 		unsigned delay = 0;
 
 		/* UPDATE FINITE STATE MACHINE */
-		if (val /* == ETIMEDOUT */)
+		if (chosen < 0)
 		{
 			/* no response */
 			count++;
@@ -349,7 +561,6 @@ void maintenance_thread (teredo_maintenance *m)
 					syslog (LOG_NOTICE, _("Lost Teredo connectivity"));
 					c_state->up = false;
 					m->state.cb (c_state, m->state.opaque);
-					server_ip = 0;
 				}
 
 				/* Wait some time before retrying */
@@ -359,8 +570,20 @@ void maintenance_thread (teredo_maintenance *m)
 		else
 		/* RA received and parsed succesfully */
 		{
+			teredo_state newst = m->servers[chosen].state;
+
 			count = 0;
 
+			if (c_state->up && (m->active != (unsigned)chosen))
+			{
+				char buf[INET_ADDRSTRLEN];
+
+				syslog (LOG_NOTICE, _("Switching to Teredo server %s"),
+				        inet_ntop (AF_INET, &m->servers[chosen].ip, buf,
+				                   sizeof (buf)));
+			}
+			m->active = chosen;
+
 			/* 12-bits Teredo flags randomization */
 			newst.addr.teredo.flags = c_state->addr.teredo.flags;
 			if (!IN6_ARE_ADDR_EQUAL (&c_state->addr.ip6, &newst.addr.ip6))
@@ -386,17 +609,18 @@ void maintenance_thread (teredo_maintenance *m)
 		}
 
 		/* WAIT UNTIL NEXT SOLICITATION */
-		/* TODO: watch for new interface events
-		 * (netlink on Linux, PF_ROUTE on BSD) */
+		/* (or until the network changes) */
 		if (delay)
 		{
 			deadline.tv_sec -= m->qualification_delay;
 			deadline.tv_sec += delay;
-			wait_reply_ignore (m, &deadline);
+			if (wait_reply_standby (m, &deadline))
+			{
+				count = 0;
+				gettime (&deadline);
+			}
 		}
 	}
-	/* dead code */
-	pthread_cleanup_pop (1);
 }
 
 
@@ -406,6 +630,44 @@ static LIBTEREDO_NORETURN void *do_maintenance (void *opaque)
 }
 
 
+static void maintenance_servers_stop (teredo_maintenance *m)
+{
+	for (unsigned i = 0; i < MAINTENANCE_SERVERS; i++)
+	{
+		teredo_server *srv = m->servers + i;
+
+		if (srv->resolver != NULL)
+			teredo_resolver_stop (srv->resolver);
+		free (srv->name);
+	}
+}
+
+
+static int maintenance_servers_start (teredo_maintenance *m,
+                                      const char *s1, const char *s2)
+{
+	const char *names[MAINTENANCE_SERVERS] = { s1, s2 };
+
+	for (unsigned i = 0; i < MAINTENANCE_SERVERS; i++)
+	{
+		teredo_server *srv = m->servers + i;
+
+		if (names[i] == NULL)
+			continue;
+
+		srv->name = strdup (names[i]);
+		if ((srv->name == NULL)
+		 || ((srv->resolver = teredo_resolver_start (srv->name,
+		                                             NULL)) == NULL))
+		{
+			maintenance_servers_stop (m);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+
 static const unsigned QualificationDelay = 4; // seconds
 static const unsigned QualificationRetries = 3;
 
@@ -429,15 +691,14 @@ teredo_maintenance_start (int fd, teredo_state_cb cb, void *opaque,
 	m->state.opaque = opaque;
 
 	assert (s1 != NULL);
-	m->server = strdup (s1);
-	(void)s2;
 
 	m->qualification_delay = q_sec ?: QualificationDelay;
 	m->qualification_retries = q_retries ?: QualificationRetries;
 	m->refresh_delay = refresh_sec ?: RefreshDelay;
 	m->restart_delay = restart_sec ?: RestartDelay;
 
-	if (m->server == NULL)
+	/* Resolves the server names in the background */
+	if (maintenance_servers_start (m, s1, s2))
 	{
 		free (m);
 		return NULL;
@@ -454,7 +715,6 @@ teredo_maintenance_start (int fd, teredo_state_cb cb, void *opaque,
 		pthread_condattr_destroy (&attr);
 	}
 
-	pthread_cond_init (&m->processed, NULL);
 	pthread_mutex_init (&m->outer, NULL);
 	pthread_mutex_init (&m->inner, NULL);
 
@@ -465,12 +725,11 @@ teredo_maintenance_start (int fd, teredo_state_cb cb, void *opaque,
 	errno = err;
 	syslog (LOG_ALERT, _("Error (%s): %m"), "pthread_create");
 
-	pthread_cond_destroy (&m->processed);
 	pthread_cond_destroy (&m->received);
 	pthread_mutex_destroy (&m->outer);
 	pthread_mutex_destroy (&m->inner);
 
-	free (m->server);
+	maintenance_servers_stop (m);
 	free (m);
 	return NULL;
 }
@@ -481,12 +740,11 @@ void teredo_maintenance_stop (teredo_maintenance *m)
 	pthread_cancel (m->thread);
 	pthread_join (m->thread, NULL);
 
-	pthread_cond_destroy (&m->processed);
 	pthread_cond_destroy (&m->received);
 	pthread_mutex_destroy (&m->inner);
 	pthread_mutex_destroy (&m->outer);
 
-	free (m->server);
+	maintenance_servers_stop (m);
 	free (m);
 }
 
@@ -507,19 +765,51 @@ int teredo_maintenance_process (teredo_maintenance *restrict m,
 	 || !IN6_ARE_ADDR_EQUAL (&packet->ip6->ip6_dst, &teredo_restrict))
 		return -1;
 
+	if (packet->ip6_len > MAINTENANCE_RA_SIZE)
+		return 0; /* dropped: not a sensible router advertisement */
+
+	/* Copies the packet, unless the maintenance thread is lagging */
 	pthread_mutex_lock (&m->outer);
-	pthread_mutex_lock (&m->inner);
+	unsigned long tail = m->tail;
+	bool full = (tail - teredo_atomic_load_acquire (&m->head))
+	            >= MAINTENANCE_QUEUE_SIZE;
 
-	m->incoming = packet;
-	pthread_cond_signal (&m->received);
+	if (!full)
+	{
+		teredo_ra *ra = m->queue + (tail & (MAINTENANCE_QUEUE_SIZE - 1));
+
+		ra->ip6_len = packet->ip6_len;
+		memcpy (ra->buf.fill, packet->ip6, packet->ip6_len);
+		ra->orig_ipv4 = packet->orig_ipv4;
+		ra->dest_ipv4 = packet->dest_ipv4;
+		ra->auth_fail = packet->auth_fail;
+		memcpy (ra->auth_nonce, packet->auth_nonce, sizeof (ra->auth_nonce));
+		teredo_atomic_store_release (&m->tail, tail + 1);
+	}
+	pthread_mutex_unlock (&m->outer);
 
-	/* Waits for maintenance thread to process packet... */
-	do
-		pthread_cond_wait (&m->processed, &m->inner);
-	while (m->incoming != NULL);
+	if (full)
+	{
+		debug ("Router advertisement dropped (maintenance busy)");
+		return 0;
+	}
 
+	/* Wakes the maintenance thread up */
+	pthread_mutex_lock (&m->inner);
+	pthread_cond_signal (&m->received);
 	pthread_mutex_unlock (&m->inner);
-	pthread_mutex_unlock (&m->outer);
 
 	return 0;
 }
+
+
+void teredo_maintenance_requalify (teredo_maintenance *m)
+{
+	assert (m != NULL);
+
+	teredo_atomic_store (&m->requalify, true);
+
+	pthread_mutex_lock (&m->inner);
+	pthread_cond_signal (&m->received);
+	pthread_mutex_unlock (&m->inner);
+}
@@ -65,8 +65,11 @@ typedef void (*teredo_state_cb) (const struct teredo_state *s, void *opaque);
  * @param fd socket to send router solicitation with
  * @param cb status change notification callback
  * @param opaque data for @a cb callback
- * @param s1 primary server address/hostname
- * @param s2 secondary server address/hostname
+ * @param s1 primary server address/hostname (resolved in the background,
+ *           and again whenever its DNS time-to-live expires)
+ * @param s2 secondary server address/hostname, or NULL for the primary
+ *           server address plus one (router solicitations are sent to both
+ *           at once, the other one being kept as a hot standby)
  * @param q_sec qualification time out (seconds), 0 = default
  * @param q_retries qualification retries, 0 = default
  * @param refresh_sec qualification refresh interval (seconds), 0 = default
@@ -91,13 +94,22 @@ void teredo_maintenance_stop (teredo_maintenance *m);
 
 /**
  * Passes a Teredo packet to a maintenance thread for processing.
+ * The packet is copied and queued, so this never waits for the maintenance
+ * thread; packets are dropped if too many are already pending.
  * Thread-safe, not async-cancel safe.
  *
- * @return 0 if processed, -1 if not a valid router solicitation.
+ * @return 0 if queued (or dropped), -1 if not a valid router solicitation.
  */
 int teredo_maintenance_process (teredo_maintenance *restrict m,
                                 const teredo_packet *restrict packet);
 
+/**
+ * Requests immediate qualification, typically after a network configuration
+ * change, instead of waiting for the next refresh. Thread-safe, never
+ * waits for the maintenance thread.
+ */
+void teredo_maintenance_requalify (teredo_maintenance *m);
+
 # ifdef __cplusplus
 }
 # endif
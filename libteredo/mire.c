@@ -91,10 +91,11 @@ process_icmpv6 (int fd, struct ip6_hdr *ip6, size_t plen,
 	ip6->ip6_dst = ip6->ip6_src;
 	ip6->ip6_src = buf;;
 
+	/* Swapping the addresses leaves the checksum unchanged */
+	const uint8_t old[2] = { hdr->icmp6_type, hdr->icmp6_code };
 	hdr->icmp6_type = ICMP6_ECHO_REPLY;
 	hdr->icmp6_code = 0;
-	hdr->icmp6_cksum = 0;
-	hdr->icmp6_cksum = icmp6_checksum (ip6, hdr);
+	hdr->icmp6_cksum = teredo_cksum_adjust (hdr->icmp6_cksum, old, hdr, 2);
 
 	teredo_send (fd, ip6, sizeof (*ip6) + plen, ipv4, port);
 }
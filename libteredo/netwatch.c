@@ -0,0 +1,199 @@
+/*
+ * netwatch.c - Network configuration change notifications
+ */
+
+/***********************************************************************
+ *  Copyright © 2007 Rémi Denis-Courmont.                              *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdbool.h>
+#include <stdlib.h> /* malloc(), free() */
+#include <inttypes.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h> /* AF_INET */
+#include <unistd.h> /* close() */
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#ifdef HAVE_LINUX_RTNETLINK_H
+# include <linux/netlink.h>
+# include <linux/rtnetlink.h>
+#endif
+
+#include "iothread.h"
+#include "netwatch.h"
+#include "debug.h"
+
+/* Quiet time after a change before reporting it (milliseconds) */
+#define NETWATCH_SETTLE_MS 50
+
+struct teredo_netwatch
+{
+	teredo_iothread *thread;
+	teredo_netwatch_cb cb;
+	void *opaque;
+};
+
+
+bool teredo_netwatch_filter (const void *buf, size_t len)
+{
+#ifdef HAVE_LINUX_RTNETLINK_H
+	for (const struct nlmsghdr *nh = buf; NLMSG_OK (nh, len);
+	     nh = NLMSG_NEXT (nh, len))
+	{
+		switch (nh->nlmsg_type)
+		{
+			case RTM_NEWADDR:
+			case RTM_DELADDR:
+			{
+				const struct ifaddrmsg *ifa = NLMSG_DATA (nh);
+
+				if (nh->nlmsg_len < NLMSG_LENGTH (sizeof (*ifa)))
+					break;
+				/* loopback addresses are irrelevant */
+				if ((ifa->ifa_family == AF_INET)
+				 && (ifa->ifa_scope != RT_SCOPE_HOST))
+					return true;
+				break;
+			}
+
+			case RTM_NEWROUTE:
+			case RTM_DELROUTE:
+			{
+				const struct rtmsg *rtm = NLMSG_DATA (nh);
+
+				if (nh->nlmsg_len < NLMSG_LENGTH (sizeof (*rtm)))
+					break;
+				if ((rtm->rtm_family == AF_INET)
+				 && (rtm->rtm_dst_len == 0)
+				 && (rtm->rtm_table == RT_TABLE_MAIN)
+				 && (rtm->rtm_type == RTN_UNICAST))
+					return true;
+				break;
+			}
+		}
+	}
+#else
+	(void)buf;
+	(void)len;
+#endif
+	return false;
+}
+
+
+#ifdef HAVE_LINUX_RTNETLINK_H
+/**
+ * Receives pending routing messages.
+ * @return true if any of them is relevant, or if some were lost.
+ */
+static bool netwatch_recv (int fd, int flags)
+{
+	union
+	{
+		struct nlmsghdr hdr;
+		uint8_t buf[8192];
+	} msg;
+
+	ssize_t len = recv (fd, msg.buf, sizeof (msg.buf), flags);
+	if (len < 0)
+		return errno == ENOBUFS; /* overflow: assume the worst */
+
+	return teredo_netwatch_filter (msg.buf, len);
+}
+
+
+static LIBTEREDO_NORETURN void *netwatch_thread (void *opaque, int fd)
+{
+	teredo_netwatch *w = (teredo_netwatch *)opaque;
+
+	for (;;)
+	{
+		if (!netwatch_recv (fd, 0))
+			continue;
+
+		/* Waits for the burst of changes to settle */
+		struct pollfd ufd = { .fd = fd, .events = POLLIN };
+		while (poll (&ufd, 1, NETWATCH_SETTLE_MS) > 0)
+			netwatch_recv (fd, MSG_DONTWAIT);
+
+		debug ("Network configuration changed");
+
+		int state;
+		pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, &state);
+		w->cb (w->opaque);
+		pthread_setcancelstate (state, NULL);
+	}
+}
+#endif
+
+
+teredo_netwatch *teredo_netwatch_start (teredo_netwatch_cb cb, void *opaque)
+{
+#ifdef HAVE_LINUX_RTNETLINK_H
+	teredo_netwatch *w = malloc (sizeof (*w));
+	if (w == NULL)
+		return NULL;
+
+	int fd = socket (AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+	if (fd == -1)
+	{
+		free (w);
+		return NULL;
+	}
+	fcntl (fd, F_SETFD, FD_CLOEXEC);
+
+	struct sockaddr_nl addr =
+	{
+		.nl_family = AF_NETLINK,
+		.nl_groups = RTMGRP_IPV4_IFADDR | RTMGRP_IPV4_ROUTE
+	};
+
+	if (bind (fd, (struct sockaddr *)&addr, sizeof (addr)))
+	{
+		debug ("Cannot watch for network changes: %m");
+		close (fd);
+		free (w);
+		return NULL;
+	}
+
+	w->cb = cb;
+	w->opaque = opaque;
+	w->thread = teredo_iothread_start (netwatch_thread, w, fd);
+	if (w->thread != NULL)
+		return w;
+
+	close (fd);
+	free (w);
+#else
+	(void)cb;
+	(void)opaque;
+#endif
+	return NULL;
+}
+
+
+void teredo_netwatch_stop (teredo_netwatch *w)
+{
+	teredo_iothread_stop (w->thread, true);
+	free (w);
+}
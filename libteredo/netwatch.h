@@ -0,0 +1,70 @@
+/**
+ * @file netwatch.h
+ * @brief Network configuration change notifications
+ *
+ * Watches for IPv4 address and default route changes, so that the Teredo
+ * client can qualify again as soon as the network changes, rather than at
+ * the next refresh. Only rtnetlink (Linux) is supported at the moment.
+ */
+
+/***********************************************************************
+ *  Copyright © 2007 Rémi Denis-Courmont.                              *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifndef LIBTEREDO_NETWATCH_H
+# define LIBTEREDO_NETWATCH_H
+
+typedef struct teredo_netwatch teredo_netwatch;
+
+/**
+ * Network change callback, run from the watcher thread. Cancellation is
+ * disabled while it runs, so it may take locks and join threads.
+ */
+typedef void (*teredo_netwatch_cb) (void *opaque);
+
+# ifdef __cplusplus
+extern "C" {
+# endif
+
+/**
+ * Starts watching for network configuration changes. Bursts of changes
+ * (e.g. a new address followed by a new default route) are reported once.
+ *
+ * @param cb callback invoked after a change
+ * @param opaque pointer passed to @p cb
+ *
+ * @return NULL on error, or if not supported on this system.
+ */
+teredo_netwatch *teredo_netwatch_start (teredo_netwatch_cb cb, void *opaque);
+
+/**
+ * Stops watching for network changes.
+ */
+void teredo_netwatch_stop (teredo_netwatch *w);
+
+/**
+ * Tests whether routing socket messages report a change that affects the
+ * Teredo client: an IPv4 address, or an IPv4 default route.
+ *
+ * @param buf messages as received from the routing socket
+ * @param len byte length of @p buf
+ */
+bool teredo_netwatch_filter (const void *buf, size_t len);
+
+# ifdef __cplusplus
+}
+# endif /* ifdef __cplusplus */
+#endif /* ifndef LIBTEREDO_NETWATCH_H */
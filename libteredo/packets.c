@@ -91,7 +91,7 @@ SendBubbleFromDst (int fd, const struct in6_addr *dst, bool indirect)
 	struct in6_addr src;
 	memcpy (src.s6_addr, "\xfe\x80\x00\x00\x00\x00\x00\x00", 8);
 	/* TODO: use some time information */
-	teredo_get_nonce (0, ip, port, src.s6_addr + 8);
+	teredo_get_cookie (ip, port, src.s6_addr + 8);
 	src.s6_addr[8] &= 0xfc; /* Modified EUI-64 */
 
 	if (indirect)
@@ -109,9 +109,9 @@ int CheckBubble (const teredo_packet *packet)
 	const struct ip6_hdr *ip6 = packet->ip6;
 	const struct in6_addr *me = &ip6->ip6_dst, *it = &ip6->ip6_src;
 
-	uint8_t hash[8];
+	uint8_t hash[LIBTEREDO_COOKIE_LEN];
 	/* TODO: use some time information */
-	teredo_get_nonce (0, IN6_TEREDO_IPV4 (it), IN6_TEREDO_PORT (it), hash);
+	teredo_get_cookie (IN6_TEREDO_IPV4 (it), IN6_TEREDO_PORT (it), hash);
 	hash[0] &= 0xfc; /* Modified EUI-64: non-global, non-group address */
 
 	return memcmp (hash, me->s6_addr + 8, 8) ? -1 : 0;
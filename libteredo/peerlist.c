@@ -27,6 +27,8 @@
 #include <string.h>
 #include <time.h>
 #include <stdlib.h> /* malloc() / free() */
+#include <stddef.h> /* offsetof() */
+#include <limits.h> /* UINT_MAX */
 #include <assert.h>
 
 #include <inttypes.h>
@@ -35,19 +37,19 @@
 #include <netinet/in.h>
 #include <pthread.h>
 #include <errno.h>
-
-#ifndef NDEBUG
-# define JUDYERROR_NOTEST 1
-#endif
-#ifdef HAVE_JUDY_H
-# include <Judy.h>
-#endif
+#include <unistd.h> /* _POSIX_MONOTONIC_CLOCK */
 
 #include "teredo.h"
 #include "teredo-udp.h" // FIXME: ugly
 #include "debug.h"
 #include "clock.h"
 #include "peerlist.h"
+#include "security.h"
+#include "siphash.h"
+#include "pool.h"
+#include "atomic.h"
+#include "ebr.h"
+#include "hashtable.h"
 
 /*
  * Packets queueing
@@ -55,6 +57,8 @@
 struct teredo_queue
 {
 	teredo_queue *next;
+	teredo_pool *pool;
+	struct teredo_peerlist *list; /* charged for the packet bytes */
 	size_t length;
 	uint32_t ipv4;
 	uint16_t port;
@@ -62,13 +66,33 @@ struct teredo_queue
 	uint8_t data[];
 };
 
-static const unsigned teredo_MaxQueueBytes = 1280;
+/* Queued packets buffers size classes */
+#define TEREDO_QUEUE_CLASSES 3
+static const size_t queue_class_size[TEREDO_QUEUE_CLASSES] =
+	{ 128, 512, MAXQUEUE };
+
+/* Queued outgoing packets sent per system call */
+#define TEREDO_EMIT_BATCH 32
+
+static teredo_pool *teredo_peer_pool (teredo_peer *peer, size_t len);
+static struct teredo_peerlist *teredo_peer_list (teredo_peer *peer);
+static bool teredo_queue_charge (struct teredo_peerlist *l,
+                                 const teredo_peer *peer, size_t len);
+static void teredo_queue_uncharge (struct teredo_peerlist *l, size_t len);
 
 
 static inline void teredo_peer_init (teredo_peer *peer)
 {
-	peer->queue = NULL;
-	peer->queue_left = teredo_MaxQueueBytes;
+	peer->queue = peer->queue_last = NULL;
+	peer->queue_bytes = 0;
+	peer->last_rx = peer->last_tx = 0;
+}
+
+
+static void teredo_queue_free (teredo_queue *q)
+{
+	teredo_queue_uncharge (q->list, q->length);
+	teredo_pool_free (q->pool, q);
 }
 
 
@@ -81,7 +105,7 @@ static inline void teredo_peer_destroy (teredo_peer *peer)
 		teredo_queue *buf;
 
 		buf = p->next;
-		free (p);
+		teredo_queue_free (p);
 		p = buf;
 	}
 }
@@ -93,19 +117,37 @@ static void teredo_peer_queue (teredo_peer *restrict peer,
 {
 	teredo_queue *p;
 
-	if (len > peer->queue_left)
+	if (len > MAXQUEUE)
 		return;
-	peer->queue_left -= len;
 
-	p = (teredo_queue *)malloc (sizeof (*p) + len);
+	struct teredo_peerlist *l = teredo_peer_list (peer);
+	if (!teredo_queue_charge (l, peer, len))
+		return;
+
+	teredo_pool *pool = teredo_peer_pool (peer, len);
+	p = (teredo_queue *)teredo_pool_alloc (pool);
+	if (p == NULL)
+	{
+		teredo_queue_uncharge (l, len);
+		return;
+	}
+	peer->queue_bytes += len;
+
+	p->pool = pool;
+	p->list = l;
 	p->length = len;
 	memcpy (p->data, data, len);
 	p->ipv4 = ip;
 	p->port = port;
 	p->incoming = incoming;
 
-	p->next = peer->queue;
-	peer->queue = p;
+	/* appends, so that packets are sent in order */
+	p->next = NULL;
+	if (peer->queue_last != NULL)
+		peer->queue_last->next = p;
+	else
+		peer->queue = p;
+	peer->queue_last = p;
 }
 
 
@@ -126,8 +168,8 @@ void teredo_enqueue_out (teredo_peer *restrict peer,
 teredo_queue *teredo_peer_queue_yield (teredo_peer *peer)
 {
 	teredo_queue *q = peer->queue;
-	peer->queue = NULL;
-	peer->queue_left = teredo_MaxQueueBytes;
+	peer->queue = peer->queue_last = NULL;
+	peer->queue_bytes = 0;
 	return q;
 }
 
@@ -135,6 +177,10 @@ teredo_queue *teredo_peer_queue_yield (teredo_peer *peer)
 void teredo_queue_emit (teredo_queue *q, int fd, uint32_t ipv4, uint16_t port,
                         teredo_dequeue_cb cb, void *opaque)
 {
+	struct iovec iov[TEREDO_EMIT_BATCH];
+	teredo_queue *out[TEREDO_EMIT_BATCH];
+	unsigned n = 0;
+
 	while (q != NULL)
 	{
 		teredo_queue *buf;
@@ -144,10 +190,22 @@ void teredo_queue_emit (teredo_queue *q, int fd, uint32_t ipv4, uint16_t port,
 		{
 			if ((ipv4 == q->ipv4) && (port == q->port))
 				cb (opaque, q->data, q->length);
+			teredo_queue_free (q);
 		}
 		else
-			teredo_send (fd, q->data, q->length, ipv4, port);
-		free (q);
+		{
+			/* outgoing packets are sent together, once they are gathered */
+			iov[n].iov_base = q->data;
+			iov[n].iov_len = q->length;
+			out[n++] = q;
+		}
+
+		if ((n == TEREDO_EMIT_BATCH) || ((buf == NULL) && (n > 0)))
+		{
+			teredo_send_many (fd, iov, n, ipv4, port);
+			while (n > 0)
+				teredo_queue_free (out[--n]);
+		}
 		q = buf;
 	}
 }
@@ -157,28 +215,253 @@ void teredo_queue_emit (teredo_queue *q, int fd, uint32_t ipv4, uint16_t port,
 typedef struct teredo_listitem
 {
 	struct teredo_listitem **pprev, *next;
+	struct teredo_stripe *stripe;
 	teredo_peer peer;
 	union teredo_addr key;
+	uint32_t hash;
+	teredo_clock_t atime; /* last lookup (atomic) */
+	uint16_t src_bucket, net_bucket; /* admission quotas buckets */
+	bool charged; /* counted as an untrusted admission */
+	bool dead; /* removed from the index (atomic) */
+	uint64_t fastmap; /* lock-less lookup mapping (atomic) */
+	teredo_ebr_node ebr;
 } teredo_listitem;
 
+/*
+ * The list is split into stripes (selected from the peer address), each
+ * with its own lock, timing wheel and index, so that lookups for different
+ * peers do not serialize on a single lock.
+ */
+#define TEREDO_LIST_STRIPES 16 /* must be a power of two */
+
+/* Number of peer entries preallocated when creating a list */
+#define TEREDO_LIST_PREALLOC 1024
+/* Extra pool room per stripe, for small lists */
+#define TEREDO_POOL_SLACK 16
+
+/*
+ * Peers are expired with a hashed timing wheel: each peer is linked into
+ * the slot of its expiration deadline, and the garbage collector only
+ * examines the slots whose time has come, a bounded number of peers at a
+ * time. Lookups only stamp the peer (CLOCK-like reference), and peers
+ * whose deadline was pushed back since they were filed are moved to the
+ * right slot by the garbage collector, so that a lookup hit only writes to
+ * the peer itself.
+ */
+#define TEREDO_WHEEL_SLOTS 64 /* must be a power of two */
+#define TEREDO_SWEEP_BATCH 256 /* peers examined per stripe lock hold */
+
+/*
+ * Admission control: peers created by teredo_list_admit() count against
+ * quotas until they are trusted, so that spoofed traffic cannot fill the
+ * list and push out real peers. Sources and networks are hashed into
+ * buckets of counters, which is approximate but bounded in memory.
+ */
+#define TEREDO_ADMIT_BUCKETS 4096 /* must be a power of two */
+#define TEREDO_ADMIT_NONE UINT16_MAX
+#define TEREDO_ADMIT_SOURCE_QUOTA 256 /* untrusted peers per source */
+#define TEREDO_ADMIT_NET_QUOTA 64 /* untrusted peers per IPv4 /24 */
+#define TEREDO_EVICT_SCAN 64 /* peers examined to find a victim */
+
+/*
+ * Membership filter: a counting Bloom filter of the listed peers, which
+ * can be checked without locking the list to drop packets from unknown
+ * sources early. It is sized when the list is created.
+ */
+#define TEREDO_FILTER_HASHES 3
+#define TEREDO_FILTER_RATIO 8 /* counters per peer */
+#define TEREDO_FILTER_MIN 1024 /* must be a power of two */
+#define TEREDO_FILTER_MAX (1 << 22) /* must be a power of two */
+
+typedef struct teredo_stripe
+{
+	struct teredo_peerlist *list;
+	pthread_mutex_t lock;
+	teredo_listitem *wheel[TEREDO_WHEEL_SLOTS];
+	teredo_listitem *sweep; /* peers of the slot being swept */
+	unsigned long swept; /* last swept slot number */
+	teredo_clock_t now; /* time of the last sweep */
+	teredo_htab index;
+	/* entries and queued packets are allocated from per-stripe pools */
+	teredo_pool *items;
+	teredo_pool *queues[TEREDO_QUEUE_CLASSES];
+} teredo_stripe;
+
 struct teredo_peerlist
 {
-	teredo_listitem *recent, *old;
-	unsigned left;
+	unsigned left, max;
 	unsigned expiration;
+	unsigned tick; /* timing wheel slot duration (seconds) */
 	pthread_t gc;
-	pthread_mutex_t lock;
-#ifdef HAVE_LIBJUDY
-	Pvoid_t PJHSArray;
-#endif
+	pthread_mutex_t lock; /* protects left, admission and statistics;
+	                       * nests inside stripe locks */
+	unsigned long expired;
+	unsigned long max_pause;
+	unsigned untrusted, max_untrusted;
+	unsigned long evicted, refused_source, refused_net, refused_full;
+	uint16_t src_count[TEREDO_ADMIT_BUCKETS];
+	uint16_t net_count[TEREDO_ADMIT_BUCKETS];
+	uint16_t *filter; /* membership filter counters (atomic) */
+	uint32_t filter_mask;
+	size_t queue_peer, queue_total; /* queued bytes budgets (atomic) */
+	size_t queued_bytes; /* queued bytes (atomic) */
+	unsigned long queue_dropped; /* packets over budget (atomic) */
+	uint8_t key[TEREDO_SIPHASH_KEY_LEN];
+	teredo_stripe stripes[TEREDO_LIST_STRIPES];
 };
 
 
-static inline teredo_listitem *listitem_create (void)
+/* Peer returned by teredo_list_lookup() in the calling thread */
+static pthread_key_t held_key;
+static pthread_once_t held_once = PTHREAD_ONCE_INIT;
+
+static void held_key_create (void)
+{
+	(void)pthread_key_create (&held_key, NULL);
+}
+
+
+/**
+ * Hashes a peer address with the list secret key, so that remote hosts
+ * cannot choose colliding addresses.
+ *
+ * @param hash [OUT] hash value for the stripe index
+ * @return the stripe of the peer.
+ */
+static inline teredo_stripe *
+stripe_get (teredo_peerlist *restrict l, const struct in6_addr *restrict addr,
+            uint32_t *restrict hash)
+{
+	uint64_t h = teredo_siphash (l->key, addr, sizeof (*addr));
+
+	*hash = (uint32_t)h;
+	return l->stripes + ((h >> 32) & (TEREDO_LIST_STRIPES - 1));
+}
+
+
+/**
+ * Computes the membership filter counters of a peer from its hash.
+ */
+static inline void
+filter_slots (const teredo_peerlist *l, uint32_t hash,
+              uint32_t slots[TEREDO_FILTER_HASHES])
+{
+	uint32_t delta = ((hash >> 16) | (hash << 16)) | 1;
+
+	for (unsigned i = 0; i < TEREDO_FILTER_HASHES; i++)
+	{
+		slots[i] = hash & l->filter_mask;
+		hash += delta;
+	}
+}
+
+
+static void filter_add (teredo_peerlist *l, uint32_t hash)
 {
-	teredo_listitem *entry = malloc (sizeof (*entry));
+	uint32_t slots[TEREDO_FILTER_HASHES];
+
+	filter_slots (l, hash, slots);
+	for (unsigned i = 0; i < TEREDO_FILTER_HASHES; i++)
+		teredo_atomic_add (l->filter + slots[i], 1);
+}
+
+
+static void filter_remove (teredo_peerlist *l, uint32_t hash)
+{
+	uint32_t slots[TEREDO_FILTER_HASHES];
+
+	filter_slots (l, hash, slots);
+	for (unsigned i = 0; i < TEREDO_FILTER_HASHES; i++)
+	{
+		assert (teredo_atomic_load (l->filter + slots[i]) > 0);
+		teredo_atomic_sub (l->filter + slots[i], 1);
+	}
+}
+
+
+/**
+ * @return the number of membership filter counters for a list.
+ */
+static uint32_t filter_size (unsigned max)
+{
+	uint32_t n = TEREDO_FILTER_MIN;
+
+	while ((n < TEREDO_FILTER_MAX) && (n / TEREDO_FILTER_RATIO < max))
+		n <<= 1;
+	return n;
+}
+
+
+/**
+ * @return the list of a peer.
+ */
+static struct teredo_peerlist *teredo_peer_list (teredo_peer *peer)
+{
+	teredo_listitem *entry = (teredo_listitem *)
+		(((uint8_t *)peer) - offsetof (teredo_listitem, peer));
+
+	return entry->stripe->list;
+}
+
+
+/**
+ * Checks a packet against the queued bytes budget of a peer, and charges it
+ * against the budget of the list.
+ * @return false if either budget is exhausted.
+ */
+static bool teredo_queue_charge (struct teredo_peerlist *l,
+                                 const teredo_peer *peer, size_t len)
+{
+	if (peer->queue_bytes + len > teredo_atomic_load (&l->queue_peer))
+		goto drop;
+
+	if (teredo_atomic_add_fetch (&l->queued_bytes, len)
+	     > teredo_atomic_load (&l->queue_total))
+	{
+		teredo_queue_uncharge (l, len);
+		goto drop;
+	}
+	return true;
+
+drop:
+	teredo_atomic_add (&l->queue_dropped, 1);
+	return false;
+}
+
+
+static void teredo_queue_uncharge (struct teredo_peerlist *l, size_t len)
+{
+	teredo_atomic_sub (&l->queued_bytes, len);
+}
+
+
+/**
+ * Selects the pool for a packet queued to a peer.
+ */
+static teredo_pool *teredo_peer_pool (teredo_peer *peer, size_t len)
+{
+	teredo_listitem *entry = (teredo_listitem *)
+		(((uint8_t *)peer) - offsetof (teredo_listitem, peer));
+	unsigned i = 0;
+
+	assert (len <= queue_class_size[TEREDO_QUEUE_CLASSES - 1]);
+	while (len > queue_class_size[i])
+		i++;
+	return entry->stripe->queues[i];
+}
+
+
+static inline teredo_listitem *listitem_create (teredo_stripe *s)
+{
+	teredo_listitem *entry = teredo_pool_alloc (s->items);
 	if (entry != NULL)
+	{
+		entry->stripe = s;
+		entry->charged = false;
+		entry->dead = false;
+		entry->fastmap = 0;
 		teredo_peer_init (&entry->peer);
+	}
 	return entry;
 }
 
@@ -186,22 +469,288 @@ static inline teredo_listitem *listitem_create (void)
 static inline void listitem_destroy (teredo_listitem *entry)
 {
 	teredo_peer_destroy (&entry->peer);
-	free (entry);
+	teredo_pool_free (entry->stripe->items, entry);
+}
+
+
+static void listitem_release (teredo_ebr_node *node)
+{
+	listitem_destroy ((teredo_listitem *)
+		(((uint8_t *)node) - offsetof (teredo_listitem, ebr)));
 }
 
 
-static void listitem_recdestroy (teredo_listitem *entry)
+/**
+ * Destroys removed peers once lock-less readers cannot see them anymore.
+ */
+static void listitem_retire (teredo_listitem *entry)
 {
 	while (entry != NULL)
 	{
 		teredo_listitem *buf = entry->next;
-		listitem_destroy (entry);
+		teredo_ebr_retire (&entry->ebr, listitem_release);
 		entry = buf;
 	}
 }
 
 
-#include <sched.h>
+/**
+ * @return the maximum number of objects of each of @a parts pools sharing
+ * the room for @a max peers. Removed peers are only released once
+ * lock-less readers cannot see them anymore, and peers are not spread
+ * perfectly evenly across stripes, so each pool gets a bit more than its
+ * share.
+ */
+static inline unsigned pool_limit (unsigned max, unsigned parts)
+{
+	uint64_t limit = ((uint64_t)max + parts - 1) / parts;
+
+	limit += limit / 2 + TEREDO_POOL_SLACK;
+	return (limit > UINT_MAX) ? UINT_MAX : limit;
+}
+
+
+/**
+ * Sets the limits of the memory pools of a stripe.
+ */
+static void stripe_limit (teredo_stripe *s, unsigned max)
+{
+	teredo_pool_limit (s->items, pool_limit (max, TEREDO_LIST_STRIPES));
+	for (unsigned i = 0; i < TEREDO_QUEUE_CLASSES; i++)
+		teredo_pool_limit (s->queues[i],
+		                   pool_limit (max, TEREDO_LIST_STRIPES
+		                                    * TEREDO_QUEUE_CLASSES));
+}
+
+
+/**
+ * Initializes a stripe and its memory pools.
+ * @param max maximum number of peers in the list
+ * @return 0 on success, -1 on memory error.
+ */
+static int stripe_init (teredo_peerlist *l, teredo_stripe *s, unsigned max)
+{
+	unsigned prealloc = (max < TEREDO_LIST_PREALLOC)
+		? max : TEREDO_LIST_PREALLOC;
+	prealloc = (prealloc + TEREDO_LIST_STRIPES - 1) / TEREDO_LIST_STRIPES;
+
+	/* The list maximum is shared by the stripes and the queue classes */
+	s->items = teredo_pool_create (sizeof (teredo_listitem), prealloc,
+	                               pool_limit (max, TEREDO_LIST_STRIPES));
+	if (s->items == NULL)
+		return -1;
+
+	unsigned queue_max = pool_limit (max, TEREDO_LIST_STRIPES
+	                                      * TEREDO_QUEUE_CLASSES);
+
+	for (unsigned i = 0; i < TEREDO_QUEUE_CLASSES; i++)
+	{
+		s->queues[i] = teredo_pool_create (sizeof (teredo_queue)
+		                                   + queue_class_size[i],
+		                                   prealloc / 8, queue_max);
+		if (s->queues[i] == NULL)
+		{
+			while (i > 0)
+				teredo_pool_destroy (s->queues[--i]);
+			teredo_pool_destroy (s->items);
+			return -1;
+		}
+	}
+
+	s->list = l;
+	pthread_mutex_init (&s->lock, NULL);
+	for (unsigned i = 0; i < TEREDO_WHEEL_SLOTS; i++)
+		s->wheel[i] = NULL;
+	s->sweep = NULL;
+	s->now = teredo_clock ();
+	s->swept = s->now / l->tick - 1;
+	teredo_htab_init (&s->index, offsetof (teredo_listitem, key));
+	s->index.release = teredo_ebr_free;
+	return 0;
+}
+
+
+/**
+ * Releases the resources of an empty stripe.
+ */
+static void stripe_deinit (teredo_stripe *s)
+{
+	for (unsigned i = 0; i < TEREDO_QUEUE_CLASSES; i++)
+		teredo_pool_destroy (s->queues[i]);
+	teredo_pool_destroy (s->items);
+	pthread_mutex_destroy (&s->lock);
+}
+
+
+/**
+ * @return the time after which a peer can be removed from the list.
+ * Peers are kept at least @a expiration seconds after their last lookup,
+ * reception or transmission (plus one second for the clock resolution).
+ */
+static inline teredo_clock_t
+listitem_deadline (const teredo_peerlist *l, const teredo_listitem *p)
+{
+	teredo_clock_t last = teredo_atomic_load (&p->atime);
+	teredo_clock_t rx = teredo_atomic_load (&p->peer.last_rx);
+	teredo_clock_t tx = teredo_atomic_load (&p->peer.last_tx);
+
+	if (rx > last)
+		last = rx;
+	if (tx > last)
+		last = tx;
+	return last + l->expiration + 1;
+}
+
+
+/**
+ * Links a peer into the timing wheel slot of its deadline.
+ */
+static void wheel_link (const teredo_peerlist *l, teredo_stripe *s,
+                        teredo_listitem *p)
+{
+	unsigned long slot = listitem_deadline (l, p) / l->tick;
+	teredo_listitem **head = s->wheel + (slot & (TEREDO_WHEEL_SLOTS - 1));
+
+	p->next = *head;
+	if (p->next != NULL)
+		p->next->pprev = &p->next;
+	*head = p;
+	p->pprev = head;
+
+	assert (*(p->pprev) == p);
+	assert ((p->next == NULL) || (p->next->pprev == &p->next));
+}
+
+
+static void wheel_unlink (teredo_listitem *p)
+{
+	assert (*(p->pprev) == p);
+	assert ((p->next == NULL) || (p->next->pprev == &p->next));
+
+	if (p->next != NULL)
+		p->next->pprev = p->pprev;
+	*(p->pprev) = p->next;
+}
+
+
+/**
+ * Removes a peer from the index of its stripe and from the membership
+ * filter.
+ */
+static void stripe_unindex (teredo_peerlist *l, teredo_stripe *s,
+                            teredo_listitem *p)
+{
+	void *item = teredo_htab_remove (&s->index, p->hash, &p->key);
+	assert (item == p);
+	(void)item;
+	teredo_atomic_store (&p->dead, true);
+	filter_remove (l, p->hash);
+}
+
+
+/**
+ * Releases the admission quotas of a peer. Must be called with the peer
+ * stripe lock held, and the list counter lock held.
+ */
+static void listitem_uncharge (teredo_peerlist *l, teredo_listitem *p)
+{
+	if (!p->charged)
+		return;
+
+	assert (l->untrusted > 0);
+	l->untrusted--;
+	if (p->src_bucket != TEREDO_ADMIT_NONE)
+		l->src_count[p->src_bucket]--;
+	if (p->net_bucket != TEREDO_ADMIT_NONE)
+		l->net_count[p->net_bucket]--;
+	p->charged = false;
+}
+
+
+/**
+ * Expires peers from the elapsed slots of a stripe timing wheel.
+ * At most TEREDO_SWEEP_BATCH peers are examined, so that the stripe lock
+ * (which must be held) is not held for too long.
+ *
+ * @param dead [OUT] list of expired peers, to be destroyed by the caller
+ * after the stripe lock is released
+ * @param count [OUT] number of expired peers
+ *
+ * @return true if all elapsed slots were swept, false otherwise.
+ */
+static bool stripe_sweep (teredo_peerlist *l, teredo_stripe *s,
+                          teredo_listitem **restrict dead,
+                          unsigned *restrict count)
+{
+	const teredo_clock_t now = s->now;
+	const unsigned long last = now / l->tick - 1; /* last elapsed slot */
+
+	/* Skips full revolutions if we are really late */
+	if ((s->swept < last) && (last - s->swept > TEREDO_WHEEL_SLOTS))
+		s->swept = last - TEREDO_WHEEL_SLOTS;
+
+	*dead = NULL;
+	*count = 0;
+
+	for (unsigned budget = TEREDO_SWEEP_BATCH; budget > 0; budget--)
+	{
+		teredo_listitem *p = s->sweep;
+
+		if (p == NULL)
+		{
+			/* Detaches the next elapsed slot */
+			if (s->swept >= last)
+				return true;
+
+			s->swept++;
+			teredo_listitem **head =
+				s->wheel + (s->swept & (TEREDO_WHEEL_SLOTS - 1));
+
+			s->sweep = *head;
+			*head = NULL;
+			if (s->sweep != NULL)
+				s->sweep->pprev = &s->sweep;
+			continue;
+		}
+
+		wheel_unlink (p);
+
+		if (listitem_deadline (l, p) >= now)
+		{	/* still alive (deadline pushed back): refiles */
+			wheel_link (l, s, p);
+			continue;
+		}
+
+		stripe_unindex (l, s, p);
+		if (p->charged)
+		{
+			pthread_mutex_lock (&l->lock);
+			listitem_uncharge (l, p);
+			pthread_mutex_unlock (&l->lock);
+		}
+		p->next = *dead;
+		*dead = p;
+		(*count)++;
+	}
+
+	return (s->sweep == NULL) && (s->swept >= last);
+}
+
+
+/**
+ * @return a monotonic time value in microseconds.
+ */
+static unsigned long gc_usec (void)
+{
+	struct timespec ts;
+
+#if (_POSIX_MONOTONIC_CLOCK - 0 >= 0)
+	if (clock_gettime (CLOCK_MONOTONIC, &ts))
+#endif
+		clock_gettime (CLOCK_REALTIME, &ts);
+	return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
 
 /**
  * Peer list garbage collector entry point.
@@ -214,40 +763,83 @@ static LIBTEREDO_NORETURN void *garbage_collector (void *data)
 
 	for (;;)
 	{
-		struct timespec delay = { .tv_sec = l->expiration };
+		/* Sweeps twice per slot */
+		struct timespec delay =
+		{
+			.tv_sec = l->tick / 2,
+			.tv_nsec = (l->tick & 1) ? 500000000 : 0
+		};
 		while (clock_nanosleep (CLOCK_REALTIME, 0, &delay, &delay));
 
 		int state;
 		pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, &state);
 		/* cancel-unsafe section starts */
-		pthread_mutex_lock (&l->lock);
+		teredo_clock_t now = teredo_clock ();
+		unsigned long total = 0, max_pause = 0;
 
-		// remove expired peers from hash table
-		for (teredo_listitem *p = l->old; p != NULL; p = p->next)
+		for (unsigned i = 0; i < TEREDO_LIST_STRIPES; i++)
 		{
-#ifdef HAVE_LIBJUDY
-			int Rc_int;
-			JHSD (Rc_int, l->PJHSArray, (uint8_t *)&p->key, 16);
-			assert (Rc_int);
-#endif
-			l->left++;
+			teredo_stripe *s = l->stripes + i;
+			bool done;
+
+			do
+			{
+				teredo_listitem *dead;
+				unsigned count;
+				unsigned long pause = gc_usec ();
+
+				pthread_mutex_lock (&s->lock);
+				teredo_atomic_store (&s->now, now);
+				done = stripe_sweep (l, s, &dead, &count);
+				pthread_mutex_unlock (&s->lock);
+
+				pause = gc_usec () - pause;
+				if (pause > max_pause)
+					max_pause = pause;
+
+				// Perform possibly expensive memory release without the lock
+				listitem_retire (dead);
+
+				if (count > 0)
+				{
+					pthread_mutex_lock (&l->lock);
+					l->left += count;
+					pthread_mutex_unlock (&l->lock);
+					total += count;
+				}
+			}
+			while (!done);
 		}
 
-		// unlinks old peers
-		teredo_listitem *old = l->old;
+		teredo_ebr_collect ();
 
-		// moves recent peers to old peers area
-		l->old = l->recent;
-		l->recent = NULL;
-		if (l->old != NULL)
-			l->old->pprev = &l->old;
+		/* Gives the memory of expired peers back to the heap */
+		for (unsigned i = 0; i < TEREDO_LIST_STRIPES; i++)
+		{
+			teredo_stripe *s = l->stripes + i;
 
-		pthread_mutex_unlock (&l->lock);
+			teredo_pool_trim (s->items);
+			for (unsigned j = 0; j < TEREDO_QUEUE_CLASSES; j++)
+				teredo_pool_trim (s->queues[j]);
+		}
 
-		// Perform possibly expensive memory release without the lock
-		sched_yield ();
-		listitem_recdestroy (old);
+		pthread_mutex_lock (&l->lock);
+		l->expired += total;
+		if (max_pause > l->max_pause)
+			l->max_pause = max_pause;
+		pthread_mutex_unlock (&l->lock);
 
+#ifndef NDEBUG
+		if (total > 0)
+		{
+			teredo_list_stats st;
+			teredo_list_get_stats (l, &st);
+			debug ("Peer list: %lu expired (longest pause %lu us), "
+			       "%u/%u entries, %u/%u queued packets, %zu bytes",
+			       total, max_pause, st.peers, st.peers_room,
+			       st.queued, st.queued_room, st.bytes);
+		}
+#endif
 		/* cancel-unsafe section ends */
 		pthread_setcancelstate (state, NULL);
 		sched_yield ();
@@ -261,56 +853,103 @@ teredo_peerlist *teredo_list_create (unsigned max, unsigned expiration)
 	        sizeof (teredo_listitem));*/
 	assert (expiration > 0);
 
+	if (pthread_once (&held_once, held_key_create))
+		return NULL;
+
 	teredo_peerlist *l = (teredo_peerlist *)malloc (sizeof (*l));
 	if (l == NULL)
 		return NULL;
 
-	memset (l, 0, sizeof (l));
-	pthread_mutex_init (&l->lock, NULL);
-	l->recent = l->old = NULL;
-	l->left = max;
+	memset (l, 0, sizeof (*l));
+	teredo_get_list_key (l->key);
+
+	l->left = l->max = max;
+	l->max_untrusted = (max + 1) / 2;
 	l->expiration = expiration;
-#ifdef HAVE_LIBJUDY
-	l->PJHSArray = (Pvoid_t)NULL;
-#endif
+	l->queue_peer = TEREDO_QUEUE_PEER_DEFAULT;
+	l->queue_total = TEREDO_QUEUE_TOTAL_DEFAULT;
+
+	l->tick = (expiration + 2) / (TEREDO_WHEEL_SLOTS - 4) + 1;
 
-	if (pthread_create (&l->gc, NULL, garbage_collector, l))
+	uint32_t fsize = filter_size (max);
+	l->filter = (uint16_t *)calloc (fsize, sizeof (*l->filter));
+	if (l->filter == NULL)
 	{
-		pthread_mutex_destroy (&l->lock);
 		free (l);
 		return NULL;
 	}
+	l->filter_mask = fsize - 1;
+
+	unsigned n;
+	for (n = 0; n < TEREDO_LIST_STRIPES; n++)
+		if (stripe_init (l, l->stripes + n, max))
+			goto error;
+
+	pthread_mutex_init (&l->lock, NULL);
+	if (pthread_create (&l->gc, NULL, garbage_collector, l) == 0)
+		return l;
 
-	return l;
+	pthread_mutex_destroy (&l->lock);
+error:
+	while (n > 0)
+		stripe_deinit (l->stripes + --n);
+	free (l->filter);
+	free (l);
+	return NULL;
 }
 
 
 void teredo_list_reset (teredo_peerlist *l, unsigned max)
 {
+	teredo_listitem *items[TEREDO_LIST_STRIPES][TEREDO_WHEEL_SLOTS + 1];
+	teredo_htab arrays[TEREDO_LIST_STRIPES];
+
+	/* Stripes are locked in order, the counter lock comes last */
+	for (unsigned i = 0; i < TEREDO_LIST_STRIPES; i++)
+		pthread_mutex_lock (&l->stripes[i].lock);
 	pthread_mutex_lock (&l->lock);
+	l->left = l->max = max;
+	l->untrusted = 0;
+	l->max_untrusted = (max + 1) / 2;
+	memset (l->src_count, 0, sizeof (l->src_count));
+	memset (l->net_count, 0, sizeof (l->net_count));
+	pthread_mutex_unlock (&l->lock);
 
-#ifdef HAVE_LIBJUDY
-	// detach old array
-	Pvoid_t array = l->PJHSArray;
-	l->PJHSArray = (Pvoid_t)NULL;
-#endif
+	/* all peers are removed at once; lock-less readers may be checking */
+	for (uint32_t i = 0; i <= l->filter_mask; i++)
+		teredo_atomic_store (l->filter + i, 0);
 
-	teredo_listitem *recent = l->recent, *old = l->old;
-	// unlinks peers and resets lists
-	l->recent = l->old = NULL;
-	l->left = max;
+	for (unsigned i = 0; i < TEREDO_LIST_STRIPES; i++)
+		stripe_limit (l->stripes + i, max);
 
-	pthread_mutex_unlock (&l->lock);
+	for (unsigned i = 0; i < TEREDO_LIST_STRIPES; i++)
+	{
+		teredo_stripe *s = l->stripes + i;
+
+		arrays[i] = s->index;
+		teredo_htab_init (&s->index, offsetof (teredo_listitem, key));
+		s->index.release = teredo_ebr_free;
+		// unlinks peers and resets the timing wheel
+		for (unsigned j = 0; j < TEREDO_WHEEL_SLOTS; j++)
+		{
+			items[i][j] = s->wheel[j];
+			s->wheel[j] = NULL;
+		}
+		items[i][TEREDO_WHEEL_SLOTS] = s->sweep;
+		s->sweep = NULL;
+	}
+
+	for (unsigned i = TEREDO_LIST_STRIPES; i > 0; i--)
+		pthread_mutex_unlock (&l->stripes[i - 1].lock);
 
 	/* the mutex is not needed for actual memory release */
-	listitem_recdestroy (old);
-	listitem_recdestroy (recent);
+	for (unsigned i = 0; i < TEREDO_LIST_STRIPES; i++)
+		for (unsigned j = 0; j <= TEREDO_WHEEL_SLOTS; j++)
+			listitem_retire (items[i][j]);
 
-#ifdef HAVE_LIBJUDY
-	// destroy the old array that was detached before unlocking
-	intptr_t Rc_word;
-	JHSFA (Rc_word, array);
-#endif
+	// destroy the old indexes that were detached before unlocking
+	for (unsigned i = 0; i < TEREDO_LIST_STRIPES; i++)
+		teredo_htab_destroy (arrays + i);
 }
 
 
@@ -320,59 +959,221 @@ void teredo_list_destroy (teredo_peerlist *l)
 
 	pthread_cancel (l->gc);
 	pthread_join (l->gc, NULL);
+	/* waits until removed peers are released before destroying pools */
+	teredo_ebr_barrier ();
+	for (unsigned i = 0; i < TEREDO_LIST_STRIPES; i++)
+		stripe_deinit (l->stripes + i);
 	pthread_mutex_destroy (&l->lock);
 
+	free (l->filter);
 	free (l);
 }
 
 
-teredo_peer *teredo_list_lookup (teredo_peerlist *restrict list,
-                                 const struct in6_addr *restrict addr,
-                                 bool *restrict create)
+void teredo_list_get_stats (teredo_peerlist *restrict l,
+                            teredo_list_stats *restrict stats)
 {
-	teredo_listitem *p;
+	memset (stats, 0, sizeof (*stats));
 
-	pthread_mutex_lock (&list->lock);
+	for (unsigned i = 0; i < TEREDO_LIST_STRIPES; i++)
+	{
+		const teredo_stripe *s = l->stripes + i;
+		teredo_pool_stats ps;
 
-#ifdef HAVE_LIBJUDY
-	teredo_listitem **pp = NULL;
+		teredo_pool_get_stats (s->items, &ps);
+		stats->peers_room += ps.total;
+		stats->bytes += ps.total * ps.size;
 
-	/* Judy dynamic array-based fast lookup */
+		for (unsigned j = 0; j < TEREDO_QUEUE_CLASSES; j++)
+		{
+			teredo_pool_get_stats (s->queues[j], &ps);
+			stats->queued += ps.used;
+			stats->queued_room += ps.total;
+			stats->bytes += ps.total * ps.size;
+		}
+	}
+
+	pthread_mutex_lock (&l->lock);
+	stats->peers = l->max - l->left;
+	stats->expired = l->expired;
+	stats->max_pause = l->max_pause;
+	stats->untrusted = l->untrusted;
+	stats->evicted = l->evicted;
+	stats->refused_source = l->refused_source;
+	stats->refused_net = l->refused_net;
+	stats->refused_full = l->refused_full;
+	pthread_mutex_unlock (&l->lock);
+
+	stats->queued_bytes = teredo_atomic_load (&l->queued_bytes);
+	stats->queue_dropped = teredo_atomic_load (&l->queue_dropped);
+}
+
+
+void teredo_list_set_queue_limits (teredo_peerlist *l, size_t peer,
+                                   size_t total)
+{
+	teredo_atomic_store (&l->queue_peer, peer);
+	teredo_atomic_store (&l->queue_total, total);
+}
+
+
+/**
+ * Admission quotas buckets of a peer being created.
+ */
+typedef struct teredo_admission
+{
+	uint16_t src_bucket, net_bucket;
+} teredo_admission;
+
+
+/**
+ * Reserves room for one more peer in the list.
+ * @return true on success, false if the list is full.
+ */
+static bool teredo_list_reserve (teredo_peerlist *l)
+{
+	bool ok;
+
+	pthread_mutex_lock (&l->lock);
+	ok = (l->left > 0);
+	if (ok)
+		l->left--;
+	pthread_mutex_unlock (&l->lock);
+	return ok;
+}
+
+
+/**
+ * Cancels a reservation from teredo_list_reserve() (if @a adm is NULL) or
+ * teredo_list_admit_inner().
+ */
+static void teredo_list_unreserve (teredo_peerlist *restrict l,
+                                   const teredo_admission *restrict adm)
+{
+	pthread_mutex_lock (&l->lock);
+	l->left++;
+	if (adm != NULL)
 	{
-		void *PValue;
+		l->untrusted--;
+		if (adm->src_bucket != TEREDO_ADMIT_NONE)
+			l->src_count[adm->src_bucket]--;
+		if (adm->net_bucket != TEREDO_ADMIT_NONE)
+			l->net_count[adm->net_bucket]--;
+	}
+	pthread_mutex_unlock (&l->lock);
+}
 
-		if (create != NULL)
+
+/**
+ * Finds an untrusted peer to evict from a stripe, closest to expiry first.
+ * Must be called with the stripe lock held.
+ *
+ * @param charged only consider peers counted as untrusted admissions
+ * @return NULL if none was found within TEREDO_EVICT_SCAN peers.
+ */
+static teredo_listitem *stripe_victim (teredo_stripe *s, bool charged)
+{
+	teredo_listitem *p = s->sweep;
+	unsigned budget = TEREDO_EVICT_SCAN;
+
+	for (unsigned i = 0;; i++)
+	{
+		for (; p != NULL; p = p->next)
 		{
-			JHSI (PValue, list->PJHSArray, (uint8_t *)addr, 16);
-			if (PValue == PJERR)
-			{
-				pthread_mutex_unlock (&list->lock);
+			if (!p->peer.trusted && (p->charged || !charged))
+				return p;
+			if (--budget == 0)
 				return NULL;
-			}
-			pp = (teredo_listitem **)PValue;
-			p = *pp;
 		}
-		else
+
+		if (i >= TEREDO_WHEEL_SLOTS)
+			return NULL;
+		p = s->wheel[(s->swept + 1 + i) & (TEREDO_WHEEL_SLOTS - 1)];
+	}
+}
+
+
+/**
+ * Reserves room for one more untrusted peer in the list, subject to
+ * admission control. If the list is full, or there are too many untrusted
+ * peers, an untrusted peer is evicted from the stripe (whose lock must be
+ * held) to make room.
+ *
+ * @return true on success, false if the peer is refused.
+ */
+static bool teredo_list_admit_inner (teredo_peerlist *restrict l,
+                                     teredo_stripe *restrict s,
+                                     const teredo_admission *restrict adm)
+{
+	teredo_listitem *victim = NULL;
+
+	pthread_mutex_lock (&l->lock);
+	if ((adm->src_bucket != TEREDO_ADMIT_NONE)
+	 && (l->src_count[adm->src_bucket] >= TEREDO_ADMIT_SOURCE_QUOTA))
+	{
+		l->refused_source++;
+		goto refuse;
+	}
+
+	if ((adm->net_bucket != TEREDO_ADMIT_NONE)
+	 && (l->net_count[adm->net_bucket] >= TEREDO_ADMIT_NET_QUOTA))
+	{
+		l->refused_net++;
+		goto refuse;
+	}
+
+	bool need_untrusted = l->untrusted >= l->max_untrusted;
+	if (need_untrusted || (l->left == 0))
+	{
+		victim = stripe_victim (s, need_untrusted);
+		if (victim == NULL)
 		{
-			JHSG (PValue, list->PJHSArray, (uint8_t *)addr, 16);
-			pp = (teredo_listitem **)PValue;
-			p = (pp != NULL) ? *pp : NULL;
+			l->refused_full++;
+			goto refuse;
 		}
 
+		wheel_unlink (victim);
+		stripe_unindex (l, s, victim);
+		listitem_uncharge (l, victim);
+		l->left++;
+		l->evicted++;
 	}
-#else
-	/* Slow O(n) simplistic peer lookup */
-	p = NULL;
 
-	for (p = list->recent; p != NULL; p = p->next)
-		if (IN6_ARE_ADDR_EQUAL (&p->key.ip6, addr))
-			break;
+	l->left--;
+	l->untrusted++;
+	if (adm->src_bucket != TEREDO_ADMIT_NONE)
+		l->src_count[adm->src_bucket]++;
+	if (adm->net_bucket != TEREDO_ADMIT_NONE)
+		l->net_count[adm->net_bucket]++;
+	pthread_mutex_unlock (&l->lock);
 
-	if (p == NULL)
-		for (p = list->old; p != NULL; p = p->next)
-			if (IN6_ARE_ADDR_EQUAL (&p->key.ip6, addr))
-				break;
-#endif
+	if (victim != NULL)
+	{
+		victim->next = NULL;
+		listitem_retire (victim);
+	}
+	return true;
+
+refuse:
+	pthread_mutex_unlock (&l->lock);
+	return false;
+}
+
+
+static teredo_peer *
+teredo_list_lookup_inner (teredo_peerlist *restrict list,
+                          const struct in6_addr *restrict addr,
+                          bool *restrict create,
+                          const teredo_admission *restrict adm)
+{
+	uint32_t hash;
+	teredo_stripe *s = stripe_get (list, addr, &hash);
+	teredo_listitem *p;
+
+	pthread_mutex_lock (&s->lock);
+
+	/* Built-in hash table lookup */
+	p = teredo_htab_find (&s->index, hash, addr);
 
 	if (p != NULL)
 	{
@@ -383,77 +1184,205 @@ teredo_peer *teredo_list_lookup (teredo_peerlist *restrict list,
 		if (create != NULL)
 			*create = false;
 
-		/* move peer to the top of the head of the "recent" list */
-		if (list->recent != p)
-		{
-			// unlinks
-			if (p->next != NULL)
-				p->next->pprev = p->pprev;
-			*(p->pprev) = p->next;
-
-			// inserts at head
-			p->next = list->recent;
-			if (p->next != NULL)
-				p->next->pprev = &p->next;
-
-			list->recent = p;
-			p->pprev = &list->recent;
-
-			assert (*(p->pprev) == p);
-			assert ((p->next == NULL) || (p->next->pprev == &p->next));
-		}
+		/* references the peer; the garbage collector will refile it */
+		if (teredo_atomic_load (&p->atime) != s->now)
+			teredo_atomic_store (&p->atime, s->now);
 
+		pthread_setspecific (held_key, p);
 		return &p->peer;
 	}
 
-	assert (p == NULL);
-
 	/* otherwise, peer was not in list */
 	if (create == NULL)
 	{
-		pthread_mutex_unlock (&list->lock);
+		pthread_mutex_unlock (&s->lock);
 		return NULL;
 	}
 
 	*create = true;
 
 	/* Allocates a new peer entry */
-	if (list->left > 0)
-		p = listitem_create ();
+	if ((adm != NULL) ? !teredo_list_admit_inner (list, s, adm)
+	                  : !teredo_list_reserve (list))
+	{
+		pthread_mutex_unlock (&s->lock);
+		return NULL;
+	}
+
+	p = listitem_create (s);
+	/* entries may be waiting for lock-less readers: reclaims them */
+	for (unsigned i = 0; (p == NULL) && (i < 2); i++)
+	{
+		teredo_ebr_collect ();
+		p = listitem_create (s);
+	}
+
+	if (p != NULL)
+	{
+		p->key.ip6 = *addr;
+		p->hash = hash;
+		if (teredo_htab_insert (&s->index, hash, p))
+		{
+			listitem_destroy (p);
+			p = NULL;
+		}
+	}
 
 	if (p == NULL)
 	{
-#ifdef HAVE_LIBJUDY
-		int Rc_int;
-		JHSD (Rc_int, list->PJHSArray, (uint8_t *)addr, sizeof (*addr));
-#endif
-		pthread_mutex_unlock (&list->lock);
+		teredo_list_unreserve (list, adm);
+		pthread_mutex_unlock (&s->lock);
 		return NULL;
 	}
 
-	/* Puts new entry at the head of the list */
-	p->next = list->recent;
-	if (p->next != NULL)
-		p->next->pprev = &p->next;
+	if (adm != NULL)
+	{
+		p->src_bucket = adm->src_bucket;
+		p->net_bucket = adm->net_bucket;
+		p->charged = true;
+	}
+	p->atime = s->now;
+	filter_add (list, hash);
+	wheel_link (list, s, p);
+	pthread_setspecific (held_key, p);
+	return &p->peer;
+}
 
-	p->pprev = &list->recent;
-	list->recent = p;
-	p->pprev = &list->recent;
 
-	list->left--;
+teredo_peer *teredo_list_lookup (teredo_peerlist *restrict list,
+                                 const struct in6_addr *restrict addr,
+                                 bool *restrict create)
+{
+	return teredo_list_lookup_inner (list, addr, create, NULL);
+}
 
-	assert (*(p->pprev) == p);
-	assert ((p->next == NULL) || (p->next->pprev == &p->next));
 
-#ifdef HAVE_LIBJUDY
-	*pp = p;
-#endif
-	p->key.ip6 = *addr;
-	return &p->peer;
+teredo_peer *teredo_list_admit (teredo_peerlist *restrict list,
+                                const struct in6_addr *restrict addr,
+                                const struct in6_addr *restrict src,
+                                uint32_t ipv4, bool *restrict create)
+{
+	teredo_admission adm =
+	{
+		.src_bucket = TEREDO_ADMIT_NONE,
+		.net_bucket = TEREDO_ADMIT_NONE,
+	};
+
+	if (src != NULL)
+		adm.src_bucket = teredo_siphash (list->key, src, sizeof (*src))
+		                 & (TEREDO_ADMIT_BUCKETS - 1);
+	if (ipv4 != 0)
+	{
+		uint32_t net = ipv4 & htonl (0xffffff00);
+		adm.net_bucket = teredo_siphash (list->key, &net, sizeof (net))
+		                 & (TEREDO_ADMIT_BUCKETS - 1);
+	}
+
+	return teredo_list_lookup_inner (list, addr, create, &adm);
+}
+
+
+bool teredo_list_may_contain (teredo_peerlist *restrict list,
+                              const struct in6_addr *restrict addr)
+{
+	uint32_t hash, slots[TEREDO_FILTER_HASHES];
+
+	(void)stripe_get (list, addr, &hash);
+	filter_slots (list, hash, slots);
+
+	for (unsigned i = 0; i < TEREDO_FILTER_HASHES; i++)
+		if (teredo_atomic_load (list->filter + slots[i]) == 0)
+			return false;
+	return true;
+}
+
+
+void teredo_list_prefetch (teredo_peerlist *restrict list,
+                           const struct in6_addr *restrict addr)
+{
+	uint32_t hash;
+	teredo_stripe *s = stripe_get (list, addr, &hash);
+
+	teredo_htab_prefetch (&s->index, hash);
+}
+
+
+int teredo_list_read_lock (void)
+{
+	return teredo_ebr_enter ();
+}
+
+
+void teredo_list_read_unlock (void)
+{
+	teredo_ebr_leave ();
+}
+
+
+int teredo_list_find_trusted (teredo_peerlist *restrict list,
+                              const struct in6_addr *restrict addr,
+                              teredo_trusted *restrict t)
+{
+	uint32_t hash;
+	teredo_stripe *s = stripe_get (list, addr, &hash);
+	teredo_listitem *p = teredo_htab_find_lockless (&s->index, hash, addr);
+
+	if (p == NULL)
+		return -1;
+
+	uint64_t map = teredo_atomic_load_acquire (&p->fastmap);
+	if (!(map & 1) || teredo_atomic_load (&p->dead))
+		return -1;
+
+	/* references the peer; the garbage collector will refile it */
+	teredo_clock_t now = teredo_atomic_load (&s->now);
+	if (teredo_atomic_load (&p->atime) != now)
+		teredo_atomic_store (&p->atime, now);
+
+	t->peer = &p->peer;
+	t->mapped_addr = map >> 32;
+	t->mapped_port = map >> 16;
+	t->local = (map >> 1) & 1;
+	return 0;
+}
+
+
+/**
+ * @return the lock-less lookup mapping of a peer: its mapping, local flag
+ * and a valid bit if it is eligible, 0 otherwise.
+ */
+static uint64_t listitem_fastmap (const teredo_listitem *p)
+{
+	const teredo_peer *peer = &p->peer;
+
+	if (!peer->trusted || peer->bubbles || peer->pings
+	 || (peer->queue != NULL))
+		return 0;
+
+	return ((uint64_t)peer->mapped_addr << 32)
+	     | ((uint64_t)peer->mapped_port << 16) | (peer->local << 1) | 1;
 }
 
 
 void teredo_list_release (teredo_peerlist *l)
 {
-	pthread_mutex_unlock (&l->lock);
+	teredo_listitem *p = (teredo_listitem *)pthread_getspecific (held_key);
+
+	assert (p != NULL);
+	teredo_stripe *s = p->stripe;
+	assert ((s >= l->stripes) && (s < l->stripes + TEREDO_LIST_STRIPES));
+
+	/* publishes the peer state for lock-less lookups */
+	uint64_t map = listitem_fastmap (p);
+	if (teredo_atomic_load (&p->fastmap) != map)
+		teredo_atomic_store_release (&p->fastmap, map);
+
+	/* peers stop counting against quotas once trusted */
+	if (p->charged && p->peer.trusted)
+	{
+		pthread_mutex_lock (&l->lock);
+		listitem_uncharge (l, p);
+		pthread_mutex_unlock (&l->lock);
+	}
+	pthread_mutex_unlock (&s->lock);
 }
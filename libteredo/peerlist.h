@@ -23,15 +23,19 @@
 #ifndef LIBTEREDO_PEERLIST_H
 # define LIBTEREDO_PEERLIST_H
 
+# include "atomic.h"
+
 # define TEREDO_TIMEOUT 30 // seconds
-# define MAXQUEUE 1280u // bytes
+# define MAXQUEUE 1280u // largest queued packet (bytes)
+# define TEREDO_QUEUE_PEER_DEFAULT 8192u // bytes queued per peer
+# define TEREDO_QUEUE_TOTAL_DEFAULT (4u << 20) // bytes queued per list
 
 typedef struct teredo_queue teredo_queue;
 
 typedef struct teredo_peer
 {
-	teredo_queue *queue;
-	size_t queue_left;
+	teredo_queue *queue, *queue_last; /* packets in arrival order */
+	size_t queue_bytes;
 	teredo_clock_t last_rx;
 	teredo_clock_t last_tx;
 	teredo_clock_t last_ping;
@@ -69,26 +73,77 @@ static inline void SetMapping (teredo_peer *peer, uint32_t ip, uint16_t port)
 	peer->mapped_port = port;
 }
 
+/* last_rx and last_tx are also accessed without the list lock */
 static inline void TouchReceive (teredo_peer *peer, teredo_clock_t now)
 {
-	peer->last_rx = now;
+	if (teredo_atomic_load (&peer->last_rx) != now)
+		teredo_atomic_store (&peer->last_rx, now);
 }
 
 static inline void TouchTransmit (teredo_peer *peer, teredo_clock_t now)
 {
-	peer->last_tx = now;
+	if (teredo_atomic_load (&peer->last_tx) != now)
+		teredo_atomic_store (&peer->last_tx, now);
 }
 
 
+static inline bool IsValidSince (teredo_clock_t last_rx, bool local,
+                                 teredo_clock_t now)
+{
+	return (now - last_rx) <= (local ? 600 : 30);
+}
+
 static inline
 bool IsValid (const teredo_peer *peer, teredo_clock_t now)
 {
-	return (now - peer->last_rx) <= (peer->local ? 600 : 30);
+	return IsValidSince (teredo_atomic_load (&peer->last_rx), peer->local,
+	                     now);
+}
+
+
+/**
+ * Trusted peer, as seen by the lock-less lookup path.
+ */
+typedef struct teredo_trusted
+{
+	teredo_peer *peer; /**< only for TouchReceive() & TouchTransmit() */
+	uint32_t mapped_addr;
+	uint16_t mapped_port;
+	bool local;
+} teredo_trusted;
+
+static inline
+bool IsValidTrusted (const teredo_trusted *t, teredo_clock_t now)
+{
+	return IsValidSince (teredo_atomic_load (&t->peer->last_rx), t->local,
+	                     now);
 }
 
 
 typedef struct teredo_peerlist teredo_peerlist;
 
+/**
+ * Peer list memory occupancy.
+ */
+typedef struct teredo_list_stats
+{
+	unsigned peers; /**< peers in the list */
+	unsigned peers_room; /**< allocated peer entries (used, free or
+	                       * waiting to be released) */
+	unsigned queued; /**< queued packets */
+	unsigned queued_room; /**< allocated packet buffers (used or free) */
+	size_t bytes; /**< total allocated memory for entries and packets */
+	unsigned long expired; /**< peers expired so far */
+	unsigned long max_pause; /**< longest expiry lock hold (microseconds) */
+	unsigned untrusted; /**< admitted peers not trusted yet */
+	unsigned long evicted; /**< untrusted peers evicted to admit others */
+	unsigned long refused_source; /**< admissions refused (source quota) */
+	unsigned long refused_net; /**< admissions refused (/24 quota) */
+	unsigned long refused_full; /**< admissions refused (list full) */
+	size_t queued_bytes; /**< bytes of queued packets */
+	unsigned long queue_dropped; /**< packets not queued (over budget) */
+} teredo_list_stats;
+
 struct in6_addr;
 
 # ifdef __cplusplus
@@ -96,11 +151,14 @@ extern "C" {
 # endif
 
 /**
- * Creates an empty peer list.
+ * Creates an empty peer list. Memory for peers and queued packets grows
+ * with the number of peers, within about 1.5 times what @a max peers need,
+ * and is given back to the heap by the garbage collector as peers expire.
  *
  * @param max maximum number of peers in the list
- * @param expiration minimum delay (seconds) before a peer can be removed
- * by the garbage collector. Must not be 0.
+ * @param expiration minimum delay (seconds) since its last lookup, reception
+ * or transmission before a peer can be removed by the garbage collector.
+ * Must not be 0.
  *
  * @return NULL on error (see errno for actual problem).
  */
@@ -143,12 +201,109 @@ teredo_peer *teredo_list_lookup (teredo_peerlist *restrict list,
                                  const struct in6_addr *restrict addr,
                                  bool *restrict create);
 
+/**
+ * Looks up a peer like teredo_list_lookup(), but subject to admission
+ * control if the peer needs to be created. Until they are trusted, created
+ * peers count against quotas for the source that caused their creation
+ * and for the IPv4 /24 network they are mapped to, and against a cap on
+ * the overall number of untrusted peers. When the list is full or the cap
+ * is reached, untrusted peers are evicted before giving up.
+ *
+ * @param list peers list
+ * @param addr IPv6 address of the peer to search for
+ * @param src IPv6 address of the node causing the creation (NULL if none)
+ * @param ipv4 IPv4 address the peer is mapped to (0 if none)
+ * @param create see teredo_list_lookup()
+ *
+ * @return see teredo_list_lookup(). NULL if the admission is refused.
+ */
+teredo_peer *teredo_list_admit (teredo_peerlist *restrict list,
+                                const struct in6_addr *restrict addr,
+                                const struct in6_addr *restrict src,
+                                uint32_t ipv4, bool *restrict create);
+
+/**
+ * Checks whether a peer may be in the list, without locking it. There are
+ * no false negatives, except for peers being added or removed concurrently,
+ * but there are false positives, which teredo_list_lookup() sorts out.
+ *
+ * @param list peers list
+ * @param addr IPv6 address of the peer to search for
+ *
+ * @return false if the peer is definitely not in the list.
+ */
+bool teredo_list_may_contain (teredo_peerlist *restrict list,
+                              const struct in6_addr *restrict addr);
+
+/**
+ * Prefetches the index slot of a peer into the CPU cache, ahead of a
+ * lookup. Does not lock the list, and has no other effect.
+ *
+ * @param list peers list
+ * @param addr IPv6 address of the peer that will be searched for
+ */
+void teredo_list_prefetch (teredo_peerlist *restrict list,
+                           const struct in6_addr *restrict addr);
+
+/**
+ * Enters a lock-less read-side section, for teredo_list_find_trusted().
+ * Read-side sections must be short, and must not be nested nor call any
+ * other peer list function.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int teredo_list_read_lock (void);
+
+/**
+ * Leaves a lock-less read-side section.
+ */
+void teredo_list_read_unlock (void);
+
+/**
+ * Looks up a trusted peer without locking the list. This only succeeds
+ * for trusted peers with no pending packets nor bubbles and pings counts,
+ * that is to say, peers for which no state change is needed other than
+ * last reception and transmission times. The peer can be used until
+ * teredo_list_read_unlock().
+ *
+ * @param list peers list
+ * @param addr IPv6 address of the peer to search for
+ * @param t [OUT] trusted peer mapping
+ *
+ * @return 0 on success, -1 if the peer was not found or is not eligible,
+ * in which case teredo_list_lookup() must be used.
+ */
+int teredo_list_find_trusted (teredo_peerlist *restrict list,
+                              const struct in6_addr *restrict addr,
+                              teredo_trusted *restrict t);
+
 /**
  * Unlocks a list that was locked by teredo_list_lookup().
  * @param list peers list
  */
 void teredo_list_release (teredo_peerlist *list);
 
+/**
+ * Defines the budgets for packets queued to peers while they are not
+ * trusted yet. Packets that would exceed either budget are dropped.
+ * Thread-safe, but packets already queued are not affected.
+ *
+ * @param list peers list
+ * @param peer maximum bytes of packets queued to any single peer
+ * @param total maximum bytes of packets queued to all peers of the list
+ */
+void teredo_list_set_queue_limits (teredo_peerlist *list, size_t peer,
+                                   size_t total);
+
+/**
+ * Gets the memory occupancy of a list. Thread-safe, but the values are
+ * only a snapshot.
+ * @param list peers list
+ * @param stats [OUT] occupancy statistics
+ */
+void teredo_list_get_stats (teredo_peerlist *restrict list,
+                            teredo_list_stats *restrict stats);
+
 # ifdef __cplusplus
 }
 # endif
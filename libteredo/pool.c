@@ -0,0 +1,288 @@
+/*
+ * pool.c - Fixed-size objects pool allocator
+ */
+
+/***********************************************************************
+ *  Copyright © 2007 Rémi Denis-Courmont.                              *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdbool.h>
+#include <stdlib.h> /* posix_memalign() / free() */
+#include <assert.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#include "pool.h"
+#include "debug.h"
+
+#define POOL_ALIGN 16 /* enough for any object we use */
+#define POOL_SLAB_BYTES 16384 /* power of two */
+
+typedef struct teredo_free
+{
+	struct teredo_free *next;
+} teredo_free;
+
+/*
+ * Slabs are aligned on their size, so that the slab of an object is found
+ * by masking its address. Each slab keeps its own free objects, so that a
+ * slab whose objects are all free can be given back to the heap.
+ */
+typedef union teredo_slab
+{
+	struct
+	{
+		union teredo_slab *next, **pprev;
+		teredo_free *free;
+		unsigned used;
+	} h;
+	uint8_t pad[(sizeof (void *) * 3 + sizeof (unsigned) + POOL_ALIGN - 1)
+	            & ~(POOL_ALIGN - 1)];
+} teredo_slab;
+
+struct teredo_pool
+{
+	pthread_mutex_t lock;
+	/* slabs with some, no and only free objects */
+	teredo_slab *partial, *full, *empty;
+	size_t size, slab_bytes;
+	unsigned per_slab;
+	unsigned used, total, max, min;
+};
+
+
+static inline void slab_link (teredo_slab **list, teredo_slab *slab)
+{
+	slab->h.next = *list;
+	if (*list != NULL)
+		(*list)->h.pprev = &slab->h.next;
+	slab->h.pprev = list;
+	*list = slab;
+}
+
+
+static inline void slab_unlink (teredo_slab *slab)
+{
+	*(slab->h.pprev) = slab->h.next;
+	if (slab->h.next != NULL)
+		slab->h.next->h.pprev = slab->h.pprev;
+}
+
+
+/**
+ * @return the list that a slab belongs to, given its occupancy.
+ */
+static inline teredo_slab **slab_list (teredo_pool *pool,
+                                       const teredo_slab *slab)
+{
+	if (slab->h.free == NULL)
+		return &pool->full;
+	return (slab->h.used > 0) ? &pool->partial : &pool->empty;
+}
+
+
+/**
+ * Allocates a new empty slab.
+ * Must be called with the lock held.
+ *
+ * @return 0 on success, -1 on memory error.
+ */
+static int pool_grow (teredo_pool *pool)
+{
+	void *mem;
+
+	if (posix_memalign (&mem, pool->slab_bytes, pool->slab_bytes))
+		return -1;
+
+	teredo_slab *slab = (teredo_slab *)mem;
+	slab->h.free = NULL;
+	slab->h.used = 0;
+
+	uint8_t *obj = (uint8_t *)(slab + 1);
+	for (unsigned i = 0; i < pool->per_slab; i++, obj += pool->size)
+	{
+		teredo_free *f = (teredo_free *)obj;
+		f->next = slab->h.free;
+		slab->h.free = f;
+	}
+
+	slab_link (&pool->empty, slab);
+	pool->total += pool->per_slab;
+	return 0;
+}
+
+
+static void slabs_free (teredo_slab *slab)
+{
+	while (slab != NULL)
+	{
+		teredo_slab *next = slab->h.next;
+		free (slab);
+		slab = next;
+	}
+}
+
+
+teredo_pool *teredo_pool_create (size_t size, unsigned prealloc,
+                                 unsigned max)
+{
+	assert (prealloc <= max);
+
+	teredo_pool *pool = malloc (sizeof (*pool));
+	if (pool == NULL)
+		return NULL;
+
+	if (size < sizeof (teredo_free))
+		size = sizeof (teredo_free);
+	size = (size + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1);
+
+	size_t slab_bytes = POOL_SLAB_BYTES;
+	while (slab_bytes - sizeof (teredo_slab) < size)
+		slab_bytes *= 2;
+
+	pool->partial = pool->full = pool->empty = NULL;
+	pool->size = size;
+	pool->slab_bytes = slab_bytes;
+	pool->per_slab = (slab_bytes - sizeof (teredo_slab)) / size;
+	pool->used = pool->total = 0;
+	pool->max = max;
+	pool->min = prealloc;
+
+	while (pool->total < prealloc)
+		if (pool_grow (pool))
+		{
+			slabs_free (pool->empty);
+			free (pool);
+			return NULL;
+		}
+
+	pthread_mutex_init (&pool->lock, NULL);
+	return pool;
+}
+
+
+void teredo_pool_destroy (teredo_pool *pool)
+{
+	slabs_free (pool->partial);
+	slabs_free (pool->full);
+	slabs_free (pool->empty);
+
+	pthread_mutex_destroy (&pool->lock);
+	free (pool);
+}
+
+
+void teredo_pool_limit (teredo_pool *pool, unsigned max)
+{
+	pthread_mutex_lock (&pool->lock);
+	pool->max = max;
+	pthread_mutex_unlock (&pool->lock);
+}
+
+
+void *teredo_pool_alloc (teredo_pool *pool)
+{
+	teredo_free *f = NULL;
+
+	pthread_mutex_lock (&pool->lock);
+
+	if (pool->used < pool->max)
+	{
+		/* Fills partially used slabs first, so that others may empty */
+		teredo_slab *slab = (pool->partial != NULL) ? pool->partial
+		                                            : pool->empty;
+
+		if ((slab == NULL) && (pool_grow (pool) == 0))
+			slab = pool->empty;
+
+		if (slab != NULL)
+		{
+			f = slab->h.free;
+			slab->h.free = f->next;
+			slab->h.used++;
+			pool->used++;
+
+			slab_unlink (slab);
+			slab_link (slab_list (pool, slab), slab);
+		}
+	}
+
+	pthread_mutex_unlock (&pool->lock);
+	return f;
+}
+
+
+void teredo_pool_free (teredo_pool *pool, void *obj)
+{
+	teredo_free *f = (teredo_free *)obj;
+	teredo_slab *slab = (teredo_slab *)((uintptr_t)obj
+	                                    & ~(uintptr_t)(pool->slab_bytes - 1));
+
+	pthread_mutex_lock (&pool->lock);
+	assert (pool->used > 0);
+	assert (slab->h.used > 0);
+
+	bool was_full = (slab->h.free == NULL);
+	f->next = slab->h.free;
+	slab->h.free = f;
+	slab->h.used--;
+	pool->used--;
+
+	if (was_full || (slab->h.used == 0))
+	{
+		slab_unlink (slab);
+		slab_link (slab_list (pool, slab), slab);
+	}
+	pthread_mutex_unlock (&pool->lock);
+}
+
+
+void teredo_pool_trim (teredo_pool *pool)
+{
+	teredo_slab *dead = NULL;
+
+	pthread_mutex_lock (&pool->lock);
+	while ((pool->empty != NULL)
+	    && (pool->total - pool->per_slab >= pool->min))
+	{
+		teredo_slab *slab = pool->empty;
+
+		slab_unlink (slab);
+		slab->h.next = dead;
+		dead = slab;
+		pool->total -= pool->per_slab;
+	}
+	pthread_mutex_unlock (&pool->lock);
+
+	/* Heap release is done without the lock */
+	slabs_free (dead);
+}
+
+
+void teredo_pool_get_stats (teredo_pool *restrict pool,
+                            teredo_pool_stats *restrict stats)
+{
+	pthread_mutex_lock (&pool->lock);
+	stats->size = pool->size;
+	stats->used = pool->used;
+	stats->total = pool->total;
+	stats->max = pool->max;
+	pthread_mutex_unlock (&pool->lock);
+}
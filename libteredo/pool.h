@@ -0,0 +1,99 @@
+/**
+ * @file pool.h
+ * @brief Fixed-size objects pool allocator
+ *
+ * Objects are carved out of large slabs, which are allocated on demand
+ * up to a maximum number of objects. Freed objects are recycled, and slabs
+ * whose objects are all free are only given back to the heap by
+ * teredo_pool_trim(). This avoids hitting the general purpose heap
+ * allocator (and fragmenting it) on the packet path.
+ */
+
+/***********************************************************************
+ *  Copyright © 2007 Rémi Denis-Courmont.                              *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifndef LIBTEREDO_POOL_H
+# define LIBTEREDO_POOL_H
+
+typedef struct teredo_pool teredo_pool;
+
+/**
+ * Pool occupancy statistics.
+ */
+typedef struct teredo_pool_stats
+{
+	size_t size; /**< object size (bytes) */
+	unsigned used; /**< number of allocated objects */
+	unsigned total; /**< number of objects in slabs (used or free) */
+	unsigned max; /**< maximum number of objects */
+} teredo_pool_stats;
+
+# ifdef __cplusplus
+extern "C" {
+# endif
+
+/**
+ * Creates an objects pool. Thread-safe.
+ *
+ * @param size object size (bytes)
+ * @param prealloc number of objects to allocate immediately, and to keep
+ * when the pool is trimmed
+ * @param max maximum number of objects in use at any given time
+ *
+ * @return NULL on error.
+ */
+teredo_pool *teredo_pool_create (size_t size, unsigned prealloc,
+                                 unsigned max);
+
+/**
+ * Destroys a pool, including all its objects (whether freed or not).
+ */
+void teredo_pool_destroy (teredo_pool *pool);
+
+/**
+ * Changes the maximum number of objects of a pool. Thread-safe.
+ * Objects already allocated beyond the new limit are not reclaimed.
+ */
+void teredo_pool_limit (teredo_pool *pool, unsigned max);
+
+/**
+ * Allocates an object from a pool. Thread-safe.
+ * @return NULL if the pool is exhausted or on memory error.
+ */
+void *teredo_pool_alloc (teredo_pool *pool);
+
+/**
+ * Returns an object to its pool. Thread-safe.
+ */
+void teredo_pool_free (teredo_pool *pool, void *obj);
+
+/**
+ * Releases the slabs whose objects are all free, down to the preallocated
+ * number of objects. Thread-safe.
+ */
+void teredo_pool_trim (teredo_pool *pool);
+
+/**
+ * Gets pool occupancy statistics. Thread-safe.
+ */
+void teredo_pool_get_stats (teredo_pool *restrict pool,
+                            teredo_pool_stats *restrict stats);
+
+# ifdef __cplusplus
+}
+# endif /* ifdef __cplusplus */
+#endif /* ifndef LIBTEREDO_POOL_H */
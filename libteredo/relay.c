@@ -36,7 +36,9 @@
 
 #include <sys/types.h>
 #include <sys/time.h>
+#include <sys/uio.h> // struct iovec
 #include <netinet/in.h>
+#include <sys/socket.h> // getsockname()
 #include <netinet/ip6.h> // struct ip6_hdr
 #include <netinet/icmp6.h> // ICMP6_DST_UNREACH_*
 #include <arpa/inet.h> // inet_ntop()
@@ -51,34 +53,89 @@
 #include "maintain.h"
 #include "clock.h"
 #include "peerlist.h"
+#include "atomic.h"
 #include "iothread.h"
 #ifdef MIREDO_TEREDO_CLIENT
 # include "security.h"
 # include "discovery.h"
+# include "netwatch.h"
 #endif
 #include "debug.h"
-#ifndef NDEBUG
-# include <sys/socket.h>
+
+struct teredo_packet;
+struct ip6_hdr;
+
+/*
+ * A tunnel never changes mode once set up, so packets are processed by
+ * functions specialized for each mode, installed as function pointers.
+ */
+typedef enum teredo_mode
+{
+	TEREDO_MODE_RELAY,
+	TEREDO_MODE_CONE_RELAY,
+	TEREDO_MODE_CLIENT,
+} teredo_mode;
+
+typedef struct teredo_shard teredo_shard;
+
+typedef struct teredo_ops
+{
+	int (*transmit) (struct teredo_tunnel *restrict,
+	                 const struct ip6_hdr *restrict, size_t);
+	void (*receive) (teredo_shard *restrict,
+	                 const struct teredo_packet *restrict, unsigned);
+} teredo_ops;
+
+/* Forces the inlining of functions specialized by constant parameters */
+#ifdef __GNUC__
+# define TEREDO_TEMPLATE static inline __attribute__ ((always_inline))
+#else
+# define TEREDO_TEMPLATE static inline
 #endif
 
-struct teredo_tunnel
+struct teredo_shard
 {
+	struct teredo_tunnel *tunnel;
 	struct teredo_peerlist *list;
+	int fd;
+};
+
+/* Tunnel state, as words that can be accessed atomically */
+typedef union teredo_state_snapshot
+{
+	teredo_state state;
+	uint32_t words[(sizeof (teredo_state) + 3) / 4];
+} teredo_state_snapshot;
+
+struct teredo_tunnel
+{
 	void *opaque;
 #ifdef MIREDO_TEREDO_CLIENT
 	struct teredo_maintenance *maintenance;
 	struct teredo_discovery *discovery;
+	struct teredo_netwatch *netwatch;
 	
 	teredo_state_up_cb up_cb;
 	teredo_state_down_cb down_cb;
 	const teredo_discovery_params *disc_params;
 #endif
+	const teredo_ops *ops; /* mode-specialized functions (atomic) */
+	uint32_t prefix; /* Teredo prefix, for relays (atomic) */
+
 	teredo_recv_cb recv_cb;
+	teredo_recvv_cb recvv_cb;
 	teredo_icmpv6_cb icmpv6_cb;
 
 	teredo_state state;
 	pthread_rwlock_t state_lock;
 
+	/*
+	 * Copy of the state for packet processing, published with a sequence
+	 * lock so that readers neither lock nor write any shared memory.
+	 */
+	unsigned long state_seq;
+	teredo_state_snapshot snapshot;
+
 	// ICMPv6 rate limiting
 	struct
 	{
@@ -88,17 +145,61 @@ struct teredo_tunnel
 	} ratelimit;
 
 	// Asynchronous packet reception
-	teredo_iothread *recv;
+	teredo_iothread **recv;
+	unsigned recv_count;
 
-	int fd;
+	// Budgets for packets queued to peers (bytes, whole tunnel)
+	size_t queue_peer, queue_total;
+
+	// Sockets and peers (relay mode may use several shards)
+	unsigned shard_count;
+	teredo_shard shard[];
 };
 
-#ifdef HAVE_LIBJUDY
-# define MAX_PEERS 1048576
-#else
-# define MAX_PEERS 1024
-#endif
+#define MAX_PEERS 1048576
 #define ICMP_RATE_LIMIT_MS 100
+#define RECV_BATCH 16
+
+
+/**
+ * Publishes the tunnel state for teredo_state_read().
+ * Must be called with the state lock held for writing.
+ */
+static void teredo_state_publish (teredo_tunnel *tunnel)
+{
+	unsigned long seq = tunnel->state_seq;
+	teredo_state_snapshot u = { .state = tunnel->state };
+
+	/* odd sequence number: update in progress */
+	teredo_atomic_store (&tunnel->state_seq, seq + 1);
+	teredo_atomic_fence_release ();
+	for (size_t i = 0; i < sizeof (u.words) / sizeof (u.words[0]); i++)
+		teredo_atomic_store (tunnel->snapshot.words + i, u.words[i]);
+	teredo_atomic_store_release (&tunnel->state_seq, seq + 2);
+}
+
+
+/**
+ * Reads a consistent, if slightly outdated, copy of the tunnel state
+ * without locking. Thread-safe.
+ */
+static void teredo_state_read (teredo_tunnel *restrict tunnel,
+                               teredo_state *restrict state)
+{
+	teredo_state_snapshot u;
+	unsigned long seq;
+
+	do
+	{
+		seq = teredo_atomic_load_acquire (&tunnel->state_seq);
+		for (size_t i = 0; i < sizeof (u.words) / sizeof (u.words[0]); i++)
+			u.words[i] = teredo_atomic_load (tunnel->snapshot.words + i);
+		teredo_atomic_fence_acquire ();
+	}
+	while ((seq & 1) || (seq != teredo_atomic_load (&tunnel->state_seq)));
+
+	*state = u.state;
+}
 
 #if 0
 static unsigned QualificationRetries; // maintain.c
@@ -184,6 +285,7 @@ teredo_state_change (const teredo_state *state, void *self)
 	pthread_rwlock_wrlock (&tunnel->state_lock);
 	bool previously_up = tunnel->state.up;
 	tunnel->state = *state;
+	teredo_state_publish (tunnel);
 
 	if (tunnel->state.up)
 	{
@@ -199,7 +301,7 @@ teredo_state_change (const teredo_state *state, void *self)
 		 * the peer list is locked is STRICTLY FORBIDDEN to avoid an obvious
 		 * inter-locking deadlock.
 		 */
-		teredo_list_reset (tunnel->list, MAX_PEERS);
+		teredo_list_reset (tunnel->shard[0].list, MAX_PEERS);
 		tunnel->up_cb (tunnel->opaque,
 		               &tunnel->state.addr.ip6, tunnel->state.mtu);
 
@@ -213,9 +315,9 @@ teredo_state_change (const teredo_state *state, void *self)
 		{
 			teredo_discovery *d;
 			d = teredo_discovery_start (tunnel->disc_params,
-			                            tunnel->fd,
+			                            tunnel->shard[0].fd,
 						    &tunnel->state.addr.ip6,
-						    teredo_recv_thread, tunnel);
+						    teredo_recv_thread, tunnel->shard);
 			tunnel->discovery = d;
 		}
 	}
@@ -232,6 +334,29 @@ teredo_state_change (const teredo_state *state, void *self)
 	pthread_rwlock_unlock (&tunnel->state_lock);
 }
 
+/**
+ * Network configuration change callback: starts local discovery afresh on
+ * the current interfaces, and requalifies immediately.
+ */
+static void teredo_net_change (void *self)
+{
+	teredo_tunnel *tunnel = (teredo_tunnel *)self;
+
+	pthread_rwlock_wrlock (&tunnel->state_lock);
+	if (tunnel->discovery != NULL)
+	{
+		teredo_discovery_stop (tunnel->discovery);
+		tunnel->discovery = teredo_discovery_start (tunnel->disc_params,
+		                                            tunnel->shard[0].fd,
+		                                            &tunnel->state.addr.ip6,
+		                                            teredo_recv_thread,
+		                                            tunnel->shard);
+	}
+	pthread_rwlock_unlock (&tunnel->state_lock);
+
+	teredo_maintenance_requalify (tunnel->maintenance);
+}
+
 /**
  * @return 0 if a ping may be sent. 1 if one was sent recently
  * -1 if the peer seems unreachable.
@@ -319,6 +444,23 @@ static inline void SetMappingFromPacket (teredo_peer *peer,
 }
 
 
+/**
+ * Finds the shard that owns a Teredo peer, that is to say the one whose
+ * socket receives the packets from the peer's mapped address.
+ */
+static inline teredo_shard *
+teredo_get_shard (teredo_tunnel *restrict tunnel,
+                  const struct in6_addr *restrict addr)
+{
+	if (tunnel->shard_count == 1)
+		return tunnel->shard;
+
+	return tunnel->shard + teredo_steer (IN6_TEREDO_IPV4 (addr),
+	                                     IN6_TEREDO_PORT (addr),
+	                                     tunnel->shard_count);
+}
+
+
 /**
  * Encapsulates an IPv6 packet, forward it to a Teredo peer and release the
  * Teredo peers list. It is (obviously) assumed that the peers list lock is
@@ -327,24 +469,28 @@ static inline void SetMappingFromPacket (teredo_peer *peer,
  * @return 0 on success, -1 in case of UDP/IPv4 network error.
  */
 static
-int teredo_encap (teredo_tunnel *restrict tunnel, teredo_peer *restrict peer,
+int teredo_encap (teredo_shard *restrict shard, teredo_peer *restrict peer,
                   const void *restrict data, size_t len, teredo_clock_t now)
 {
 	uint32_t ipv4 = peer->mapped_addr;
 	uint16_t port = peer->mapped_port;
 	TouchTransmit (peer, now);
-	teredo_list_release (tunnel->list);
+	teredo_list_release (shard->list);
 
-	return (teredo_send (tunnel->fd,
+	return (teredo_send (shard->fd,
 	                     data, len, ipv4, port) == (int)len) ? 0 : -1;
 }
 
 
-int teredo_transmit (teredo_tunnel *restrict tunnel,
-                     const struct ip6_hdr *restrict packet, size_t length)
+/**
+ * Transmits a packet toward the Teredo tunnel (see teredo_transmit()),
+ * specialized for a tunnel mode.
+ */
+TEREDO_TEMPLATE int
+teredo_encap_mode (teredo_tunnel *restrict tunnel,
+                   const struct ip6_hdr *restrict packet, size_t length,
+                   const teredo_mode mode)
 {
-	assert (tunnel != NULL);
-
 	const union teredo_addr *dst =
 		(const union teredo_addr *)&packet->ip6_dst;
 #ifndef NDEBUG
@@ -355,34 +501,46 @@ int teredo_transmit (teredo_tunnel *restrict tunnel,
 	if (dst->ip6.s6_addr[0] == 0xff)
 		return 0;
 
-	teredo_state s;
-	pthread_rwlock_rdlock (&tunnel->state_lock);
-	s = tunnel->state;
 	/*
-	 * We can afford to use a slightly outdated state, but we cannot afford to
-	 * use an inconsistent state, hence this lock.
+	 * Relays only need the prefix, and their cone flag is part of the mode.
+	 * Clients can afford to use a slightly outdated state, but they cannot
+	 * afford to use an inconsistent state, hence the snapshot.
 	 */
-	pthread_rwlock_unlock (&tunnel->state_lock);
-
+	uint32_t prefix;
+	bool cone;
 #ifdef MIREDO_TEREDO_CLIENT
-	if (IsClient (tunnel) && !s.up)
+	teredo_state s;
+
+	if (mode == TEREDO_MODE_CLIENT)
 	{
-		/* Client not qualified */
-		teredo_send_unreach (tunnel, ICMP6_DST_UNREACH_ADDR, packet, length);
-		return 0;
+		teredo_state_read (tunnel, &s);
+		if (!s.up)
+		{
+			/* Client not qualified */
+			teredo_send_unreach (tunnel, ICMP6_DST_UNREACH_ADDR, packet,
+			                     length);
+			return 0;
+		}
+		prefix = s.addr.teredo.prefix;
+		cone = (s.addr.teredo.flags & htons (TEREDO_FLAG_CONE)) != 0;
 	}
+	else
 #endif
+	{
+		prefix = teredo_atomic_load (&tunnel->prefix);
+		cone = (mode == TEREDO_MODE_CONE_RELAY);
+	}
 
-	if (dst->teredo.prefix != s.addr.teredo.prefix)
+	if (dst->teredo.prefix != prefix)
 	{
 		/* Non-Teredo destination */
 #ifdef MIREDO_TEREDO_CLIENT
-		if (IsClient (tunnel))
+		if (mode == TEREDO_MODE_CLIENT)
 		{
 			const union teredo_addr *src =
 				(const union teredo_addr *)&packet->ip6_src;
 
-			if (src->teredo.prefix != s.addr.teredo.prefix)
+			if (src->teredo.prefix != prefix)
 			{
 				// Teredo servers and relays would reject the packet
 				// if it does not have a Teredo source.
@@ -406,7 +564,7 @@ int teredo_transmit (teredo_tunnel *restrict tunnel,
 	else
 	{
 		/* Teredo destination */
-		assert (dst->teredo.prefix == s.addr.teredo.prefix);
+		assert (dst->teredo.prefix == prefix);
 		/*
 		 * Ignores Teredo clients with incorrect server IPv4.
 		 * This check is only specified for client case 4 & 5.
@@ -434,18 +592,40 @@ int teredo_transmit (teredo_tunnel *restrict tunnel,
 
 	bool created;
 	teredo_clock_t now = teredo_clock ();
-	struct teredo_peerlist *list = tunnel->list;
+	bool is_teredo = (dst->teredo.prefix == prefix);
+	teredo_shard *shard = is_teredo
+		? teredo_get_shard (tunnel, &dst->ip6) : tunnel->shard;
+	struct teredo_peerlist *list = shard->list;
+
+	/* Case 1 fast path: valid trusted peer, without locking the list */
+	if (teredo_list_read_lock () == 0)
+	{
+		teredo_trusted t;
+
+		if ((teredo_list_find_trusted (list, &dst->ip6, &t) == 0)
+		 && IsValidTrusted (&t, now))
+		{
+			TouchTransmit (t.peer, now);
+			teredo_list_read_unlock ();
+			return (teredo_send (shard->fd, packet, length, t.mapped_addr,
+			                     t.mapped_port) == (int)length) ? 0 : -1;
+		}
+		teredo_list_read_unlock ();
+	}
 
-	teredo_peer *p = teredo_list_lookup (list, &dst->ip6, &created);
+	/* Teredo destinations are chosen by remote hosts: admission control */
+	teredo_peer *p = teredo_list_admit (list, &dst->ip6, &packet->ip6_src,
+	                                    is_teredo ? IN6_TEREDO_IPV4 (dst) : 0,
+	                                    &created);
 	if (p == NULL)
-		return -1; /* error */
+		return -1; /* error or refused */
 
 	if (!created)
 	{
 		/* Case 1 (paragraphs 5.2.4 & 5.4.1): trusted peer */
 		if (p->trusted && IsValid (p, now))
 			/* Already known -valid- peer */
-			return teredo_encap (tunnel, p, packet, length, now);
+			return teredo_encap (shard, p, packet, length, now);
 	}
  	else
 	{
@@ -465,12 +645,10 @@ int teredo_transmit (teredo_tunnel *restrict tunnel,
 
 #ifdef MIREDO_TEREDO_CLIENT
 	/* Untrusted non-Teredo node */
-	if (dst->teredo.prefix != s.addr.teredo.prefix)
+	if ((mode == TEREDO_MODE_CLIENT) && (dst->teredo.prefix != prefix))
 	{
 		int res;
 
-		assert (IsClient (tunnel));
-
 		/* Client case 2: direct IPv6 connectivity test */
 		// TODO: avoid code duplication
 		if (created)
@@ -484,7 +662,7 @@ int teredo_transmit (teredo_tunnel *restrict tunnel,
 		teredo_list_release (list);
 
 		if (res == 0)
-			res = SendPing (tunnel->fd, &s.addr, &dst->ip6);
+			res = SendPing (shard->fd, &s.addr, &dst->ip6);
 
 		if (res == -1)
 			teredo_send_unreach (tunnel, ICMP6_DST_UNREACH_ADDR,
@@ -496,7 +674,7 @@ int teredo_transmit (teredo_tunnel *restrict tunnel,
 	}
 
 	/* Client case 3: untrusted local peer */
-	if (p->local && IsValid (p, now))
+	if ((mode == TEREDO_MODE_CLIENT) && p->local && IsValid (p, now))
 	{
 		teredo_enqueue_out (p, packet, length);
 
@@ -508,7 +686,7 @@ int teredo_transmit (teredo_tunnel *restrict tunnel,
 
 		if (res == 0)
 		{
-			teredo_send_bubble_anyway (tunnel->fd, addr, port,
+			teredo_send_bubble_anyway (shard->fd, addr, port,
 			                           &s.addr.ip6, &dst->ip6);
 
 			pthread_rwlock_rdlock (&tunnel->state_lock);
@@ -518,7 +696,7 @@ int teredo_transmit (teredo_tunnel *restrict tunnel,
 			pthread_rwlock_unlock (&tunnel->state_lock);
 
 			if (d != NULL)
-				SendDiscoveryBubble (d, tunnel->fd);
+				SendDiscoveryBubble (d, shard->fd);
 
 			teredo_discovery_release (d);
 		}
@@ -544,7 +722,7 @@ int teredo_transmit (teredo_tunnel *restrict tunnel,
 	{
 		p->trusted = 1;
 		p->bubbles = /*p->pings -USELESS- =*/ 0;
-		return teredo_encap (tunnel, p, packet, length);
+		return teredo_encap (shard, p, packet, length);
 	}
 #endif
 
@@ -561,11 +739,11 @@ int teredo_transmit (teredo_tunnel *restrict tunnel,
 			 * Open the return path if we are behind a
 			 * restricted NAT.
 			 */
-			if (!(s.addr.teredo.flags & htons (TEREDO_FLAG_CONE))
-			 && SendBubbleFromDst (tunnel->fd, &dst->ip6, false))
+			if (!cone
+			 && SendBubbleFromDst (shard->fd, &dst->ip6, false))
 				return -1;
 
-			return SendBubbleFromDst (tunnel->fd, &dst->ip6, true);
+			return SendBubbleFromDst (shard->fd, &dst->ip6, true);
 
 		case -1: // Too many bubbles already sent
 			teredo_send_unreach (tunnel, ICMP6_DST_UNREACH_ADDR,
@@ -578,76 +756,105 @@ int teredo_transmit (teredo_tunnel *restrict tunnel,
 }
 
 
+int teredo_transmit (teredo_tunnel *restrict tunnel,
+                     const struct ip6_hdr *restrict packet, size_t length)
+{
+	assert (tunnel != NULL);
+
+	const teredo_ops *ops = teredo_atomic_load (&tunnel->ops);
+	return ops->transmit (tunnel, packet, length);
+}
+
+
 #ifdef MIREDO_TEREDO_CLIENT
 /**
- * Checks whether a given packet qualifies as a local one.
- * Must be called with the state lock held for reading.
+ * Checks whether a given packet may qualify as a local one, without
+ * locking. If so, the discovery procedure must then confirm it.
  */
 static bool
-teredo_islocal (teredo_tunnel *restrict tunnel,
-                const struct teredo_packet *restrict packet)
+teredo_maybe_local (const teredo_tunnel *restrict tunnel,
+                    const teredo_state *restrict state,
+                    const struct teredo_packet *restrict packet)
 {
-	if (!tunnel->disc_params || !tunnel->discovery)
+	if (!tunnel->disc_params)
 		return false; // local discovery disabled
 
-	union teredo_addr our = tunnel->state.addr;
-	if (IN6_TEREDO_PREFIX (&packet->ip6->ip6_src) != our.teredo.prefix)
+	const union teredo_addr *our = &state->addr;
+	if (IN6_TEREDO_PREFIX (&packet->ip6->ip6_src) != our->teredo.prefix)
 		return false; // not a teredo address
 
 	uint32_t client_ip = IN6_TEREDO_IPV4 (&packet->ip6->ip6_src);
-	if ((client_ip ^ ~our.teredo.client_ip) & tunnel->disc_params->netmask)
+	if ((client_ip ^ ~our->teredo.client_ip) & tunnel->disc_params->netmask)
 		return false; // non-matching mapped IPv4
 
-	if (!is_ipv4_discovered (tunnel->discovery, packet->source_ipv4))
-		return false; // non-matching source IPv4
-
 	return true;
 }
 #endif
 
 
 static
-void teredo_predecap (teredo_tunnel *restrict tunnel,
+void teredo_predecap (teredo_shard *restrict shard,
                       teredo_peer *restrict peer, teredo_clock_t now)
 {
+	teredo_tunnel *tunnel = shard->tunnel;
+
 	TouchReceive (peer, now);
 	peer->bubbles = peer->pings = 0;
 	teredo_queue *q = teredo_peer_queue_yield (peer);
-	teredo_list_release (tunnel->list);
+	teredo_list_release (shard->list);
 
 	if (q != NULL)
-		teredo_queue_emit (q, tunnel->fd,
+		teredo_queue_emit (q, shard->fd,
 		                   peer->mapped_addr, peer->mapped_port,
 		                   tunnel->recv_cb, tunnel->opaque);
 }
 
 
-/**
- * Receives a packet coming from the Teredo tunnel (as specified per
- * paragraph 5.4.2). That's called “Packet reception”.
- *
- * This function will NOT block if no packet are pending processing; it
- * will return immediatly.
- *
- * Thread-safety: This function is thread-safe.
+/*
+ * Received packets go through a staged pipeline, a batch at a time:
+ *  1. parsing and validation,
+ *  2. local discovery check (client only), under a single state lock,
+ *  3. classification: maintenance, server and relay checks, and prefetch
+ *     of the peer entry,
+ *  4. lock-less lookup of trusted peers, in a single read-side section
+ *     for consecutive packets, then delivery of their payloads as a vector.
+ * Packets that need the peer list lock fall back to teredo_decap_slow(),
+ * in order, after the payloads of the preceding packets were delivered.
+ * Apart from using one state snapshot per batch, the results are the same
+ * as processing each packet on its own.
  */
-static void
-teredo_run_inner (teredo_tunnel *restrict tunnel,
-                  const struct teredo_packet *restrict packet)
+typedef enum teredo_decap_class
 {
-	assert (tunnel != NULL);
-	assert (packet != NULL);
+	TEREDO_DECAP_DROP, /* invalid, or fully processed already */
+	TEREDO_DECAP_FAST, /* may come from a trusted peer */
+	TEREDO_DECAP_SLOW, /* needs the peer list lock */
+} teredo_decap_class;
 
-#ifndef NDEBUG
-	char b[INET6_ADDRSTRLEN];
+typedef struct teredo_decap
+{
+	const struct teredo_packet *packet;
+	size_t length; /* IPv6 packet length */
+	teredo_decap_class cls;
+#ifdef MIREDO_TEREDO_CLIENT
+	bool islocal;
 #endif
-	struct ip6_hdr *ip6 = packet->ip6;
+} teredo_decap;
+
+
+/**
+ * Checks a received packet (stage 1).
+ *
+ * @return the IPv6 packet length, or 0 if it is not valid.
+ */
+static size_t teredo_decap_parse (const struct teredo_packet *packet)
+{
+	const struct ip6_hdr *ip6 = packet->ip6;
 
 	// Checks packet
 	if (packet->ip6_len < sizeof (*ip6))
      	{
 		debug ("Packet size invalid: %zu bytes.", packet->ip6_len);
-		return; // invalid packet
+		return 0; // invalid packet
 	}
 
 	size_t length = sizeof (*ip6) + ntohs (ip6->ip6_plen);
@@ -655,46 +862,56 @@ teredo_run_inner (teredo_tunnel *restrict tunnel,
 	 || (length > packet->ip6_len))
      	{
 	   	debug ("Received malformed IPv6 packet.");
-		return; // malformatted IPv6 packet
+		return 0; // malformatted IPv6 packet
 	}
+	return length;
+}
 
-	pthread_rwlock_rdlock (&tunnel->state_lock);
-	teredo_state s = tunnel->state;
+
+/**
+ * Classifies a valid packet (stage 3). Maintenance packets and bubbles
+ * from our server are fully processed here.
+ */
+TEREDO_TEMPLATE teredo_decap_class
+teredo_decap_classify (teredo_shard *restrict shard,
+                       const teredo_state *restrict state, uint32_t prefix,
+                       const teredo_decap *restrict d, const teredo_mode mode)
+{
 #ifdef MIREDO_TEREDO_CLIENT
-	bool islocal = teredo_islocal (tunnel, packet);
+	teredo_tunnel *tunnel = shard->tunnel;
+#endif
+	const struct teredo_packet *packet = d->packet;
+	const struct ip6_hdr *ip6 = packet->ip6;
+#ifndef NDEBUG
+	char b[INET6_ADDRSTRLEN];
 #endif
-	/*
-	 * We can afford to use a slightly outdated state, but we cannot afford to
-	 * use an inconsistent state, hence this lock. Also, we cannot call
-	 * teredo_maintenance_process() while holding the lock, as that would
-	 * cause a deadlock at StateChange().
-	 */
-	pthread_rwlock_unlock (&tunnel->state_lock);
 
 #ifdef MIREDO_TEREDO_CLIENT
 	/* Maintenance */
-	if (IsClient (tunnel))
+	if (mode == TEREDO_MODE_CLIENT)
 	{
 		if (teredo_maintenance_process (tunnel->maintenance, packet) == 0)
 		{
 			debug (" packet passed to maintenance procedure");
-			return;
+			return TEREDO_DECAP_DROP;
 		}
 
-		if (!s.up)
+		if (!state->up)
 		{
 			debug (" packet dropped because tunnel down");
-			return; /* Not qualified -> do not accept incoming packets */
+			/* Not qualified -> do not accept incoming packets */
+			return TEREDO_DECAP_DROP;
 		}
 
-		if ((packet->source_ipv4 == s.addr.teredo.server_ip)
+		if ((packet->source_ipv4 == state->addr.teredo.server_ip)
 		 && (packet->source_port == htons (IPPORT_TEREDO)))
 		{
 			uint32_t ipv4 = packet->orig_ipv4;
 			uint16_t port = packet->orig_port;
 
 			if ((ipv4 == 0) && IsBubble (ip6)
-			 && (IN6_TEREDO_PREFIX (&ip6->ip6_src) == s.addr.teredo.prefix))
+			 && (IN6_TEREDO_PREFIX (&ip6->ip6_src)
+			     == prefix))
 			{
 				/*
 				 * Some servers do not insert an origin indication.
@@ -708,10 +925,10 @@ teredo_run_inner (teredo_tunnel *restrict tunnel,
 			if (ipv4)
 			{
 				/* TODO: record sending of bubble, create a peer, etc ? */
-				teredo_reply_bubble (tunnel->fd, ipv4, port, ip6);
+				teredo_reply_bubble (shard->fd, ipv4, port, ip6);
 				debug (" bubble sent");
-				if (IsBubble (ip6))
-					return; // don't pass bubble to kernel
+				if (IsBubble (ip6)) // don't pass bubble to kernel
+					return TEREDO_DECAP_DROP;
 			}
 		}
 
@@ -741,24 +958,71 @@ teredo_run_inner (teredo_tunnel *restrict tunnel,
 		 * Only Linux defines s6_addr16, so we don't use it.
 		 */
 		if (ntohs ((ip6->ip6_src.s6_addr16[0]) & 0xffc0) == 0xfe80)
-			return;
+			return TEREDO_DECAP_DROP;
 	}
 	else
 #endif /* MIREDO_TEREDO_CLIENT */
 	/* Relays only accept packets from Teredo clients */
-	if (IN6_TEREDO_PREFIX (&ip6->ip6_src) != s.addr.teredo.prefix)
+	if (IN6_TEREDO_PREFIX (&ip6->ip6_src) != prefix)
 	{
 		debug ("Source %s is not a teredo address.",
 		       inet_ntop (AF_INET6, &ip6->ip6_src.s6_addr, b, sizeof b));
-		return;
+		return TEREDO_DECAP_DROP;
 	}
 
-	/* Actual packet reception, either as a relay or a client */
+	/*
+	 * Relays drop packets from unknown peers (see below). Sources that are
+	 * definitely not listed are dropped without locking the list, so that
+	 * floods of spoofed packets do not contend on it.
+	 */
+	if (
+#ifdef MIREDO_TEREDO_CLIENT
+	    (mode != TEREDO_MODE_CLIENT) &&
+#endif
+	    !teredo_list_may_contain (shard->list, &ip6->ip6_src))
+	{
+		debug ("No peer for %s found. Dropping packet.",
+		       inet_ntop (AF_INET6, &ip6->ip6_src.s6_addr, b, sizeof b));
+		return TEREDO_DECAP_DROP;
+	}
 
-	teredo_clock_t now = teredo_clock ();
+	teredo_list_prefetch (shard->list, &ip6->ip6_src);
+
+	/* Client case 1 fast path: trusted peer, without locking the list */
+	if ((ip6->ip6_dst.s6_addr[0] != 0xff)
+#ifdef MIREDO_TEREDO_CLIENT
+	 && !((mode == TEREDO_MODE_CLIENT) && d->islocal
+	      && IsDiscoveryBubble (packet))
+#endif
+	   )
+		return TEREDO_DECAP_FAST;
+	return TEREDO_DECAP_SLOW;
+}
+
+
+/**
+ * Receives a packet that needs the peer list lock (as specified per
+ * paragraph 5.4.2, except for the trusted peers fast path).
+ */
+TEREDO_TEMPLATE void
+teredo_decap_slow (teredo_shard *restrict shard,
+                   const teredo_state *restrict state, uint32_t prefix,
+                   const teredo_decap *restrict d, teredo_clock_t now,
+                   const teredo_mode mode)
+{
+	teredo_tunnel *tunnel = shard->tunnel;
+	const struct teredo_packet *packet = d->packet;
+	struct ip6_hdr *ip6 = packet->ip6;
+	size_t length = d->length;
+	struct teredo_peerlist *list = shard->list;
+#ifdef MIREDO_TEREDO_CLIENT
+	bool islocal = (mode == TEREDO_MODE_CLIENT) && d->islocal;
+#endif
+#ifndef NDEBUG
+	char b[INET6_ADDRSTRLEN];
+#endif
 
 	// Checks source IPv6 address / looks up peer in the list:
-	struct teredo_peerlist *list = tunnel->list;
 	teredo_peer *p = teredo_list_lookup (list, &ip6->ip6_src, NULL);
 
 #ifdef MIREDO_TEREDO_CLIENT
@@ -801,10 +1065,10 @@ teredo_run_inner (teredo_tunnel *restrict tunnel,
 			return;
 
 		debug ("Replying to discovery bubble");
-		teredo_send_bubble_anyway (tunnel->fd,
+		teredo_send_bubble_anyway (shard->fd,
 					   packet->source_ipv4,
 					   packet->source_port,
-					   &s.addr.ip6, &ip6->ip6_src);
+					   &state->addr.ip6, &ip6->ip6_src);
 		return;
 	}
 #endif
@@ -847,7 +1111,7 @@ teredo_run_inner (teredo_tunnel *restrict tunnel,
 		 && (packet->source_ipv4 == p->mapped_addr)
 		 && (packet->source_port == p->mapped_port))
 		{
-			teredo_predecap (tunnel, p, now);
+			teredo_predecap (shard, p, now);
 			tunnel->recv_cb (tunnel->opaque, ip6, length);
 			return;
 		}
@@ -858,12 +1122,12 @@ teredo_run_inner (teredo_tunnel *restrict tunnel,
 		 * Mismatching trusted non-Teredo nodes are also accepted to recover
 		 * faster from a Teredo relay change. This is legal (client case 6).
 		 */
-		if (IsClient (tunnel) && (CheckPing (packet) == 0))
+		if ((mode == TEREDO_MODE_CLIENT) && (CheckPing (packet) == 0))
 		{
 			p->trusted = 1;
 			SetMappingFromPacket (p, packet);
 
-			teredo_predecap (tunnel, p, now);
+			teredo_predecap (shard, p, now);
 			return; /* don't pass ping to kernel */
 		}
 #endif /* ifdef MIREDO_TEREDO_CLIENT */
@@ -873,14 +1137,14 @@ teredo_run_inner (teredo_tunnel *restrict tunnel,
 	 * At this point, we have either a trusted mapping mismatch,
 	 * an unlisted peer, or an un-trusted client peer.
 	 */
-	if (IN6_TEREDO_PREFIX (&ip6->ip6_src) == s.addr.teredo.prefix)
+	if (IN6_TEREDO_PREFIX (&ip6->ip6_src) == prefix)
 	{
 		// Client case 3 (unknown or untrusted matching Teredo client):
 		if (IN6_MATCHES_TEREDO_CLIENT (&ip6->ip6_src, packet->source_ipv4,
 		                               packet->source_port)
 #ifdef MIREDO_TEREDO_CLIENT
 		// Client case 5 (untrusted local peer)
-		 || (p != NULL && p->local
+		 || ((mode == TEREDO_MODE_CLIENT) && p != NULL && p->local
 		     && (packet->source_ipv4 == p->mapped_addr)
 		     && (packet->source_port == p->mapped_port))
 		// Extension: packet from unknown local peer (faster discovery)
@@ -890,7 +1154,7 @@ teredo_run_inner (teredo_tunnel *restrict tunnel,
 		 || (IsBubble (ip6) && (CheckBubble (packet) == 0)))
 		{
 #ifdef MIREDO_TEREDO_CLIENT
-			if (IsClient (tunnel) && (p == NULL))
+			if ((mode == TEREDO_MODE_CLIENT) && (p == NULL))
 			{
 				p = teredo_list_lookup (list, &ip6->ip6_src, &(bool){ false });
 				if (p == NULL) {
@@ -917,7 +1181,7 @@ teredo_run_inner (teredo_tunnel *restrict tunnel,
 
 			SetMappingFromPacket (p, packet);
 			p->trusted = 1;
-			teredo_predecap (tunnel, p, now);
+			teredo_predecap (shard, p, now);
 
 			if (!IsBubble (ip6)) // discard Teredo bubble
 				tunnel->recv_cb (tunnel->opaque, ip6, length);
@@ -926,9 +1190,9 @@ teredo_run_inner (teredo_tunnel *restrict tunnel,
 	}
 #ifdef MIREDO_TEREDO_CLIENT
 	else
+	if (mode == TEREDO_MODE_CLIENT)
 	{
-		assert (IN6_TEREDO_PREFIX (&ip6->ip6_src) != s.addr.teredo.prefix);
-		assert (IsClient (tunnel));
+		assert (IN6_TEREDO_PREFIX (&ip6->ip6_src) != prefix);
 
 		/*
 		 * Default: Client case 6:
@@ -943,10 +1207,11 @@ teredo_run_inner (teredo_tunnel *restrict tunnel,
 		if (p == NULL)
 		{
 			bool create;
-			p = teredo_list_lookup (list, &ip6->ip6_src, &create);
+			p = teredo_list_admit (list, &ip6->ip6_src, NULL,
+			                       packet->source_ipv4, &create);
 			if (p == NULL)
 		     	{
-				debug ("Out of memory.");
+				debug ("Out of memory or peer refused.");
 				return; // memory error
 			}
 
@@ -973,7 +1238,7 @@ teredo_run_inner (teredo_tunnel *restrict tunnel,
 		teredo_list_release (list);
 
 		if (res == 0)
-			SendPing (tunnel->fd, &s.addr, &ip6->ip6_src);
+			SendPing (shard->fd, &state->addr, &ip6->ip6_src);
 
 		return;
 	}
@@ -986,6 +1251,196 @@ teredo_run_inner (teredo_tunnel *restrict tunnel,
 }
 
 
+/**
+ * Passes decapsulated packets to the recv callbacks, in order.
+ */
+static void teredo_deliver (teredo_tunnel *restrict tunnel,
+                            const struct iovec *restrict vec, size_t n)
+{
+	if (n == 0)
+		return;
+
+	if (tunnel->recvv_cb != NULL)
+		tunnel->recvv_cb (tunnel->opaque, vec, n);
+	else
+		for (size_t i = 0; i < n; i++)
+			tunnel->recv_cb (tunnel->opaque, vec[i].iov_base,
+			                 vec[i].iov_len);
+}
+
+
+/**
+ * Receives up to RECV_BATCH packets coming from the Teredo tunnel (as
+ * specified per paragraph 5.4.2). That's called “Packet reception”.
+ * Specialized for a tunnel mode.
+ *
+ * Thread-safety: This function is thread-safe.
+ */
+TEREDO_TEMPLATE void
+teredo_decap_mode (teredo_shard *restrict shard,
+                   const struct teredo_packet *restrict packets, unsigned n,
+                   const teredo_mode mode)
+{
+	assert (shard != NULL);
+	assert (n <= RECV_BATCH);
+
+	teredo_tunnel *tunnel = shard->tunnel;
+	teredo_decap batch[RECV_BATCH];
+
+	/* Stage 1: parsing */
+	for (unsigned i = 0; i < n; i++)
+	{
+		batch[i].packet = packets + i;
+		batch[i].length = teredo_decap_parse (packets + i);
+		batch[i].cls = batch[i].length ? TEREDO_DECAP_SLOW
+		                               : TEREDO_DECAP_DROP;
+#ifdef MIREDO_TEREDO_CLIENT
+		batch[i].islocal = false;
+#endif
+	}
+
+	/*
+	 * Relays only need the prefix. Clients can afford to use a slightly
+	 * outdated state, but they cannot afford to use an inconsistent state,
+	 * hence the snapshot.
+	 */
+	const teredo_state *state = NULL;
+	uint32_t prefix;
+#ifdef MIREDO_TEREDO_CLIENT
+	teredo_state s;
+
+	if (mode == TEREDO_MODE_CLIENT)
+	{
+		teredo_state_read (tunnel, &s);
+		state = &s;
+		prefix = s.addr.teredo.prefix;
+	}
+	else
+#endif
+		prefix = teredo_atomic_load (&tunnel->prefix);
+
+#ifdef MIREDO_TEREDO_CLIENT
+	/*
+	 * Stage 2: local discovery. The state lock is only taken for packets
+	 * from the local network, and at most once per batch, as the discovery
+	 * can be stopped by a state change meanwhile.
+	 */
+	bool locked = false;
+
+	for (unsigned i = 0; (mode == TEREDO_MODE_CLIENT) && (i < n); i++)
+	{
+		teredo_decap *d = batch + i;
+
+		if ((d->cls == TEREDO_DECAP_DROP)
+		 || !teredo_maybe_local (tunnel, &s, d->packet))
+			continue;
+
+		if (!locked)
+		{
+			pthread_rwlock_rdlock (&tunnel->state_lock);
+			locked = true;
+		}
+		d->islocal = (tunnel->discovery != NULL)
+		          && is_ipv4_discovered (tunnel->discovery,
+		                                 d->packet->source_ipv4);
+	}
+
+	if (locked)
+		pthread_rwlock_unlock (&tunnel->state_lock);
+#endif
+
+	/* Stage 3: classification */
+	for (unsigned i = 0; i < n; i++)
+		if (batch[i].cls != TEREDO_DECAP_DROP)
+			batch[i].cls = teredo_decap_classify (shard, state, prefix,
+			                                      batch + i, mode);
+
+	/* Stage 4: trusted peers, then everything else in order */
+	teredo_clock_t now = teredo_clock ();
+	struct iovec vec[RECV_BATCH];
+	unsigned pending = 0;
+	bool reading = false;
+
+	for (unsigned i = 0; i < n; i++)
+	{
+		const teredo_decap *d = batch + i;
+
+		if (d->cls == TEREDO_DECAP_DROP)
+			continue;
+
+		if ((d->cls == TEREDO_DECAP_FAST)
+		 && (reading || (reading = (teredo_list_read_lock () == 0))))
+		{
+			const struct teredo_packet *packet = d->packet;
+			teredo_trusted t;
+
+			if ((teredo_list_find_trusted (shard->list, &packet->ip6->ip6_src,
+			                               &t) == 0)
+			 && (packet->source_ipv4 == t.mapped_addr)
+			 && (packet->source_port == t.mapped_port))
+			{
+				TouchReceive (t.peer, now);
+				vec[pending].iov_base = packet->ip6;
+				vec[pending].iov_len = d->length;
+				pending++;
+				continue;
+			}
+		}
+
+		/* The slow path must see the effects of the preceding packets */
+		if (reading)
+		{
+			teredo_list_read_unlock ();
+			reading = false;
+		}
+		teredo_deliver (tunnel, vec, pending);
+		pending = 0;
+
+		teredo_decap_slow (shard, state, prefix, d, now, mode);
+	}
+
+	if (reading)
+		teredo_list_read_unlock ();
+	teredo_deliver (tunnel, vec, pending);
+}
+
+
+/* Generates the specialized functions of each tunnel mode */
+#define TEREDO_OPS(name, mode) \
+	static int \
+	teredo_encap_##name (teredo_tunnel *restrict tunnel, \
+	                     const struct ip6_hdr *restrict packet, size_t len) \
+	{ \
+		return teredo_encap_mode (tunnel, packet, len, mode); \
+	} \
+	\
+	static void \
+	teredo_decap_##name (teredo_shard *restrict shard, \
+	                     const struct teredo_packet *restrict packets, \
+	                     unsigned n) \
+	{ \
+		teredo_decap_mode (shard, packets, n, mode); \
+	} \
+	\
+	static const teredo_ops name##_ops = \
+		{ teredo_encap_##name, teredo_decap_##name }
+
+TEREDO_OPS (relay, TEREDO_MODE_RELAY);
+TEREDO_OPS (cone_relay, TEREDO_MODE_CONE_RELAY);
+#ifdef MIREDO_TEREDO_CLIENT
+TEREDO_OPS (client, TEREDO_MODE_CLIENT);
+#endif
+
+
+static void
+teredo_run_batch (teredo_shard *restrict shard,
+                  const struct teredo_packet *restrict packets, unsigned n)
+{
+	const teredo_ops *ops = teredo_atomic_load (&shard->tunnel->ops);
+	ops->receive (shard, packets, n);
+}
+
+
 
 static void teredo_dummy_recv_cb (void *o, const void *p, size_t l)
 {
@@ -1022,14 +1477,35 @@ static void teredo_dummy_state_down_cb (void *o)
 #endif
 
 
-teredo_tunnel *teredo_create (uint32_t ipv4, uint16_t port)
+/**
+ * Applies the queued packets budgets of a tunnel to one of its lists. The
+ * total budget is split evenly between shards.
+ */
+static void teredo_apply_queue_limits (const teredo_tunnel *t,
+                                       teredo_peerlist *list)
+{
+	unsigned n = t->shard_count;
+
+	teredo_list_set_queue_limits (list, t->queue_peer,
+	                              t->queue_total / n + (t->queue_total % n != 0));
+}
+
+
+teredo_tunnel *teredo_create_shards (uint32_t ipv4, uint16_t port,
+                                     unsigned n)
 {
-	teredo_tunnel *tunnel = (teredo_tunnel *)malloc (sizeof (*tunnel));
+	if (n == 0)
+		return NULL;
+
+	teredo_tunnel *tunnel = (teredo_tunnel *)malloc (sizeof (*tunnel)
+	                                    + n * sizeof (tunnel->shard[0]));
 	if (tunnel == NULL)
 		return NULL;
 
 	memset (tunnel, 0, sizeof (*tunnel));
 	tunnel->state.addr.teredo.prefix = htonl (TEREDO_PREFIX);
+	tunnel->prefix = htonl (TEREDO_PREFIX);
+	tunnel->ops = &relay_ops;
 
 	/*
 	 * That doesn't really need to match our mapping: the address is only
@@ -1050,15 +1526,62 @@ teredo_tunnel *teredo_create (uint32_t ipv4, uint16_t port)
 	tunnel->down_cb = teredo_dummy_state_down_cb;
 #endif
 
-	if ((tunnel->fd = teredo_socket (ipv4, port)) != -1)
+	/* The peers limit applies to the whole tunnel */
+	unsigned max_peers = (MAX_PEERS + n - 1) / n;
+	unsigned i;
+
+	for (i = 0; i < n; i++)
 	{
-		if ((tunnel->list = teredo_list_create (MAX_PEERS, 30)) != NULL)
+		teredo_shard *shard = tunnel->shard + i;
+
+		shard->tunnel = tunnel;
+		shard->fd = (n > 1) ? teredo_socket_shared (ipv4, port)
+		                    : teredo_socket (ipv4, port);
+		if (shard->fd == -1)
+			break;
+
+		if (port == 0)
+		{
+			/* All shards must be bound to the same port */
+			struct sockaddr_in addr;
+			socklen_t addrlen = sizeof (addr);
+
+			if (getsockname (shard->fd, (struct sockaddr *)&addr, &addrlen))
+			{
+				teredo_close (shard->fd);
+				break;
+			}
+			port = addr.sin_port;
+		}
+
+		shard->list = teredo_list_create (max_peers, 30);
+		if (shard->list == NULL)
 		{
-			(void)pthread_rwlock_init (&tunnel->state_lock, NULL);
-			(void)pthread_mutex_init (&tunnel->ratelimit.lock, NULL);
-			return tunnel;
+			teredo_close (shard->fd);
+			break;
 		}
-		teredo_close (tunnel->fd);
+	}
+
+	if ((i == n)
+	 && ((n == 1) || (teredo_socket_steer (tunnel->shard[0].fd, n) == 0)))
+	{
+		tunnel->shard_count = n;
+		tunnel->queue_peer = TEREDO_QUEUE_PEER_DEFAULT;
+		tunnel->queue_total = TEREDO_QUEUE_TOTAL_DEFAULT;
+		for (i = 0; i < n; i++)
+			teredo_apply_queue_limits (tunnel, tunnel->shard[i].list);
+		teredo_state_publish (tunnel);
+		(void)pthread_rwlock_init (&tunnel->state_lock, NULL);
+		(void)pthread_mutex_init (&tunnel->ratelimit.lock, NULL);
+		return tunnel;
+	}
+
+	while (i > 0)
+	{
+		teredo_shard *shard = tunnel->shard + --i;
+
+		teredo_list_destroy (shard->list);
+		teredo_close (shard->fd);
 	}
 
 	free (tunnel);
@@ -1066,17 +1589,25 @@ teredo_tunnel *teredo_create (uint32_t ipv4, uint16_t port)
 }
 
 
+teredo_tunnel *teredo_create (uint32_t ipv4, uint16_t port)
+{
+	return teredo_create_shards (ipv4, port, 1);
+}
+
+
 void teredo_destroy (teredo_tunnel *t)
 {
 	assert (t != NULL);
-	assert (t->fd != -1);
-	assert (t->list != NULL);
+	assert (t->shard_count > 0);
 
 #ifdef MIREDO_TEREDO_CLIENT
 	/* NOTE: We must NOT lock the state r/w lock here,
 	 * to avoid a potential deadlock, if the state callback is called by the
 	 * maintenance thread. Anyway, if the user obey the specified constraints,
 	 * we need not lock anyting in teredo_destroy(). */
+	if (t->netwatch != NULL)
+		teredo_netwatch_stop (t->netwatch);
+
 	if (t->maintenance != NULL)
 		teredo_maintenance_stop (t->maintenance);
 
@@ -1084,61 +1615,126 @@ void teredo_destroy (teredo_tunnel *t)
 		teredo_discovery_stop (t->discovery);
 #endif
 
-	if (t->recv != NULL)
-		teredo_iothread_stop (t->recv, false);
+	for (unsigned i = 0; i < t->recv_count; i++)
+		teredo_iothread_stop (t->recv[i], false);
+	free (t->recv);
 
-	teredo_list_destroy (t->list);
+	for (unsigned i = 0; i < t->shard_count; i++)
+	{
+		teredo_list_destroy (t->shard[i].list);
+		teredo_close (t->shard[i].fd);
+	}
 	pthread_rwlock_destroy (&t->state_lock);
 	pthread_mutex_destroy (&t->ratelimit.lock);
-	teredo_close (t->fd);
 	free (t);
 }
 
 
+static pthread_key_t recv_key;
+static pthread_once_t recv_once = PTHREAD_ONCE_INIT;
+
+static void teredo_recv_key_create (void)
+{
+	/* Packet buffers are freed when their thread is cancelled */
+	(void)pthread_key_create (&recv_key, free);
+}
+
+
 static LIBTEREDO_NORETURN void *teredo_recv_thread (void *t, int fd)
 {
-	teredo_tunnel *tunnel = (teredo_tunnel *)t;
+	teredo_shard *shard = (teredo_shard *)t;
+	struct teredo_packet fallback, *batch = &fallback;
+	unsigned size = 1;
+
+	/* Packet buffers are way too big to batch them on the stack */
+	(void)pthread_once (&recv_once, teredo_recv_key_create);
+	void *buf = malloc (RECV_BATCH * sizeof (fallback));
+	if (buf != NULL)
+	{
+		if (pthread_setspecific (recv_key, buf) == 0)
+		{
+			batch = (struct teredo_packet *)buf;
+			size = RECV_BATCH;
+		}
+		else
+			free (buf);
+	}
+
+	/* Replies are batched too (errors are not fatal here) */
+	teredo_send_batch_start (RECV_BATCH, 0);
 
 	for (;;)
 	{
-		struct teredo_packet packet;
-
-		if (teredo_wait_recv (fd, &packet) == 0)
+		int n = teredo_wait_recv_batch (fd, batch, size);
+		if (n > 0)
 		{
+			/* Drains the whole batch before blocking again */
 			pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, NULL);
-			teredo_run_inner (tunnel, &packet);
+			teredo_run_batch (shard, batch, n);
+			teredo_send_batch_flush ();
 			pthread_setcancelstate (PTHREAD_CANCEL_ENABLE, NULL);
 		}
 	}
 }
 
 
-int teredo_run_async (teredo_tunnel *t)
+int teredo_run_async_n (teredo_tunnel *t, unsigned n, int cpu)
 {
 	assert (t != NULL);
 
 	/* already running */
-	if (t->recv)
+	if (t->recv || (n == 0))
 		return -1;
 
-	t->recv = teredo_iothread_start (teredo_recv_thread, t, t->fd);
-	if (t->recv == NULL)
+	n *= t->shard_count;
+
+	teredo_iothread **recv = malloc (n * sizeof (*recv));
+	if (recv == NULL)
 		return -1;
 
+	for (unsigned i = 0; i < n; i++)
+	{
+		teredo_shard *shard = t->shard + (i % t->shard_count);
+
+		recv[i] = teredo_iothread_start (teredo_recv_thread, shard,
+		                                 shard->fd);
+		if (recv[i] == NULL)
+		{
+			while (i > 0)
+				teredo_iothread_stop (recv[--i], false);
+			free (recv);
+			return -1;
+		}
+
+		if ((cpu >= 0) && teredo_iothread_bind (recv[i], cpu + i))
+			debug ("Cannot bind receive thread %u to CPU %u", i, cpu + i);
+	}
+
+	t->recv = recv;
+	t->recv_count = n;
 	return 0;
 }
 
 
+int teredo_run_async (teredo_tunnel *t)
+{
+	return teredo_run_async_n (t, 1, -1);
+}
+
+
 void teredo_run (teredo_tunnel *tunnel)
 {
 	assert (tunnel != NULL);
 
 	struct teredo_packet packet;
 
-	if (teredo_recv (tunnel->fd, &packet))
-		return;
+	for (unsigned i = 0; i < tunnel->shard_count; i++)
+	{
+		teredo_shard *shard = tunnel->shard + i;
 
-	teredo_run_inner (tunnel, &packet);
+		if (teredo_recv (shard->fd, &packet) == 0)
+			teredo_run_batch (shard, &packet, 1);
+	}
 }
 
 
@@ -1157,13 +1753,30 @@ int teredo_set_prefix (teredo_tunnel *t, uint32_t prefix)
 		retval = -1;
 	else
 #endif
+	{
 		t->state.addr.teredo.prefix = prefix;
+		teredo_state_publish (t);
+		teredo_atomic_store (&t->prefix, prefix);
+	}
 
 	pthread_rwlock_unlock (&t->state_lock);
 	return retval;
 }
 
 
+void teredo_set_queue_limits (teredo_tunnel *t, size_t peer, size_t total)
+{
+	assert (t != NULL);
+
+	pthread_rwlock_wrlock (&t->state_lock);
+	t->queue_peer = peer;
+	t->queue_total = total;
+	for (unsigned i = 0; i < t->shard_count; i++)
+		teredo_apply_queue_limits (t, t->shard[i].list);
+	pthread_rwlock_unlock (&t->state_lock);
+}
+
+
 int teredo_set_cone_flag (teredo_tunnel *t, bool cone)
 {
 	assert (t != NULL);
@@ -1177,10 +1790,14 @@ int teredo_set_cone_flag (teredo_tunnel *t, bool cone)
 		retval = -1;
 	else
 #endif
-	if (cone)
-		t->state.addr.teredo.flags |= htons (TEREDO_FLAG_CONE);
-	else
-		t->state.addr.teredo.flags &= ~htons (TEREDO_FLAG_CONE);
+	{
+		if (cone)
+			t->state.addr.teredo.flags |= htons (TEREDO_FLAG_CONE);
+		else
+			t->state.addr.teredo.flags &= ~htons (TEREDO_FLAG_CONE);
+		teredo_state_publish (t);
+		teredo_atomic_store (&t->ops, cone ? &cone_relay_ops : &relay_ops);
+	}
 
 	pthread_rwlock_unlock (&t->state_lock);
 
@@ -1212,8 +1829,9 @@ int teredo_set_client_mode (teredo_tunnel *restrict t,
 	assert (t != NULL);
 
 	pthread_rwlock_wrlock (&t->state_lock);
-	if (t->maintenance != NULL)
+	if ((t->maintenance != NULL) || (t->shard_count != 1))
 	{
+		/* Clients only ever use one socket */
 		pthread_rwlock_unlock (&t->state_lock);
 		return -1;
 	}
@@ -1226,13 +1844,20 @@ int teredo_set_client_mode (teredo_tunnel *restrict t,
 		pthread_rwlock_unlock (&t->state_lock);
 		return -1;
 	}
-	teredo_list_destroy (t->list);
-	t->list = newlist;
+	teredo_apply_queue_limits (t, newlist);
+	teredo_list_destroy (t->shard[0].list);
+	t->shard[0].list = newlist;
 
 	struct teredo_maintenance *m;
-	m = teredo_maintenance_start (t->fd, teredo_state_change, t, s, s2,
+	m = teredo_maintenance_start (t->shard[0].fd, teredo_state_change, t, s, s2,
 	                              0, 0, 0, 0);
 	t->maintenance = m;
+	if (m != NULL)
+	{
+		teredo_atomic_store (&t->ops, &client_ops);
+		/* Requalifies on network changes (where supported) */
+		t->netwatch = teredo_netwatch_start (teredo_net_change, t);
+	}
 	pthread_rwlock_unlock (&t->state_lock);
 
 	if (m != NULL)
@@ -1294,6 +1919,13 @@ void teredo_set_recv_callback (teredo_tunnel *restrict t, teredo_recv_cb cb)
 }
 
 
+void teredo_set_recvv_callback (teredo_tunnel *restrict t, teredo_recvv_cb cb)
+{
+	assert (t != NULL);
+	t->recvv_cb = cb;
+}
+
+
 /**
  * Thread-safety: FIXME.
  */
@@ -0,0 +1,363 @@
+/*
+ * resolver.c - Asynchronous Teredo server name resolution
+ */
+
+/***********************************************************************
+ *  Copyright © 2007 Rémi Denis-Courmont.                              *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <string.h>
+#include <stdlib.h> /* malloc(), free() */
+#include <stdbool.h>
+#include <inttypes.h>
+#include <limits.h> /* UINT_MAX */
+#include <time.h> /* clock_gettime(), clock_nanosleep() */
+#include <errno.h>
+#include <assert.h>
+
+#include <sys/types.h>
+#include <unistd.h> /* _POSIX_* */
+#include <sys/socket.h> /* AF_INET */
+#include <netinet/in.h>
+#include <arpa/inet.h> /* inet_pton() */
+#include <netdb.h> /* getaddrinfo() */
+#ifdef HAVE_NS_INITPARSE
+# include <arpa/nameser.h>
+# include <resolv.h> /* res_query() */
+#endif
+#include <pthread.h>
+
+#include "resolver.h"
+#include "debug.h"
+
+#if (_POSIX_CLOCK_SELECTION - 0 < 0) || (_POSIX_MONOTONIC_CLOCK - 0 < 0)
+# define pthread_condattr_setclock( a, c ) (((c) != CLOCK_REALTIME) ? EINVAL : 0)
+# ifndef CLOCK_MONOTONIC
+#  define CLOCK_MONOTONIC CLOCK_REALTIME
+# endif
+#endif
+
+/* Bounds for the DNS time-to-live (seconds) */
+#define RESOLVER_TTL_MIN 30
+#define RESOLVER_TTL_DEFAULT 300
+#define RESOLVER_TTL_MAX 86400
+
+/* Delays between failed resolution attempts (seconds) */
+#define RESOLVER_RETRY_MIN 1
+#define RESOLVER_RETRY_MAX 300
+
+struct teredo_resolver
+{
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	teredo_resolve_cb cb;
+
+	uint32_t addrs[TEREDO_RESOLVER_MAX]; /* last resolved addresses */
+	unsigned count; /* 0 if none */
+	int error; /* result of the last resolution attempt */
+	bool done; /* at least one attempt completed */
+
+	char name[];
+};
+
+
+/**
+ * Resolves the IPv4 addresses of a name (thread-safe).
+ *
+ * @param ipv4 [out] table of TEREDO_RESOLVER_MAX addresses
+ * @param count [out] number of distinct addresses
+ *
+ * @return 0 on success, or an error value as defined for getaddrinfo().
+ */
+static int getipv4byname (const char *restrict name, uint32_t *restrict ipv4,
+                          unsigned *restrict count)
+{
+	struct addrinfo hints =
+	{
+		.ai_family = AF_INET,
+		.ai_socktype = SOCK_DGRAM
+	}, *res;
+
+	int val = getaddrinfo (name, NULL, &hints, &res);
+	if (val)
+		return val;
+
+	unsigned n = 0;
+	for (const struct addrinfo *p = res;
+	     (p != NULL) && (n < TEREDO_RESOLVER_MAX); p = p->ai_next)
+	{
+		const struct sockaddr_in *sin = (const struct sockaddr_in *)p->ai_addr;
+		uint32_t ip = sin->sin_addr.s_addr;
+		unsigned i = 0;
+
+		while ((i < n) && (ipv4[i] != ip))
+			i++;
+		if (i == n)
+			ipv4[n++] = ip;
+	}
+	freeaddrinfo (res);
+
+	*count = n;
+	return 0;
+}
+
+
+/**
+ * Queries the DNS for the time-to-live of the address records of a name.
+ * getaddrinfo() does not provide it, so this costs a second query, which
+ * normally hits the cache of the recursive DNS server.
+ *
+ * @return the smallest time-to-live of the A records (seconds),
+ * or RESOLVER_TTL_DEFAULT if unknown.
+ */
+static unsigned getttlbyname (const char *name)
+{
+	unsigned ttl = UINT_MAX;
+#ifdef HAVE_NS_INITPARSE
+	union
+	{
+		HEADER hdr;
+		uint8_t buf[NS_PACKETSZ];
+	} answer;
+	ns_msg msg;
+
+	int len = res_query (name, ns_c_in, ns_t_a, answer.buf,
+	                     sizeof (answer.buf));
+	if ((len <= 0) || (ns_initparse (answer.buf, len, &msg)))
+		return RESOLVER_TTL_DEFAULT;
+
+	for (int i = 0, n = ns_msg_count (msg, ns_s_an); i < n; i++)
+	{
+		ns_rr rr;
+
+		if (ns_parserr (&msg, ns_s_an, i, &rr))
+			break;
+		/* CNAME records are ignored, as the A records expire sooner */
+		if ((ns_rr_type (rr) == ns_t_a) && (ns_rr_ttl (rr) < ttl))
+			ttl = ns_rr_ttl (rr);
+	}
+#else
+	(void)name;
+#endif
+	return (ttl != UINT_MAX) ? ttl : RESOLVER_TTL_DEFAULT;
+}
+
+
+/**
+ * System resolver: getaddrinfo() with the DNS time-to-live.
+ */
+static int resolve_default (const char *name, uint32_t *ipv4,
+                            unsigned *count, unsigned *ttl)
+{
+	struct in_addr addr;
+
+	if (inet_pton (AF_INET, name, &addr) == 1)
+	{
+		/* IPv4 address literal: never expires */
+		ipv4[0] = addr.s_addr;
+		*count = 1;
+		*ttl = UINT_MAX;
+		return 0;
+	}
+
+	int val = getipv4byname (name, ipv4, count);
+	if (val)
+		return val;
+
+	unsigned t = getttlbyname (name);
+	if (t < RESOLVER_TTL_MIN)
+		t = RESOLVER_TTL_MIN;
+	if (t > RESOLVER_TTL_MAX)
+		t = RESOLVER_TTL_MAX;
+	*ttl = t;
+	return 0;
+}
+
+
+static inline void gettime (struct timespec *now)
+{
+	if (clock_gettime (CLOCK_MONOTONIC, now))
+		clock_gettime (CLOCK_REALTIME, now);
+}
+
+
+static void *resolver_thread (void *data)
+{
+	teredo_resolver *r = (teredo_resolver *)data;
+	unsigned backoff = RESOLVER_RETRY_MIN;
+
+	for (;;)
+	{
+		uint32_t addrs[TEREDO_RESOLVER_MAX];
+		unsigned count = 0, delay;
+		int val = r->cb (r->name, addrs, &count, &delay);
+		struct timespec next;
+
+		if ((val == 0) && (count == 0))
+			val = EAI_NONAME;
+
+		gettime (&next);
+
+		if (val == 0)
+		{
+			backoff = RESOLVER_RETRY_MIN;
+			if (delay == 0)
+				delay = 1;
+		}
+		else
+		{
+			delay = backoff;
+			if (backoff < RESOLVER_RETRY_MAX / 2)
+				backoff *= 2;
+			else
+				backoff = RESOLVER_RETRY_MAX;
+		}
+
+		pthread_mutex_lock (&r->lock);
+		if (val == 0)
+		{
+			assert (count <= TEREDO_RESOLVER_MAX);
+			memcpy (r->addrs, addrs, count * sizeof (addrs[0]));
+			r->count = count;
+		}
+		else
+		if (r->count != 0)
+			debug ("Keeping stale addresses for \"%s\" (error %d)", r->name,
+			       val);
+		r->error = val;
+		r->done = true;
+		pthread_cond_broadcast (&r->ready);
+		pthread_mutex_unlock (&r->lock);
+
+		if (delay == UINT_MAX)
+			break; /* address literal: nothing to refresh */
+
+		/* Resolve again when the cache expires */
+		next.tv_sec += delay;
+		while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &next,
+		                        NULL) == EINTR);
+	}
+	return NULL;
+}
+
+
+teredo_resolver *teredo_resolver_start (const char *name,
+                                        teredo_resolve_cb cb)
+{
+	size_t len = strlen (name) + 1;
+	teredo_resolver *r = (teredo_resolver *)malloc (sizeof (*r) + len);
+
+	if (r == NULL)
+		return NULL;
+
+	memset (r, 0, sizeof (*r));
+	memcpy (r->name, name, len);
+	r->cb = (cb != NULL) ? cb : resolve_default;
+
+	pthread_condattr_t attr;
+
+	pthread_condattr_init (&attr);
+	(void)pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+	/* EINVAL: CLOCK_MONOTONIC unknown */
+	pthread_cond_init (&r->ready, &attr);
+	pthread_condattr_destroy (&attr);
+	pthread_mutex_init (&r->lock, NULL);
+
+	int err = pthread_create (&r->thread, NULL, resolver_thread, r);
+	if (err == 0)
+		return r;
+
+	errno = err;
+	pthread_cond_destroy (&r->ready);
+	pthread_mutex_destroy (&r->lock);
+	free (r);
+	return NULL;
+}
+
+
+void teredo_resolver_stop (teredo_resolver *r)
+{
+	pthread_cancel (r->thread);
+	pthread_join (r->thread, NULL);
+
+	pthread_cond_destroy (&r->ready);
+	pthread_mutex_destroy (&r->lock);
+	free (r);
+}
+
+
+static void cleanup_unlock (void *o)
+{
+	(void)pthread_mutex_unlock ((pthread_mutex_t *)o);
+}
+
+
+/**
+ * @return the index of an address in the cache, or the number of cached
+ * addresses if it is not there. Must be called with the lock held.
+ */
+static unsigned resolver_find (const teredo_resolver *r, uint32_t ipv4)
+{
+	unsigned i = 0;
+
+	while ((i < r->count) && (r->addrs[i] != ipv4))
+		i++;
+	return i;
+}
+
+
+int teredo_resolver_get (teredo_resolver *restrict r, uint32_t *restrict ipv4,
+                         const struct timespec *restrict deadline)
+{
+	pthread_mutex_lock (&r->lock);
+	pthread_cleanup_push (cleanup_unlock, &r->lock);
+	for (int val = 0; !r->done && (val != ETIMEDOUT);)
+		val = pthread_cond_timedwait (&r->ready, &r->lock, deadline);
+	pthread_cleanup_pop (0);
+
+	int val;
+
+	if (r->count != 0)
+	{
+		/* Keeps the address in use if it is still valid */
+		if (resolver_find (r, *ipv4) == r->count)
+			*ipv4 = r->addrs[0];
+		val = 0;
+	}
+	else
+		val = r->done ? r->error : EAI_AGAIN;
+
+	pthread_mutex_unlock (&r->lock);
+	return val;
+}
+
+
+void teredo_resolver_skip (teredo_resolver *restrict r,
+                           uint32_t *restrict ipv4)
+{
+	pthread_mutex_lock (&r->lock);
+	if (r->count != 0)
+	{
+		unsigned i = resolver_find (r, *ipv4);
+		*ipv4 = r->addrs[(i < r->count) ? ((i + 1) % r->count) : 0];
+	}
+	pthread_mutex_unlock (&r->lock);
+}
@@ -0,0 +1,102 @@
+/**
+ * @file resolver.h
+ * @brief Asynchronous Teredo server name resolution
+ *
+ * A resolver thread keeps the IPv4 addresses of a host name in a cache, and
+ * resolves the name again when the DNS time-to-live expires. Readers never
+ * wait for the DNS, except for the very first resolution.
+ */
+
+/***********************************************************************
+ *  Copyright © 2007 Rémi Denis-Courmont.                              *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifndef LIBTEREDO_RESOLVER_H
+# define LIBTEREDO_RESOLVER_H
+
+struct timespec;
+
+typedef struct teredo_resolver teredo_resolver;
+
+/* Largest number of cached addresses per name */
+# define TEREDO_RESOLVER_MAX 8
+
+/**
+ * Name resolution callback, run from the resolver thread.
+ *
+ * @param name host name or IPv4 address literal
+ * @param ipv4 [out] table of TEREDO_RESOLVER_MAX entries for the resolved
+ * IPv4 addresses (network byte order)
+ * @param count [out] number of resolved addresses
+ * @param ttl [out] time in seconds during which the addresses may be cached
+ *
+ * @return 0 on success, or an error value as defined for getaddrinfo().
+ */
+typedef int (*teredo_resolve_cb) (const char *name, uint32_t *ipv4,
+                                  unsigned *count, unsigned *ttl);
+
+# ifdef __cplusplus
+extern "C" {
+# endif
+
+/**
+ * Starts resolving a host name in the background.
+ *
+ * @param name host name to resolve (copied)
+ * @param cb resolution callback, or NULL for the system resolver
+ *
+ * @return NULL on error.
+ */
+teredo_resolver *teredo_resolver_start (const char *name,
+                                        teredo_resolve_cb cb);
+
+/**
+ * Stops the resolver thread and frees the cache.
+ */
+void teredo_resolver_stop (teredo_resolver *r);
+
+/**
+ * Reads a cached address. If the name was never resolved yet, waits until
+ * the first resolution completes or the deadline is reached. When a later
+ * resolution fails, the last known addresses are used until they are
+ * replaced. Thread-safe. This is a cancellation point.
+ *
+ * @param ipv4 [in/out] IPv4 address in use (network byte order), or 0.
+ * It is kept as long as the name still resolves to it, so that round-robin
+ * DNS answers do not switch addresses needlessly. Otherwise, it is replaced
+ * with the first cached address.
+ * @param deadline absolute CLOCK_MONOTONIC time after which to give up
+ *
+ * @return 0 on success, EAI_AGAIN on timeout, or the getaddrinfo() error
+ * value of the last resolution attempt.
+ */
+int teredo_resolver_get (teredo_resolver *restrict r, uint32_t *restrict ipv4,
+                         const struct timespec *restrict deadline);
+
+/**
+ * Replaces an address with the next cached address of the name (wrapping
+ * around), e.g. when the host at that address stopped answering. The
+ * address is unchanged if it is the only one. Thread-safe. Never waits.
+ *
+ * @param ipv4 [in/out] IPv4 address in use (network byte order)
+ */
+void teredo_resolver_skip (teredo_resolver *restrict r,
+                           uint32_t *restrict ipv4);
+
+# ifdef __cplusplus
+}
+# endif /* ifdef __cplusplus */
+#endif /* ifndef LIBTEREDO_RESOLVER_H */
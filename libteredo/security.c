@@ -39,6 +39,8 @@
 #include "security.h"
 #include "debug.h"
 #include "md5.h"
+#include "siphash.h"
+#include "atomic.h"
 
 #if defined (__OpenBSD__) || defined (__OpenBSD_kernel__)
 static const char randfile[] = "/dev/srandom";
@@ -66,9 +68,47 @@ static union
 	unsigned char opad[HMAC_BLOCK_LEN];
 } outer_key;
 
+/* MD5 states after the inner and outer padded key blocks */
+static md5_state_t inner_state, outer_state;
+
+/* Key for the internal-only values, which never need to be HMAC-MD5 */
+static uint8_t sip_key[TEREDO_SIPHASH_KEY_LEN];
+
+/* Master key for the peer lists hash keys, and derived keys count */
+static uint8_t list_key[TEREDO_SIPHASH_KEY_LEN];
+static uint64_t list_count = 0;
+
 // PID cannot be zero (otherwise, have fun using fork()!)
 static uint16_t hmac_pid = 0;
 
+/**
+ * Fills a buffer with non-predictable random bytes from the kernel.
+ * @return 0 on success, -1 on error.
+ */
+static int teredo_get_random (void *buf, size_t len)
+{
+	/* Get a non-predictable random key from the kernel PRNG */
+	int fd = open (randfile, O_RDONLY);
+	if (fd == -1)
+		return -1;
+
+	for (size_t done = 0; done < len;)
+	{
+		ssize_t val = read (fd, (uint8_t *)buf + done, len - done);
+		if (val > 0)
+			done += val;
+		else
+		if ((val == 0) || (errno != EINTR))
+		{
+			close (fd);
+			return -1;
+		}
+	}
+	close (fd);
+	return 0;
+}
+
+
 int teredo_init_HMAC (void)
 {
 	static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
@@ -79,20 +119,10 @@ int teredo_init_HMAC (void)
 
 	if (hmac_pid != htons ((uint16_t)getpid ()))
 	{
-		/* Get a non-predictable random key from the kernel PRNG */
-		int fd = open (randfile, O_RDONLY);
-		if (fd == -1)
-			goto error;
-
 		memset (&inner_key, 0, sizeof (inner_key));
 
-		for (unsigned len = 0; len < LIBTEREDO_KEY_LEN;)
-		{
-			int val = read (fd, inner_key.key + len, LIBTEREDO_KEY_LEN - len);
-			if (val > 0)
-				len -= val;
-		}
-		close (fd);
+		if (teredo_get_random (inner_key.key, LIBTEREDO_KEY_LEN))
+			goto error;
 
 		/* Precomputes HMAC padding */
 		memcpy (&outer_key, &inner_key, sizeof (outer_key));
@@ -103,6 +133,16 @@ int teredo_init_HMAC (void)
 			outer_key.opad[i] ^= 0x5c;
 		}
 
+		/* Hashes the padded key blocks once and for all */
+		md5_init (&inner_state);
+		md5_append (&inner_state, inner_key.ipad, sizeof (inner_key.ipad));
+		md5_init (&outer_state);
+		md5_append (&outer_state, outer_key.opad, sizeof (outer_key.opad));
+
+		if (teredo_get_random (sip_key, sizeof (sip_key))
+		 || teredo_get_random (list_key, sizeof (list_key)))
+			goto error;
+
 		hmac_pid = htons ((uint16_t)getpid ());
 	}
 	retval = 0;
@@ -126,18 +166,15 @@ static void
 teredo_hash (const void *src, size_t slen, const void *dst, size_t dlen,
              uint8_t *restrict hash, uint32_t timestamp)
 {
-	/* compute hash */
-	md5_state_t ctx;
-	md5_init (&ctx);
-	md5_append (&ctx, inner_key.ipad, sizeof (inner_key.ipad));
+	/* compute hash, starting from the cached key blocks states */
+	md5_state_t ctx = inner_state;
 	md5_append (&ctx, (const unsigned char *)src, slen);
 	md5_append (&ctx, (const unsigned char *)dst, dlen);
 	md5_append (&ctx, (const unsigned char *)&hmac_pid, sizeof (hmac_pid));
 	md5_append (&ctx, (const unsigned char *)&timestamp, sizeof (timestamp));
 	md5_finish (&ctx, hash);
 
-	md5_init (&ctx);
-	md5_append (&ctx, outer_key.opad, sizeof (outer_key.opad));
+	ctx = outer_state;
 	md5_append (&ctx, hash, LIBTEREDO_HASH_LEN);
 	md5_finish (&ctx, hash);
 }
@@ -152,13 +189,20 @@ teredo_hash (const void *src, size_t slen, const void *dst, size_t dlen,
  *
  * The hash includes a timestamp with a lifetime of 30 units (seconds),
  * source and destination addresses, process ID, and a secret pseudo-random
- * key.
+ * key. Only we ever verify it, so it uses SipHash rather than HMAC-MD5.
  */
 static inline void
 teredo_pinghash (const struct in6_addr *src, const struct in6_addr *dst,
                  uint8_t *restrict hash, uint32_t timestamp)
 {
-	teredo_hash (src, sizeof (*src), dst, sizeof (*dst), hash, timestamp);
+	uint8_t buf[2 * sizeof (struct in6_addr) + sizeof (hmac_pid)
+	            + sizeof (timestamp)];
+
+	memcpy (buf, src, sizeof (*src));
+	memcpy (buf + 16, dst, sizeof (*dst));
+	memcpy (buf + 32, &hmac_pid, sizeof (hmac_pid));
+	memcpy (buf + 34, &timestamp, sizeof (timestamp));
+	teredo_siphash128 (sip_key, buf, sizeof (buf), hash);
 }
 
 
@@ -246,3 +290,25 @@ teredo_get_nonce (uint32_t timestamp, uint32_t ipv4, uint16_t port,
 	teredo_hash (&ipv4, 4, &port, 2, buf, timestamp);
 	memcpy (nonce, buf, LIBTEREDO_NONCE_LEN);
 }
+
+
+void teredo_get_list_key (uint8_t *restrict key)
+{
+	uint64_t n = teredo_atomic_add_fetch (&list_count, 1);
+
+	teredo_siphash128 (list_key, &n, sizeof (n), key);
+}
+
+
+void
+teredo_get_cookie (uint32_t ipv4, uint16_t port, uint8_t *restrict cookie)
+{
+	uint8_t buf[sizeof (ipv4) + sizeof (port) + sizeof (hmac_pid)];
+
+	memcpy (buf, &ipv4, sizeof (ipv4));
+	memcpy (buf + 4, &port, sizeof (port));
+	memcpy (buf + 6, &hmac_pid, sizeof (hmac_pid));
+
+	uint64_t h = teredo_siphash (sip_key, buf, sizeof (buf));
+	memcpy (cookie, &h, LIBTEREDO_COOKIE_LEN);
+}
@@ -30,6 +30,7 @@ extern "C" {
 
 #define LIBTEREDO_NONCE_LEN 8
 #define LIBTEREDO_HMAC_LEN 22
+#define LIBTEREDO_COOKIE_LEN 8
 
 int teredo_init_HMAC (void);
 void teredo_deinit_HMAC (void);
@@ -43,6 +44,28 @@ void teredo_get_nonce (uint32_t timestamp, uint32_t ipv4, uint16_t port,
                        uint8_t *restrict nonce);
 uint16_t teredo_get_flbits (uint32_t timestamp);
 
+/**
+ * Generates a secret cookie for a peer, such as the interface identifier of
+ * the source address of direct bubbles. Unlike the nonce, it never leaves
+ * the host to be echoed by a third party, so it is computed with SipHash
+ * rather than HMAC-MD5.
+ *
+ * @param ipv4 peer IPv4 address (network byte order)
+ * @param port peer UDP port (network byte order)
+ * @param cookie [out] LIBTEREDO_COOKIE_LEN bytes buffer
+ */
+void teredo_get_cookie (uint32_t ipv4, uint16_t port, uint8_t *restrict cookie);
+
+/**
+ * Derives a new secret key for a peer list hash function from a master key
+ * drawn by teredo_init_HMAC(). Each call returns a different key. Unlike
+ * teredo_init_HMAC(), this never accesses the file system, so it can be
+ * used after chroot().
+ *
+ * @param key [out] TEREDO_SIPHASH_KEY_LEN (16) bytes buffer
+ */
+void teredo_get_list_key (uint8_t *restrict key);
+
 # ifdef __cplusplus
 }
 # endif
@@ -0,0 +1,128 @@
+/*
+ * siphash.c - SipHash-2-4 keyed hash function
+ */
+
+/***********************************************************************
+ *  Copyright © 2007 Rémi Denis-Courmont.                              *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stddef.h>
+#include <inttypes.h>
+
+#include "siphash.h"
+
+static inline uint64_t load64 (const uint8_t *p)
+{
+	/* little endian, whatever the host byte order is */
+	return ((uint64_t)p[0])       | ((uint64_t)p[1] << 8)
+	     | ((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24)
+	     | ((uint64_t)p[4] << 32) | ((uint64_t)p[5] << 40)
+	     | ((uint64_t)p[6] << 48) | ((uint64_t)p[7] << 56);
+}
+
+
+#define ROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND \
+	do { \
+		v0 += v1; v1 = ROTL (v1, 13); v1 ^= v0; v0 = ROTL (v0, 32); \
+		v2 += v3; v3 = ROTL (v3, 16); v3 ^= v2; \
+		v0 += v3; v3 = ROTL (v3, 21); v3 ^= v0; \
+		v2 += v1; v1 = ROTL (v1, 17); v1 ^= v2; v2 = ROTL (v2, 32); \
+	} while (0)
+
+
+/**
+ * SipHash-2-4 core. The 128-bits variant uses different constants, and
+ * squeezes a second 64-bits word out of the state.
+ */
+static inline uint64_t
+siphash (const uint8_t *restrict key, const void *restrict data, size_t len,
+         uint64_t *restrict hi)
+{
+	const uint8_t *in = (const uint8_t *)data;
+	uint64_t k0 = load64 (key), k1 = load64 (key + 8);
+	uint64_t v0 = k0 ^ UINT64_C(0x736f6d6570736575);
+	uint64_t v1 = k1 ^ UINT64_C(0x646f72616e646f6d);
+	uint64_t v2 = k0 ^ UINT64_C(0x6c7967656e657261);
+	uint64_t v3 = k1 ^ UINT64_C(0x7465646279746573);
+	uint64_t b = ((uint64_t)len) << 56;
+
+	if (hi != NULL)
+		v1 ^= 0xee;
+
+	for (; len >= 8; len -= 8, in += 8)
+	{
+		uint64_t m = load64 (in);
+
+		v3 ^= m;
+		SIPROUND;
+		SIPROUND;
+		v0 ^= m;
+	}
+
+	for (size_t i = 0; i < len; i++)
+		b |= ((uint64_t)in[i]) << (8 * i);
+
+	v3 ^= b;
+	SIPROUND;
+	SIPROUND;
+	v0 ^= b;
+
+	v2 ^= (hi != NULL) ? 0xee : 0xff;
+	SIPROUND;
+	SIPROUND;
+	SIPROUND;
+	SIPROUND;
+
+	uint64_t lo = v0 ^ v1 ^ v2 ^ v3;
+	if (hi != NULL)
+	{
+		v1 ^= 0xdd;
+		SIPROUND;
+		SIPROUND;
+		SIPROUND;
+		SIPROUND;
+		*hi = v0 ^ v1 ^ v2 ^ v3;
+	}
+	return lo;
+}
+
+
+uint64_t teredo_siphash (const uint8_t *restrict key,
+                         const void *restrict data, size_t len)
+{
+	return siphash (key, data, len, NULL);
+}
+
+
+void teredo_siphash128 (const uint8_t *restrict key,
+                        const void *restrict data, size_t len,
+                        uint8_t *restrict hash)
+{
+	uint64_t hi, lo = siphash (key, data, len, &hi);
+
+	/* little endian, whatever the host byte order is */
+	for (unsigned i = 0; i < 8; i++)
+	{
+		hash[i] = lo >> (8 * i);
+		hash[8 + i] = hi >> (8 * i);
+	}
+}
@@ -0,0 +1,62 @@
+/**
+ * @file siphash.h
+ * @brief SipHash-2-4 keyed pseudo-random function
+ *
+ * See "SipHash: a fast short-input PRF" by J.-P. Aumasson and
+ * D. J. Bernstein (2012).
+ */
+
+/***********************************************************************
+ *  Copyright © 2007 Rémi Denis-Courmont.                              *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifndef LIBTEREDO_SIPHASH_H
+# define LIBTEREDO_SIPHASH_H
+
+# define TEREDO_SIPHASH_KEY_LEN 16
+
+# ifdef __cplusplus
+extern "C" {
+# endif
+
+/**
+ * Computes the SipHash-2-4 of a message.
+ *
+ * @param key secret key (TEREDO_SIPHASH_KEY_LEN bytes)
+ * @param data message to be hashed
+ * @param len byte length of the message
+ *
+ * @return the 64-bits hash value.
+ */
+uint64_t teredo_siphash (const uint8_t *restrict key,
+                         const void *restrict data, size_t len);
+
+/**
+ * Computes the 128-bits SipHash-2-4 of a message.
+ *
+ * @param key secret key (TEREDO_SIPHASH_KEY_LEN bytes)
+ * @param data message to be hashed
+ * @param len byte length of the message
+ * @param hash [out] 16 bytes hash value
+ */
+void teredo_siphash128 (const uint8_t *restrict key,
+                        const void *restrict data, size_t len,
+                        uint8_t *restrict hash);
+
+# ifdef __cplusplus
+}
+# endif /* ifdef __cplusplus */
+#endif /* ifndef LIBTEREDO_SIPHASH_H */
@@ -89,6 +89,42 @@ extern "C" {
  */
 int teredo_socket (uint32_t bind_ip, uint16_t port);
 
+/**
+ * Opens a Teredo UDP/IPv4 socket that can share its address and port with
+ * other such sockets. Incoming datagrams are spread across the sockets of
+ * the group, in the order they were opened, with teredo_socket_steer().
+ * Thread-safe, not cancellation-safe.
+ *
+ * @return -1 on error (including if the system does not support it).
+ */
+int teredo_socket_shared (uint32_t bind_ip, uint16_t port);
+
+/**
+ * Configures a group of @p n shared Teredo sockets (see
+ * teredo_socket_shared()) so that each datagram is received by the
+ * socket whose index is given by teredo_steer() for its source address
+ * and port.
+ * Thread-safe, not cancellation-safe.
+ *
+ * @param fd any socket from the group
+ * @param n number of sockets in the group
+ *
+ * @return 0 on success, -1 on error (including if not supported).
+ */
+int teredo_socket_steer (int fd, unsigned n);
+
+/**
+ * Computes the index of the socket receiving datagrams from a given source
+ * within a group of steered Teredo sockets.
+ *
+ * @param ip source IPv4 address (network byte order)
+ * @param port source UDP port (network byte order)
+ * @param n number of sockets in the group
+ *
+ * @return a value between 0 and n - 1.
+ */
+unsigned teredo_steer (uint32_t ip, uint16_t port, unsigned n);
+
 /**
  * Sends an UDP/IPv4 datagram.
  * Thread-safe, cancellation safe, cancellation point.
@@ -113,6 +149,52 @@ int teredo_send (int fd, const void *data, size_t len,
 int teredo_sendv (int fd, const struct iovec *iov, size_t count,
                   uint32_t ip, uint16_t port);
 
+/**
+ * Sends several UDP/IPv4 datagrams to the same destination, in order, with
+ * as few system calls as possible. Datagrams batched by the calling thread
+ * (see teredo_send_batch_start()) are sent first. As with batches, delivery
+ * errors are only used to drain the socket error queue.
+ * Thread-safe, not cancellation-safe.
+ *
+ * @param fd socket from which to send.
+ * @param iov array of datagram payloads (one entry per datagram).
+ * @param count number of datagrams.
+ * @param ip destination IPv4 (network byte order).
+ * @param port destination UDP port (network byte order).
+ */
+void teredo_send_many (int fd, const struct iovec *iov, size_t count,
+                       uint32_t ip, uint16_t port);
+
+/**
+ * Starts batching UDP datagrams sent by the calling thread with
+ * teredo_send() and teredo_sendv(). Queued datagrams are sent with as few
+ * system calls as possible when the batch is full, when the deadline
+ * expires, or when teredo_send_batch_flush() is called. Delivery errors
+ * cannot be reported to the sender of a batched datagram, and are only
+ * used to drain the socket error queue.
+ * Thread-safe, not cancellation-safe.
+ *
+ * @param size maximum number of datagrams per batch, up to 1024
+ * (0 or 1 disables batching for the calling thread).
+ * @param delay maximum time (in microseconds) a datagram can be held back
+ * before its batch is flushed, or 0 for no deadline.
+ *
+ * @return 0 on success, -1 on error (batching is then disabled).
+ */
+int teredo_send_batch_start (unsigned size, unsigned long delay);
+
+/**
+ * Sends all datagrams queued by the calling thread, if any.
+ * Thread-safe, cancellation point.
+ */
+void teredo_send_batch_flush (void);
+
+/**
+ * Flushes and stops batching datagrams sent by the calling thread.
+ * Thread-safe, cancellation point.
+ */
+void teredo_send_batch_stop (void);
+
 /**
  * Receives and parses a Teredo packet from a socket. Never blocks.
  * Thread-safe, cancellation-safe, cancellation point.
@@ -128,6 +210,24 @@ int teredo_sendv (int fd, const struct iovec *iov, size_t count,
  */
 int teredo_recv (int fd, struct teredo_packet *p);
 
+/**
+ * Receives and parses a batch of pending Teredo packets from a socket.
+ * Never blocks. Whenever possible, all packets are received with a single
+ * system call.
+ * Thread-safe, cancellation-safe, cancellation point.
+ *
+ * Malformatted datagrams are not skipped, but returned with a zero
+ * @c ip6_len so that the caller can drop them as any other invalid packet.
+ *
+ * @param fd socket file descriptor
+ * @param p array of teredo_packet receive buffers
+ * @param count number of entries in the @p p array (must be positive)
+ *
+ * @return the number of received packets, or -1 on error (including when
+ * no data is pending).
+ */
+int teredo_recv_batch (int fd, struct teredo_packet *p, unsigned count);
+
 /**
  * Waits for, receives and parses a Teredo packet from a socket.
  * Thread-safe, cancellation-safe, cancellation point.
@@ -144,6 +244,20 @@ int teredo_recv (int fd, struct teredo_packet *p);
  */
 int teredo_wait_recv (int fd, struct teredo_packet *p);
 
+/**
+ * Waits for at least one packet, then receives and parses a batch of
+ * Teredo packets from a socket, without waiting for any further packet.
+ * Thread-safe, cancellation-safe, cancellation point.
+ *
+ * @param fd socket file descriptor
+ * @param p array of teredo_packet receive buffers
+ * @param count number of entries in the @p p array (must be positive)
+ *
+ * @return the number of received packets, or -1 on error.
+ * See also teredo_recv_batch().
+ */
+int teredo_wait_recv_batch (int fd, struct teredo_packet *p, unsigned count);
+
 /**
  * Computes an IPv6 layer-3 checksum.
  * The input buffers do not need to be aligned neither of even length.
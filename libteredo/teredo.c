@@ -28,6 +28,7 @@
 
 #include <string.h> // memcpy()
 #include <stdbool.h>
+#include <stdlib.h> // malloc()
 #include <assert.h>
 
 #include <inttypes.h> /* for Mac OS X */
@@ -40,6 +41,8 @@
 #include <fcntl.h>
 #include <sys/socket.h>
 #include <errno.h>
+#include <time.h> // clock_gettime()
+#include <pthread.h>
 
 #ifndef SOL_IP
 # define SOL_IP IPPROTO_IP
@@ -64,7 +67,7 @@ const struct in6_addr teredo_cone =
 	{ { { 0xfe, 0x80, 0, 0, 0, 0, 0, 0,
 		    0x80, 0, 'T', 'E', 'R', 'E', 'D', 'O' } } };
 
-int teredo_socket (uint32_t bind_ip, uint16_t port)
+static int teredo_socket_inner (uint32_t bind_ip, uint16_t port, bool shared)
 {
 	struct sockaddr_in myaddr =
 	{
@@ -82,6 +85,17 @@ int teredo_socket (uint32_t bind_ip, uint16_t port)
 
 	fcntl (fd, F_SETFD, FD_CLOEXEC);
 
+#ifdef SO_REUSEPORT
+	if (shared
+	 && setsockopt (fd, SOL_SOCKET, SO_REUSEPORT, &(int){ 1 }, sizeof (int)))
+#else
+	if (shared) /* not supported */
+#endif
+	{
+		close (fd);
+		return -1;
+	}
+
 	if (bind (fd, (struct sockaddr *)&myaddr, sizeof (myaddr)))
 	{
 		close (fd);
@@ -114,6 +128,80 @@ int teredo_socket (uint32_t bind_ip, uint16_t port)
 }
 
 
+int teredo_socket (uint32_t bind_ip, uint16_t port)
+{
+	return teredo_socket_inner (bind_ip, port, false);
+}
+
+
+int teredo_socket_shared (uint32_t bind_ip, uint16_t port)
+{
+	return teredo_socket_inner (bind_ip, port, true);
+}
+
+
+/*
+ * Steering of incoming datagrams across a group of shared sockets
+ */
+#if defined (SO_REUSEPORT) && defined (SO_ATTACH_REUSEPORT_CBPF)
+# include <linux/filter.h>
+# ifndef BPF_MOD
+#  define BPF_MOD 0x90
+# endif
+#endif
+
+#define TEREDO_STEER_MULT 0x9E3779B1
+
+unsigned teredo_steer (uint32_t ip, uint16_t port, unsigned n)
+{
+	/* Must match the BPF program below, hence host byte order */
+	uint32_t h = (ntohl (ip) ^ ntohs (port)) * TEREDO_STEER_MULT;
+	h ^= h >> 16;
+	return h % n;
+}
+
+
+int teredo_socket_steer (int fd, unsigned n)
+{
+#if defined (SO_REUSEPORT) && defined (SO_ATTACH_REUSEPORT_CBPF)
+	struct sock_filter code[] =
+	{
+		/* X = IPv4 header length */
+		BPF_STMT (BPF_LDX | BPF_B | BPF_MSH, SKF_NET_OFF),
+		/* X = UDP source port */
+		BPF_STMT (BPF_LD | BPF_H | BPF_IND, SKF_NET_OFF),
+		BPF_STMT (BPF_MISC | BPF_TAX, 0),
+		/* A = IPv4 source address ^ UDP source port */
+		BPF_STMT (BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + 12),
+		BPF_STMT (BPF_ALU | BPF_XOR | BPF_X, 0),
+		/* A = teredo_steer (...) */
+		BPF_STMT (BPF_ALU | BPF_MUL | BPF_K, TEREDO_STEER_MULT),
+		BPF_STMT (BPF_MISC | BPF_TAX, 0),
+		BPF_STMT (BPF_ALU | BPF_RSH | BPF_K, 16),
+		BPF_STMT (BPF_ALU | BPF_XOR | BPF_X, 0),
+		BPF_STMT (BPF_ALU | BPF_MOD | BPF_K, n),
+		/* Return the index of the socket within the group */
+		BPF_STMT (BPF_RET | BPF_A, 0),
+	};
+	struct sock_fprog prog =
+	{
+		.len = sizeof (code) / sizeof (code[0]),
+		.filter = code,
+	};
+
+	if (n == 0)
+		return -1;
+	return setsockopt (fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+	                   &prog, sizeof (prog));
+#else
+	(void)fd;
+	(void)n;
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+
 static ssize_t
 teredo_recverr (int fd)
 {
@@ -130,8 +218,9 @@ teredo_recverr (int fd)
 }
 
 		
-int teredo_sendv (int fd, const struct iovec *iov, size_t count,
-                  uint32_t dest_ip, uint16_t dest_port)
+static int
+teredo_sendv_inner (int fd, const struct iovec *iov, size_t count,
+                    uint32_t dest_ip, uint16_t dest_port)
 {
 	struct sockaddr_in addr =
 	{
@@ -162,6 +251,242 @@ int teredo_sendv (int fd, const struct iovec *iov, size_t count,
 }
 
 
+/*
+ * Per-thread transmit batches
+ */
+#define TEREDO_TX_SLOT_SIZE 2048 /* larger datagrams are sent directly */
+#define TEREDO_TX_BATCH_MAX 1024 /* sendmmsg() limit (UIO_MAXIOV) */
+
+#ifdef HAVE_SENDMMSG
+typedef struct mmsghdr teredo_mmsghdr;
+#else
+typedef struct
+{
+	struct msghdr msg_hdr;
+	unsigned int msg_len;
+} teredo_mmsghdr;
+#endif
+
+typedef struct teredo_tx_batch
+{
+	int fd;
+	unsigned count, size;
+	unsigned long delay; /* microseconds */
+	struct timespec deadline;
+
+	teredo_mmsghdr *msgv;
+	struct iovec *iov;
+	struct sockaddr_in *addrv;
+	uint8_t *data;
+} teredo_tx_batch;
+
+static pthread_key_t tx_key;
+static pthread_once_t tx_once = PTHREAD_ONCE_INIT;
+
+static void teredo_tx_key_create (void)
+{
+	/* Pending datagrams of exiting threads are dropped */
+	(void)pthread_key_create (&tx_key, free);
+}
+
+
+static inline teredo_tx_batch *teredo_tx_get (void)
+{
+	(void)pthread_once (&tx_once, teredo_tx_key_create);
+	return (teredo_tx_batch *)pthread_getspecific (tx_key);
+}
+
+
+/**
+ * Sends as many messages as possible with a single system call.
+ * @return the number of sent messages, or -1 if the first one failed.
+ */
+static int teredo_sendmmsg (int fd, teredo_mmsghdr *msgv, unsigned count)
+{
+#ifdef HAVE_SENDMMSG
+	return sendmmsg (fd, msgv, count, 0);
+#else
+	unsigned n = 0;
+
+	do
+	{
+		ssize_t res = sendmsg (fd, &msgv[n].msg_hdr, 0);
+		if (res == -1)
+			break;
+		msgv[n].msg_len = res;
+	}
+	while (++n < count);
+
+	return n ? (int)n : -1;
+#endif
+}
+
+
+static void teredo_tx_flush (teredo_tx_batch *b)
+{
+	unsigned done = 0;
+
+	while (done < b->count)
+	{
+		int n = teredo_sendmmsg (b->fd, b->msgv + done, b->count - done);
+		if (n > 0)
+			done += n;
+		else
+		/* As with teredo_sendv(), retry until we have dequeued all pending
+		 * errors, then give up on the offending datagram. */
+		if (teredo_recverr (b->fd) == -1)
+			done++;
+	}
+	b->count = 0;
+}
+
+
+static bool teredo_tx_expired (const teredo_tx_batch *b)
+{
+	struct timespec now;
+
+	clock_gettime (CLOCK_MONOTONIC, &now);
+	return (now.tv_sec > b->deadline.tv_sec)
+	    || ((now.tv_sec == b->deadline.tv_sec)
+	     && (now.tv_nsec >= b->deadline.tv_nsec));
+}
+
+
+/**
+ * Appends a datagram to a transmit batch.
+ * @return the datagram byte length, or -1 if it must be sent directly.
+ */
+static int teredo_tx_enqueue (teredo_tx_batch *b, int fd,
+                              const struct iovec *iov, size_t count,
+                              uint32_t dest_ip, uint16_t dest_port)
+{
+	size_t len = 0;
+	for (size_t i = 0; i < count; i++)
+		len += iov[i].iov_len;
+
+	if ((b->count > 0) && ((b->fd != fd) || (len > TEREDO_TX_SLOT_SIZE)))
+		teredo_tx_flush (b); /* preserves ordering */
+	if (len > TEREDO_TX_SLOT_SIZE)
+		return -1;
+
+	unsigned n = b->count;
+	uint8_t *ptr = b->data + n * TEREDO_TX_SLOT_SIZE;
+
+	b->iov[n].iov_len = len;
+	for (size_t i = 0; i < count; i++)
+	{
+		memcpy (ptr, iov[i].iov_base, iov[i].iov_len);
+		ptr += iov[i].iov_len;
+	}
+	b->addrv[n].sin_addr.s_addr = dest_ip;
+	b->addrv[n].sin_port = dest_port;
+
+	if ((n == 0) && b->delay)
+	{
+		clock_gettime (CLOCK_MONOTONIC, &b->deadline);
+		b->deadline.tv_nsec += (b->delay % 1000000) * 1000;
+		b->deadline.tv_sec += b->delay / 1000000
+		                    + b->deadline.tv_nsec / 1000000000;
+		b->deadline.tv_nsec %= 1000000000;
+	}
+
+	b->fd = fd;
+	b->count = n + 1;
+
+	if ((b->count >= b->size) || (b->delay && teredo_tx_expired (b)))
+		teredo_tx_flush (b);
+	return len;
+}
+
+
+int teredo_send_batch_start (unsigned size, unsigned long delay)
+{
+	teredo_send_batch_stop ();
+	if (size < 2)
+		return 0; /* batching disabled */
+	if (size > TEREDO_TX_BATCH_MAX)
+		size = TEREDO_TX_BATCH_MAX;
+
+	teredo_tx_batch *b = malloc (sizeof (*b)
+		+ size * (sizeof (b->msgv[0]) + sizeof (b->iov[0])
+		          + sizeof (b->addrv[0]) + TEREDO_TX_SLOT_SIZE));
+	if (b == NULL)
+		return -1;
+
+	b->fd = -1;
+	b->count = 0;
+	b->size = size;
+	b->delay = delay;
+	b->msgv = (teredo_mmsghdr *)(b + 1);
+	b->iov = (struct iovec *)(b->msgv + size);
+	b->addrv = (struct sockaddr_in *)(b->iov + size);
+	b->data = (uint8_t *)(b->addrv + size);
+
+	for (unsigned i = 0; i < size; i++)
+	{
+		teredo_mmsghdr *m = b->msgv + i;
+
+		memset (b->addrv + i, 0, sizeof (b->addrv[i]));
+		b->addrv[i].sin_family = AF_INET;
+#ifdef HAVE_SA_LEN
+		b->addrv[i].sin_len = sizeof (struct sockaddr_in);
+#endif
+		b->iov[i].iov_base = b->data + i * TEREDO_TX_SLOT_SIZE;
+
+		memset (m, 0, sizeof (*m));
+		m->msg_hdr.msg_name = b->addrv + i;
+		m->msg_hdr.msg_namelen = sizeof (b->addrv[i]);
+		m->msg_hdr.msg_iov = b->iov + i;
+		m->msg_hdr.msg_iovlen = 1;
+	}
+
+	if (pthread_setspecific (tx_key, b))
+	{
+		free (b);
+		return -1;
+	}
+	return 0;
+}
+
+
+void teredo_send_batch_flush (void)
+{
+	teredo_tx_batch *b = teredo_tx_get ();
+
+	if ((b != NULL) && (b->count > 0))
+		teredo_tx_flush (b);
+}
+
+
+void teredo_send_batch_stop (void)
+{
+	teredo_tx_batch *b = teredo_tx_get ();
+
+	if (b != NULL)
+	{
+		if (b->count > 0)
+			teredo_tx_flush (b);
+		pthread_setspecific (tx_key, NULL);
+		free (b);
+	}
+}
+
+
+int teredo_sendv (int fd, const struct iovec *iov, size_t count,
+                  uint32_t dest_ip, uint16_t dest_port)
+{
+	teredo_tx_batch *b = teredo_tx_get ();
+
+	if (b != NULL)
+	{
+		int res = teredo_tx_enqueue (b, fd, iov, count, dest_ip, dest_port);
+		if (res != -1)
+			return res;
+	}
+	return teredo_sendv_inner (fd, iov, count, dest_ip, dest_port);
+}
+
+
 int teredo_send (int fd, const void *packet, size_t plen,
                  uint32_t dest_ip, uint16_t dest_port)
 {
@@ -170,48 +495,115 @@ int teredo_send (int fd, const void *packet, size_t plen,
 }
 
 
-static int teredo_recv_inner (int fd, struct teredo_packet *p, int flags)
+#define TEREDO_SEND_MANY_CHUNK 32 /* datagrams per system call */
+
+void teredo_send_many (int fd, const struct iovec *iov, size_t count,
+                       uint32_t dest_ip, uint16_t dest_port)
 {
-	struct sockaddr_in ad;
-#ifdef IP_PKTINFO
-	char cbuf[CMSG_SPACE (sizeof (struct in_pktinfo))];
-#elif defined(IP_RECVDSTADDR)
-	char cbuf[CMSG_SPACE (sizeof (struct in_addr))];
-#endif
-	struct iovec iov =
+	struct sockaddr_in addr =
 	{
-		.iov_base = p->buf.fill,
-		.iov_len = TEREDO_PACKET_SIZE
+		.sin_family = AF_INET,
+#ifdef HAVE_SA_LEN
+		.sin_len = sizeof (struct sockaddr_in),
+#endif
+		.sin_port = dest_port,
+		.sin_addr.s_addr = dest_ip
 	};
-	struct msghdr msg =
+	teredo_mmsghdr msgv[TEREDO_SEND_MANY_CHUNK];
+
+	/* Datagrams held back by the calling thread go first */
+	teredo_send_batch_flush ();
+
+	while (count > 0)
 	{
-		.msg_iov = &iov,
-		.msg_iovlen = 1,
-		.msg_name = &ad,
-		.msg_namelen = sizeof (ad),
-#if defined(IP_PKTINFO) || defined(IP_RECVDSTADDR)
-		.msg_control = cbuf,
-		.msg_controllen = sizeof (cbuf),
+		unsigned n = (count < TEREDO_SEND_MANY_CHUNK)
+			? count : TEREDO_SEND_MANY_CHUNK;
+
+		memset (msgv, 0, n * sizeof (msgv[0]));
+		for (unsigned i = 0; i < n; i++)
+		{
+			msgv[i].msg_hdr.msg_name = &addr;
+			msgv[i].msg_hdr.msg_namelen = sizeof (addr);
+			msgv[i].msg_hdr.msg_iov = (struct iovec *)(iov + i);
+			msgv[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		for (unsigned done = 0; done < n;)
+		{
+			int res = teredo_sendmmsg (fd, msgv + done, n - done);
+			if (res > 0)
+				done += res;
+			else
+			/* As with teredo_tx_flush(), give up on the offending datagram
+			 * once all pending errors are dequeued. */
+			if (teredo_recverr (fd) == -1)
+				done++;
+		}
+
+		iov += n;
+		count -= n;
+	}
+}
+
+
+#if defined(IP_PKTINFO)
+# define TEREDO_CMSG_SPACE CMSG_SPACE (sizeof (struct in_pktinfo))
+#elif defined(IP_RECVDSTADDR)
+# define TEREDO_CMSG_SPACE CMSG_SPACE (sizeof (struct in_addr))
 #endif
-	};
 
-	// Receive a UDP packet
-	ssize_t length = recvmsg (fd, &msg, flags);
-	if (length == -1)
-		teredo_recverr (fd);
-	if (length < 2) // too small or error
+/**
+ * Sets up the message header to receive a Teredo packet into @p p.
+ */
+static void teredo_recv_prepare (struct teredo_packet *restrict p,
+                                 struct msghdr *restrict msg,
+                                 struct iovec *restrict iov,
+                                 struct sockaddr_in *restrict ad,
+                                 void *restrict cbuf)
+{
+	iov->iov_base = p->buf.fill;
+	iov->iov_len = TEREDO_PACKET_SIZE;
+
+	memset (msg, 0, sizeof (*msg));
+	msg->msg_iov = iov;
+	msg->msg_iovlen = 1;
+	msg->msg_name = ad;
+	msg->msg_namelen = sizeof (*ad);
+#ifdef TEREDO_CMSG_SPACE
+	msg->msg_control = cbuf;
+	msg->msg_controllen = TEREDO_CMSG_SPACE;
+#else
+	(void)cbuf;
+#endif
+}
+
+
+/**
+ * Parses a received UDP datagram as a Teredo packet.
+ *
+ * @param msg message header that was passed to recvmsg()
+ * @param length byte length of the received datagram
+ *
+ * @return 0 on success, -1 if the datagram is malformatted.
+ */
+static int teredo_recv_parse (struct teredo_packet *restrict p,
+                              struct msghdr *restrict msg, ssize_t length)
+{
+	const struct sockaddr_in *ad = (const struct sockaddr_in *)msg->msg_name;
+
+	if (length < 2) // too small
 		return -1;
 
-	p->source_ipv4 = ad.sin_addr.s_addr;
-	p->source_port = ad.sin_port;
+	p->source_ipv4 = ad->sin_addr.s_addr;
+	p->source_port = ad->sin_port;
 	p->dest_ipv4 = 0;
 
-#if defined(IP_PKTINFO) || defined(IP_RECVDSTADDR)
+#ifdef TEREDO_CMSG_SPACE
 	// Internal outer destination IPv4 address
 	// (mostly useful for funky multi-homed hosts)
-	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR (&msg);
+	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR (msg);
 	     cmsg != NULL;
-	     cmsg = CMSG_NXTHDR (&msg, cmsg))
+	     cmsg = CMSG_NXTHDR (msg, cmsg))
 	{
 # ifdef IP_PKTINFO
 		if ((cmsg->cmsg_level == IPPROTO_IP)
@@ -303,106 +695,166 @@ static int teredo_recv_inner (int fd, struct teredo_packet *p, int flags)
 }
 
 
-int teredo_recv (int fd, struct teredo_packet *p)
+static int teredo_recv_inner (int fd, struct teredo_packet *p, int flags)
 {
-	return teredo_recv_inner (fd, p, MSG_DONTWAIT);
-}
-
-
-#if defined (__FreeBSD__) || defined (__APPLE__)
-# define HAVE_BROKEN_RECVFROM 1
-# include <sys/poll.h>
+	struct sockaddr_in ad;
+	struct iovec iov;
+	struct msghdr msg;
+#ifdef TEREDO_CMSG_SPACE
+	char cbuf[TEREDO_CMSG_SPACE];
+#else
+	char *cbuf = NULL;
 #endif
 
-int teredo_wait_recv (int fd, struct teredo_packet *p)
-{
-#ifdef HAVE_BROKEN_RECVFROM
-	// recvfrom() is not a cancellation point on FreeBSD 6.1...
-	struct pollfd ufd = { .fd = fd, .events = POLLIN };
-	if (poll (&ufd, 1, -1) == -1)
+	teredo_recv_prepare (p, &msg, &iov, &ad, cbuf);
+
+	// Receive a UDP packet
+	ssize_t length = recvmsg (fd, &msg, flags);
+	if (length == -1)
+	{
+		teredo_recverr (fd);
 		return -1;
-#endif
+	}
 
-	return teredo_recv_inner (fd, p, 0);
+	return teredo_recv_parse (p, &msg, length);
 }
 
 
-/* This does not fit anywhere and is needed by both relay and server */
-#include <stdbool.h>
-
 /**
- * Computes an Internet checksum over a scatter-gather array.
- * Buffers need not be aligned neither of even length.
- * Jumbograms are supported (though you probably don't care).
+ * Marks a batch entry as an invalid packet, so that the caller drops it.
  */
-static uint16_t in_cksum (const struct iovec *iov, size_t n)
+static inline void teredo_recv_invalidate (struct teredo_packet *p)
+{
+	p->ip6 = (struct ip6_hdr *)p->buf.fill;
+	p->ip6_len = 0;
+}
+
+
+static int
+teredo_recv_batch_inner (int fd, struct teredo_packet *p, unsigned count,
+                         int flags)
 {
-	uint32_t sum = 0;
+	assert (count > 0);
+
+#ifdef HAVE_RECVMMSG
+	struct mmsghdr msgv[count];
+	struct iovec iov[count];
+	struct sockaddr_in ad[count];
+# ifdef TEREDO_CMSG_SPACE
 	union
 	{
-		uint16_t word;
-		uint8_t  bytes[2];
-	} w;
-	bool odd = false;
+		struct cmsghdr hdr;
+		char buf[TEREDO_CMSG_SPACE];
+	} cbuf[count];
+# endif
+
+	for (unsigned i = 0; i < count; i++)
+	{
+# ifdef TEREDO_CMSG_SPACE
+		void *cb = cbuf[i].buf;
+# else
+		void *cb = NULL;
+# endif
+		teredo_recv_prepare (p + i, &msgv[i].msg_hdr, iov + i, ad + i, cb);
+		msgv[i].msg_len = 0;
+	}
+
+	int n = recvmmsg (fd, msgv, count, flags, NULL);
+	if (n == -1)
+	{
+		teredo_recverr (fd);
+		return -1;
+	}
 
-	while (n > 0)
+	for (int i = 0; i < n; i++)
+		if (teredo_recv_parse (p + i, &msgv[i].msg_hdr, msgv[i].msg_len))
+			teredo_recv_invalidate (p + i);
+
+	return n;
+#else
+	/* Emulates recvmmsg() with one recvmsg() per datagram */
+	unsigned n = 0;
+
+	do
 	{
-		const uint8_t *ptr = iov->iov_base;
+		struct sockaddr_in ad;
+		struct iovec iov;
+		struct msghdr msg;
+# ifdef TEREDO_CMSG_SPACE
+		char cbuf[TEREDO_CMSG_SPACE];
+# else
+		char *cbuf = NULL;
+# endif
+
+		teredo_recv_prepare (p + n, &msg, &iov, &ad, cbuf);
 
-		for (size_t len = iov->iov_len; len > 0; len--)
+		ssize_t length = recvmsg (fd, &msg, flags);
+		if (length == -1)
 		{
-			if (odd)
-			{
-				w.bytes[1] = *ptr++;
-				sum += w.word;
-				if (sum > 0xffff)
-					sum -= 0xffff;
-			}
-			else
-				w.bytes[0] = *ptr++;
-			odd = !odd;
+			teredo_recverr (fd);
+			break;
 		}
 
-		iov++;
-		n--;
+		if (teredo_recv_parse (p + n, &msg, length))
+			teredo_recv_invalidate (p + n);
+		flags = MSG_DONTWAIT; /* only ever wait for the first one */
 	}
+	while (++n < count);
 
-	if (odd)
-	{
-		w.bytes[1] = 0;
-		sum += w.word;
-		if (sum > 0xffff)
-			sum -= 0xffff;
-	}
+	return n ? (int)n : -1;
+#endif
+}
 
-	return sum ^ 0xffff;
+
+int teredo_recv (int fd, struct teredo_packet *p)
+{
+	return teredo_recv_inner (fd, p, MSG_DONTWAIT);
 }
 
 
-uint16_t
-teredo_cksum (const void *src, const void *dst, uint8_t protocol,
-              const struct iovec *data, size_t n)
+int teredo_recv_batch (int fd, struct teredo_packet *p, unsigned count)
 {
-	struct iovec iov[3 + n];
-	size_t plen = 0;
-	for (size_t i = 0; i < n; i++)
-	{
-		iov[3 + i].iov_base = data[i].iov_base;
-		plen += (iov[3 + i].iov_len = data[i].iov_len);
-	}
+	return teredo_recv_batch_inner (fd, p, count, MSG_DONTWAIT);
+}
 
-	uint32_t pseudo[4] = { htonl (plen), htonl (protocol) };
-	iov[0].iov_base = (void *)src;
-	iov[0].iov_len = 16;
-	iov[1].iov_base = (void *)dst;
-	iov[1].iov_len = 16;
-	iov[2].iov_base = pseudo;
-	iov[2].iov_len = 8;
 
-	return in_cksum (iov, 3 + n);
+#if defined (__FreeBSD__) || defined (__APPLE__)
+# define HAVE_BROKEN_RECVFROM 1
+# include <sys/poll.h>
+#endif
+
+int teredo_wait_recv (int fd, struct teredo_packet *p)
+{
+#ifdef HAVE_BROKEN_RECVFROM
+	// recvfrom() is not a cancellation point on FreeBSD 6.1...
+	struct pollfd ufd = { .fd = fd, .events = POLLIN };
+	if (poll (&ufd, 1, -1) == -1)
+		return -1;
+#endif
+
+	return teredo_recv_inner (fd, p, 0);
 }
 
 
+#ifndef MSG_WAITFORONE
+# define MSG_WAITFORONE 0
+#endif
+
+int teredo_wait_recv_batch (int fd, struct teredo_packet *p, unsigned count)
+{
+#ifdef HAVE_BROKEN_RECVFROM
+	struct pollfd ufd = { .fd = fd, .events = POLLIN };
+	if (poll (&ufd, 1, -1) == -1)
+		return -1;
+#endif
+
+	return teredo_recv_batch_inner (fd, p, count, MSG_WAITFORONE);
+}
+
+
+/* This does not fit anywhere and is needed by both relay and server */
+#include <stdbool.h>
+
 void teredo_close (int fd)
 {
 	(void)close (fd);
@@ -0,0 +1,245 @@
+/*
+ * cksum.c - Libteredo Internet checksum tests
+ */
+
+/***********************************************************************
+ *  Copyright © 2007 Rémi Denis-Courmont.                              *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#undef NDEBUG
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/ip6.h>
+#include <netinet/icmp6.h>
+
+#include "teredo.h"
+#include "teredo-udp.h"
+#include "checksum.h"
+
+static const char *const engines[] = { "scalar", "sse2", "avx2", "neon" };
+
+/* Byte-wise reference implementation (RFC 1071) */
+static uint16_t ref_cksum (const void *src, const void *dst, uint8_t proto,
+                           const struct iovec *iov, size_t n)
+{
+	uint32_t sum = 0, plen = 0;
+	bool odd = false;
+	union
+	{
+		uint16_t word;
+		uint8_t bytes[2];
+	} w;
+
+	for (size_t i = 0; i < n; i++)
+		plen += iov[i].iov_len;
+
+	uint32_t pseudo[2] = { htonl (plen), htonl (proto) };
+	struct iovec all[3 + n];
+	all[0].iov_base = (void *)src;
+	all[0].iov_len = 16;
+	all[1].iov_base = (void *)dst;
+	all[1].iov_len = 16;
+	all[2].iov_base = pseudo;
+	all[2].iov_len = 8;
+	memcpy (all + 3, iov, n * sizeof (*iov));
+
+	for (size_t i = 0; i < 3 + n; i++)
+	{
+		const uint8_t *p = all[i].iov_base;
+
+		for (size_t len = all[i].iov_len; len > 0; len--)
+		{
+			w.bytes[odd] = *p++;
+			if (odd)
+			{
+				sum += w.word;
+				if (sum > 0xffff)
+					sum -= 0xffff;
+			}
+			odd = !odd;
+		}
+	}
+
+	if (odd)
+	{
+		w.bytes[1] = 0;
+		sum += w.word;
+		if (sum > 0xffff)
+			sum -= 0xffff;
+	}
+	return sum ^ 0xffff;
+}
+
+
+static uint8_t buf[70000 + 64];
+static const uint8_t addr[2][16] = {
+	{ 0xfe, 0x80, 0, 0, 0, 0, 0, 0, 0x80, 0, 'T', 'E', 'R', 'E', 'D', 'O' },
+	{ 0x20, 0x01, 0, 0, 0x53, 0xaa, 0x06, 0x4c, 0, 0, 0, 0, 0, 0, 0, 1 },
+};
+
+
+/* Random lengths, alignments and scatter-gather splits */
+static void test_conformance (void)
+{
+	for (unsigned i = 0; i < 20000; i++)
+	{
+		size_t off = rand () % 64, len, n = 1 + rand () % 6;
+		struct iovec iov[6];
+
+		if (i < 1000)
+			len = i; /* all small lengths */
+		else
+			len = rand () % ((i % 100) ? 1500 : 70000);
+
+		/* splits the data at random points */
+		size_t rest = len, pos = off;
+		for (size_t j = 0; j < n; j++)
+		{
+			size_t l = (j == n - 1) ? rest : (rest ? rand () % (rest + 1) : 0);
+
+			iov[j].iov_base = buf + pos;
+			iov[j].iov_len = l;
+			pos += l;
+			rest -= l;
+		}
+
+		uint8_t proto = rand ();
+		assert (teredo_cksum (addr[0], addr[1], proto, iov, n)
+		        == ref_cksum (addr[0], addr[1], proto, iov, n));
+	}
+}
+
+
+/* Checksums of all-zero and all-one data */
+static void test_edges (void)
+{
+	static const uint8_t zero[40], ones[] = { 0xff, 0xff, 0xff, 0xff };
+	struct iovec iov = { (void *)ones, sizeof (ones) };
+
+	assert (teredo_cksum (zero, zero, 0, &iov, 0) == 0xffff);
+	assert (teredo_cksum (zero, zero, 0, &iov, 1)
+	        == ref_cksum (zero, zero, 0, &iov, 1));
+	iov.iov_len = 3;
+	assert (teredo_cksum (zero, zero, 0, &iov, 1)
+	        == ref_cksum (zero, zero, 0, &iov, 1));
+}
+
+
+/* RFC 1624 incremental update versus full computation */
+static void test_adjust (void)
+{
+	for (unsigned i = 0; i < 10000; i++)
+	{
+		size_t len = 8 + 2 * (rand () % 700);
+		size_t off = 2 * (rand () % ((len - 8) / 2 + 1));
+		size_t flen = 2 * (rand () % ((len - off) / 2 + 1));
+		uint8_t *data = buf + 1 + rand () % 16, old[1500];
+		struct iovec iov = { data, len };
+
+		uint16_t before = teredo_cksum (addr[0], addr[1], 58, &iov, 1);
+		memcpy (old, data + off, flen);
+		for (size_t j = 0; j < flen; j++)
+			data[off + j] = (i & 1) ? rand () : 0;
+
+		uint16_t after = teredo_cksum_adjust (before, old, data + off, flen);
+		assert (after == teredo_cksum (addr[0], addr[1], 58, &iov, 1));
+
+		/* restores the data for the next iteration */
+		memcpy (data + off, old, flen);
+	}
+
+	/* rewriting an IPv6 address in a pseudo-header */
+	struct iovec iov = { buf, 1280 };
+	uint16_t c = teredo_cksum (addr[0], addr[1], 58, &iov, 1);
+	c = teredo_cksum_adjust (c, addr[1], addr[0], 16);
+	assert (c == teredo_cksum (addr[0], addr[0], 58, &iov, 1));
+}
+
+
+typedef uint16_t (*cksum_fn) (const void *, const void *, uint8_t,
+                               const struct iovec *, size_t);
+
+static void bench (const char *name, cksum_fn fn, size_t len, size_t align)
+{
+	struct iovec iov = { buf + align, len };
+	unsigned long count = 0;
+	struct timespec start, now;
+	uint16_t c = 0;
+
+	clock_gettime (CLOCK_MONOTONIC, &start);
+	do
+	{
+		for (unsigned i = 0; i < 1000; i++)
+			c += fn (addr[0], addr[1], 58, &iov, 1);
+		count += 1000;
+		clock_gettime (CLOCK_MONOTONIC, &now);
+	}
+	while ((now.tv_sec - start.tv_sec) * 1000000000L
+	       + (now.tv_nsec - start.tv_nsec) < 100000000L);
+
+	double secs = (now.tv_sec - start.tv_sec)
+	            + (now.tv_nsec - start.tv_nsec) / 1e9;
+	printf ("%-6s %5zu bytes (offset %zu): %8.0f MB/s (%04x)\n", name, len,
+	        align, count * len / secs / 1e6, c);
+}
+
+
+int main (void)
+{
+	for (size_t i = 0; i < sizeof (buf); i++)
+		buf[i] = rand ();
+
+	/* RFC 1071 example: 00 01 f2 03 f4 f5 f6 f7 sums to ddf2,
+	 * plus 0008 for the length in the pseudo-header */
+	static const uint8_t zero[16], rfc[] =
+		{ 0x00, 0x01, 0xf2, 0x03, 0xf4, 0xf5, 0xf6, 0xf7 };
+	struct iovec iov = { (void *)rfc, sizeof (rfc) };
+
+	assert (teredo_cksum (zero, zero, 0, &iov, 1) == htons (0x2205));
+
+	for (size_t i = 0; i < sizeof (engines) / sizeof (engines[0]); i++)
+	{
+		if (teredo_cksum_select (engines[i]))
+		{
+			printf ("%-6s not supported\n", engines[i]);
+			continue;
+		}
+
+		test_conformance ();
+		test_edges ();
+		test_adjust ();
+		bench (engines[i], teredo_cksum, 1280, 0);
+		bench (engines[i], teredo_cksum, 1280, 1);
+		bench (engines[i], teredo_cksum, 65536, 0);
+	}
+	bench ("bytes", ref_cksum, 1280, 0);
+
+	assert (teredo_cksum_select ("bogus") == -1);
+	assert (teredo_cksum_select (NULL) == 0);
+	return 0;
+}
@@ -26,12 +26,86 @@
 #undef NDEBUG
 #include <assert.h>
 #include <sched.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "clock.h"
 
+#define BENCH_THREADS 4
+
+static struct timespec fake;
+
+static void fake_source (struct timespec *now)
+{
+	*now = fake;
+}
+
+
+static bool stop;
+
+static void *bench_thread (void *data)
+{
+	unsigned long *count = data;
+	teredo_clock_t last = 0;
+
+	while (!__atomic_load_n (&stop, __ATOMIC_RELAXED))
+	{
+		for (unsigned i = 0; i < 1000; i++)
+		{
+			teredo_clock_t now = teredo_clock ();
+			assert (now >= last);
+			last = now;
+		}
+		*count += 1000;
+	}
+	return NULL;
+}
+
+
+/**
+ * Measures clock reads per second with several threads reading at once.
+ */
+static void bench (void)
+{
+	pthread_t th[BENCH_THREADS];
+	unsigned long count[BENCH_THREADS] = { 0 }, total = 0;
+	unsigned n;
+
+	for (n = 0; n < BENCH_THREADS; n++)
+		if (pthread_create (th + n, NULL, bench_thread, count + n))
+			break;
+
+	nanosleep (&(struct timespec){ 0, 500000000 }, NULL);
+	__atomic_store_n (&stop, true, __ATOMIC_RELAXED);
+
+	for (unsigned i = 0; i < n; i++)
+	{
+		pthread_join (th[i], NULL);
+		total += count[i];
+	}
+	printf ("%u threads: %lu reads/s\n", n, total * 2);
+}
+
+
 int main (void)
 {
+	/* fake time source */
+	fake.tv_sec = 1000;
+	fake.tv_nsec = 999999999;
+	teredo_clock_set_source (fake_source);
+	assert (teredo_clock () == 1000);
+	assert (teredo_clock_ms () == 1000999);
+	fake.tv_sec++;
+	fake.tv_nsec = 0;
+	assert (teredo_clock () == 1001);
+	assert (teredo_clock_ms () == 1001000);
+	teredo_clock_set_source (NULL);
+
+	/* system clock */
 	teredo_clock_t start = teredo_clock (), now;
+	teredo_clock_ms_t start_ms = teredo_clock_ms ();
 
 	do
 	{
@@ -41,6 +115,9 @@ int main (void)
 	while (now == start);
 
 	assert (now > start);
+	assert (teredo_clock_ms () > start_ms);
+	assert (teredo_clock_ms () / 1000 >= now);
 
+	bench ();
 	return 0;
 }
@@ -0,0 +1,119 @@
+/*
+ * hashtable.c - Libteredo hash table and SipHash regression tests
+ */
+
+/***********************************************************************
+ *  Copyright © 2007 Rémi Denis-Courmont.                              *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#undef NDEBUG
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "siphash.h"
+#include "hashtable.h"
+
+typedef struct item
+{
+	unsigned value;
+	uint8_t key[TEREDO_HTAB_KEY_LEN];
+} item;
+
+#define ITEMS 10000
+
+static uint8_t secret[TEREDO_SIPHASH_KEY_LEN];
+
+static uint32_t hash (const uint8_t *key)
+{
+	return (uint32_t)teredo_siphash (secret, key, TEREDO_HTAB_KEY_LEN);
+}
+
+
+static void make_key (uint8_t *key, unsigned i)
+{
+	memset (key, 0, TEREDO_HTAB_KEY_LEN);
+	memcpy (key + 4, &i, sizeof (i));
+}
+
+
+int main (void)
+{
+	/* Reference vector from the SipHash paper */
+	uint8_t msg[15];
+	for (unsigned i = 0; i < sizeof (secret); i++)
+		secret[i] = i;
+	for (unsigned i = 0; i < sizeof (msg); i++)
+		msg[i] = i;
+	assert (teredo_siphash (secret, msg, sizeof (msg))
+	        == UINT64_C(0xa129ca6149be45e5));
+
+	teredo_htab t;
+	teredo_htab_init (&t, offsetof (item, key));
+
+	item *items = malloc (ITEMS * sizeof (*items));
+	assert (items != NULL);
+
+	for (unsigned i = 0; i < ITEMS; i++)
+	{
+		items[i].value = i;
+		make_key (items[i].key, i);
+		assert (teredo_htab_find (&t, hash (items[i].key),
+		                          items[i].key) == NULL);
+		assert (teredo_htab_insert (&t, hash (items[i].key), items + i) == 0);
+	}
+	assert (t.count == ITEMS);
+
+	for (unsigned i = 0; i < ITEMS; i++)
+	{
+		uint8_t key[TEREDO_HTAB_KEY_LEN];
+
+		make_key (key, i);
+		item *it = teredo_htab_find (&t, hash (key), key);
+		assert ((it != NULL) && (it->value == i));
+
+		make_key (key, i + ITEMS);
+		assert (teredo_htab_find (&t, hash (key), key) == NULL);
+	}
+
+	/* Removes every other item */
+	for (unsigned i = 0; i < ITEMS; i += 2)
+	{
+		uint8_t *key = items[i].key;
+		assert (teredo_htab_remove (&t, hash (key), key) == items + i);
+		assert (teredo_htab_remove (&t, hash (key), key) == NULL);
+	}
+	assert (t.count == ITEMS / 2);
+
+	for (unsigned i = 0; i < ITEMS; i++)
+	{
+		uint8_t *key = items[i].key;
+		item *it = teredo_htab_find (&t, hash (key), key);
+		assert ((i & 1) ? (it == items + i) : (it == NULL));
+	}
+
+	teredo_htab_destroy (&t);
+	assert (teredo_htab_find (&t, hash (items[1].key), items[1].key) == NULL);
+	free (items);
+	return 0;
+}
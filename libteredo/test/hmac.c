@@ -28,6 +28,7 @@
 #include <stdbool.h>
 #include <string.h>
 #include <stdio.h>
+#include <time.h>
 
 #include <inttypes.h> /* for Mac OS X */
 #include <sys/types.h>
@@ -38,6 +39,8 @@
 #include "teredo.h"
 #include "tunnel.h"
 #include "security.h"
+#include "md5.h"
+#include "siphash.h"
 
 static const uint32_t stamp = 0x12345678;
 
@@ -102,11 +105,206 @@ static int test_rs (void)
 }
 
 
+static int test_cookie (void)
+{
+	uint8_t c1[LIBTEREDO_COOKIE_LEN], c2[LIBTEREDO_COOKIE_LEN];
+	uint32_t ipv4 = htonl (0xc0000234);
+	uint16_t port = htons (12345);
+
+	teredo_get_cookie (ipv4, port, c1);
+	teredo_get_cookie (ipv4, port, c2);
+	if (memcmp (c1, c2, sizeof (c1)))
+		return 1;
+
+	/* different peers must get different cookies */
+	teredo_get_cookie (ipv4, port + 1, c2);
+	if (!memcmp (c1, c2, sizeof (c1)))
+		return 1;
+	teredo_get_cookie (ipv4 ^ 1, port, c2);
+	if (!memcmp (c1, c2, sizeof (c1)))
+		return 1;
+
+	return 0;
+}
+
+
+/* Each peer list must get its own hash key */
+static int test_list_key (void)
+{
+	uint8_t k1[TEREDO_SIPHASH_KEY_LEN], k2[TEREDO_SIPHASH_KEY_LEN];
+
+	teredo_get_list_key (k1);
+	teredo_get_list_key (k2);
+	return !memcmp (k1, k2, sizeof (k1));
+}
+
+
+/* SipHash-2-4-128 reference vectors (key 00..0f, message 00, 01...) */
+static int test_siphash128 (void)
+{
+	uint8_t key[TEREDO_SIPHASH_KEY_LEN], msg[15], hash[16];
+
+	for (unsigned i = 0; i < sizeof (key); i++)
+		key[i] = i;
+	for (unsigned i = 0; i < sizeof (msg); i++)
+		msg[i] = i;
+
+	teredo_siphash128 (key, msg, 0, hash);
+	if (memcmp (hash, "\xa3\x81\x7f\x04\xba\x25\xa8\xe6"
+	                  "\x6d\xf6\x72\x14\xc7\x55\x02\x93", 16))
+		return 1;
+
+	teredo_siphash128 (key, msg, sizeof (msg), hash);
+	if (memcmp (hash, "\x54\x93\xe9\x99\x33\xb0\xa8\x11"
+	                  "\x7e\x08\xec\x0f\x97\xcf\xc3\xd9", 16))
+		return 1;
+
+	return 0;
+}
+
+
+/* HMAC-MD5 from scratch, as teredo_hash() used to compute it */
+static void hmac_md5 (const uint8_t *key, const void *data, size_t len,
+                      uint8_t *restrict hash)
+{
+	uint8_t pad[64];
+	md5_state_t ctx;
+
+	memset (pad, 0x36, sizeof (pad));
+	for (unsigned i = 0; i < 16; i++)
+		pad[i] ^= key[i];
+	md5_init (&ctx);
+	md5_append (&ctx, pad, sizeof (pad));
+	md5_append (&ctx, data, len);
+	md5_finish (&ctx, hash);
+
+	memset (pad, 0x5c, sizeof (pad));
+	for (unsigned i = 0; i < 16; i++)
+		pad[i] ^= key[i];
+	md5_init (&ctx);
+	md5_append (&ctx, pad, sizeof (pad));
+	md5_append (&ctx, hash, 16);
+	md5_finish (&ctx, hash);
+}
+
+
+/* RFC 2202 test case 2 with a 16 bytes key, fresh and from midstates */
+static int test_midstate (void)
+{
+	static const uint8_t key[16] = "Jefe\0\0\0\0\0\0\0\0\0\0\0";
+	static const char msg[] = "what do ya want for nothing?";
+	static const uint8_t ref[16] =
+		"\x75\x0c\x78\x3e\x6a\xb0\xb5\x03"
+		"\xea\xa8\x6e\x31\x0a\x5d\xb7\x38";
+	uint8_t pad[64], hash[16];
+	md5_state_t inner, outer, ctx;
+
+	hmac_md5 (key, msg, sizeof (msg) - 1, hash);
+	if (memcmp (hash, ref, 16))
+		return 1;
+
+	memset (pad, 0x36, sizeof (pad));
+	memcpy (pad, "\x7c\x53\x50\x53", 4); /* "Jefe" ^ 0x36 */
+	md5_init (&inner);
+	md5_append (&inner, pad, sizeof (pad));
+	memset (pad, 0x5c, sizeof (pad));
+	memcpy (pad, "\x16\x39\x3a\x39", 4); /* "Jefe" ^ 0x5c */
+	md5_init (&outer);
+	md5_append (&outer, pad, sizeof (pad));
+
+	/* states are reused, so compute twice */
+	for (unsigned i = 0; i < 2; i++)
+	{
+		ctx = inner;
+		md5_append (&ctx, (const uint8_t *)msg, sizeof (msg) - 1);
+		md5_finish (&ctx, hash);
+		ctx = outer;
+		md5_append (&ctx, hash, 16);
+		md5_finish (&ctx, hash);
+		if (memcmp (hash, ref, 16))
+			return 1;
+	}
+	return 0;
+}
+
+
+static uint8_t sink;
+
+static void bench (const char *name, void (*fn) (unsigned))
+{
+	unsigned long count = 0;
+	struct timespec start, now;
+
+	clock_gettime (CLOCK_MONOTONIC, &start);
+	do
+	{
+		for (unsigned i = 0; i < 1000; i++)
+			fn (i);
+		count += 1000;
+		clock_gettime (CLOCK_MONOTONIC, &now);
+	}
+	while ((now.tv_sec - start.tv_sec) * 1000000000L
+	       + (now.tv_nsec - start.tv_nsec) < 100000000L);
+
+	double ns = (now.tv_sec - start.tv_sec) * 1e9
+	          + (now.tv_nsec - start.tv_nsec);
+	printf ("%-24s %6.0f ns/op\n", name, ns / count);
+}
+
+
+static void bench_uncached (unsigned i)
+{
+	static const uint8_t key[16];
+	uint8_t data[12] = { 0 }, hash[16];
+
+	memcpy (data, &i, sizeof (i));
+	hmac_md5 (key, data, sizeof (data), hash);
+	sink ^= hash[0];
+}
+
+
+static void bench_nonce (unsigned i)
+{
+	uint8_t nonce[LIBTEREDO_NONCE_LEN];
+
+	teredo_get_nonce (stamp, i, 3544, nonce);
+	sink ^= nonce[0];
+}
+
+
+static void bench_pinghash (unsigned i)
+{
+	struct in6_addr src = in6addr_any, dst = in6addr_loopback;
+	uint8_t hmac[LIBTEREDO_HMAC_LEN];
+
+	teredo_get_pinghash (stamp + i, &src, &dst, hmac);
+	sink ^= hmac[6];
+}
+
+
+static void bench_cookie (unsigned i)
+{
+	uint8_t cookie[LIBTEREDO_COOKIE_LEN];
+
+	teredo_get_cookie (i, 3544, cookie);
+	sink ^= cookie[0];
+}
+
+
 int main (void)
 {
 	assert (teredo_init_HMAC () == 0);
 	assert (test_ping () == 0);
 	assert (test_rs () == 0);
+	assert (test_cookie () == 0);
+	assert (test_list_key () == 0);
+	assert (test_siphash128 () == 0);
+	assert (test_midstate () == 0);
+
+	bench ("HMAC-MD5 (uncached)", bench_uncached);
+	bench ("HMAC-MD5 nonce (cached)", bench_nonce);
+	bench ("SipHash-128 ping hash", bench_pinghash);
+	bench ("SipHash-64 cookie", bench_cookie);
 
 	teredo_deinit_HMAC ();
 	return 0;
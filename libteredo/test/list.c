@@ -30,6 +30,7 @@
 
 #include <inttypes.h> /* for Mac OS X */
 #include <sys/types.h>
+#include <sys/socket.h>
 #include <netinet/in.h>
 #include <unistd.h>
 
@@ -163,6 +164,234 @@ static int test_list (teredo_peerlist *l)
 }
 
 
+static int test_admission (void)
+{
+	struct in6_addr addr = { { } }, src = { { } };
+	teredo_list_stats st;
+	bool create;
+
+	puts ("Admission quotas test...");
+	teredo_peerlist *l = teredo_list_create (1000, 3);
+	if (l == NULL)
+		return -1;
+
+	/* per-source quota */
+	for (unsigned i = 0; i < 300; i++)
+	{
+		addr.s6_addr[11] = i >> 8;
+		addr.s6_addr[12] = i;
+		if (teredo_list_admit (l, &addr, &src, 0, &create) != NULL)
+			teredo_list_release (l);
+	}
+
+	/* per-/24 quota */
+	addr.s6_addr[0] = 1;
+	addr.s6_addr[11] = 0;
+	for (unsigned i = 0; i < 100; i++)
+	{
+		addr.s6_addr[12] = i;
+		if (teredo_list_admit (l, &addr, NULL, htonl (0xc0000200 + i),
+		                       &create) != NULL)
+			teredo_list_release (l);
+	}
+
+	teredo_list_get_stats (l, &st);
+	if ((st.peers != 256 + 64) || (st.untrusted != 256 + 64)
+	 || (st.refused_source != 300 - 256) || (st.refused_net != 100 - 64))
+		return -1;
+
+	/* trusted peers do not count against quotas */
+	addr.s6_addr[12] = 0;
+	teredo_peer *p = teredo_list_admit (l, &addr, NULL, 0, &create);
+	if ((p == NULL) || create)
+		return -1;
+	p->trusted = 1;
+	teredo_list_release (l);
+	teredo_list_get_stats (l, &st);
+	if (st.untrusted != 256 + 63)
+		return -1;
+	teredo_list_destroy (l);
+
+	puts ("Admission eviction test...");
+	l = teredo_list_create (8, 3);
+	if (l == NULL)
+		return -1;
+
+	addr.s6_addr[0] = 2;
+	for (unsigned i = 0; i < 100; i++)
+	{
+		addr.s6_addr[12] = i;
+		if (teredo_list_admit (l, &addr, NULL, 0, &create) != NULL)
+			teredo_list_release (l);
+		teredo_list_get_stats (l, &st);
+		if ((st.peers > 8) || (st.untrusted > 4))
+			return -1;
+	}
+
+	if (st.evicted + st.refused_full != 100 - 4)
+		return -1;
+	teredo_list_destroy (l);
+	return 0;
+}
+
+
+static int test_trusted (void)
+{
+	struct in6_addr addr = { { } };
+	teredo_trusted t;
+	bool create;
+
+	puts ("Lock-less trusted lookup test...");
+	teredo_peerlist *l = teredo_list_create (16, 3);
+	if (l == NULL)
+		return -1;
+
+	teredo_peer *p = teredo_list_lookup (l, &addr, &create);
+	if ((p == NULL) || !create)
+		return -1;
+	p->trusted = 1;
+	p->mapped_addr = htonl (0xc0000201);
+	p->mapped_port = htons (3544);
+	teredo_list_release (l);
+
+	addr.s6_addr[12] = 1;
+	p = teredo_list_lookup (l, &addr, &create);
+	if ((p == NULL) || !create)
+		return -1;
+	teredo_list_release (l);
+
+	if (teredo_list_read_lock ())
+		return -1;
+	/* untrusted peer */
+	if (teredo_list_find_trusted (l, &addr, &t) == 0)
+		return -1;
+
+	addr.s6_addr[12] = 0;
+	if ((teredo_list_find_trusted (l, &addr, &t) != 0)
+	 || (t.mapped_addr != htonl (0xc0000201))
+	 || (t.mapped_port != htons (3544)) || t.local)
+		return -1;
+
+	/* unknown peer */
+	addr.s6_addr[12] = 2;
+	if (teredo_list_find_trusted (l, &addr, &t) == 0)
+		return -1;
+	teredo_list_read_unlock ();
+
+	teredo_list_destroy (l);
+	return 0;
+}
+
+
+static unsigned emitted;
+
+static void emit_cb (void *opaque, const void *data, size_t len)
+{
+	(void)opaque;
+	if ((len != 1000) || (*(const uint8_t *)data != emitted))
+		emitted = 100; /* out of order */
+	else
+		emitted++;
+}
+
+
+static int test_queue (void)
+{
+	struct in6_addr addr = { { } };
+	teredo_list_stats st;
+	uint8_t buf[1000] = { 0 };
+	bool create;
+
+	puts ("Packets queueing test...");
+	teredo_peerlist *l = teredo_list_create (16, 3);
+	if (l == NULL)
+		return -1;
+
+	teredo_list_set_queue_limits (l, 3000, 4500);
+
+	teredo_peer *p = teredo_list_lookup (l, &addr, &create);
+	if (p == NULL)
+		return -1;
+	for (unsigned i = 0; i < 4; i++)
+	{
+		buf[0] = i;
+		teredo_enqueue_in (p, buf, sizeof (buf), 1, 2);
+	}
+	teredo_list_release (l);
+
+	/* per-peer budget */
+	teredo_list_get_stats (l, &st);
+	if ((st.queued != 3) || (st.queued_bytes != 3000)
+	 || (st.queue_dropped != 1))
+		return -1;
+
+	/* list budget */
+	addr.s6_addr[12] = 1;
+	p = teredo_list_lookup (l, &addr, &create);
+	if (p == NULL)
+		return -1;
+	teredo_enqueue_in (p, buf, sizeof (buf), 1, 2);
+	teredo_enqueue_in (p, buf, sizeof (buf), 1, 2);
+	teredo_list_release (l);
+
+	teredo_list_get_stats (l, &st);
+	if ((st.queued != 4) || (st.queued_bytes != 4000)
+	 || (st.queue_dropped != 2))
+		return -1;
+
+	/* first in, first out */
+	addr.s6_addr[12] = 0;
+	p = teredo_list_lookup (l, &addr, NULL);
+	if (p == NULL)
+		return -1;
+	teredo_queue *q = teredo_peer_queue_yield (p);
+	teredo_list_release (l);
+
+	teredo_queue_emit (q, -1, 1, 2, emit_cb, NULL);
+	if (emitted != 3)
+		return -1;
+
+	teredo_list_get_stats (l, &st);
+	if ((st.queued != 1) || (st.queued_bytes != 1000))
+		return -1;
+
+	/* outgoing packets, sent to ourselves */
+	struct sockaddr_in sa =
+	{
+		.sin_family = AF_INET,
+		.sin_addr.s_addr = htonl (INADDR_LOOPBACK),
+	};
+	socklen_t salen = sizeof (sa);
+	int fd = socket (AF_INET, SOCK_DGRAM, 0);
+	if ((fd == -1) || bind (fd, (struct sockaddr *)&sa, sizeof (sa))
+	 || getsockname (fd, (struct sockaddr *)&sa, &salen))
+		return -1;
+
+	addr.s6_addr[12] = 2;
+	p = teredo_list_lookup (l, &addr, &create);
+	if (p == NULL)
+		return -1;
+	for (unsigned i = 0; i < 3; i++)
+	{
+		buf[0] = i;
+		teredo_enqueue_out (p, buf, 100);
+	}
+	q = teredo_peer_queue_yield (p);
+	teredo_list_release (l);
+
+	teredo_queue_emit (q, fd, sa.sin_addr.s_addr, sa.sin_port,
+	                   emit_cb, NULL);
+	for (unsigned i = 0; i < 3; i++)
+		if ((recv (fd, buf, sizeof (buf), MSG_DONTWAIT) != 100)
+		 || (buf[0] != i))
+			return -1;
+	close (fd);
+
+	teredo_list_destroy (l);
+	return 0;
+}
+
+
 int main (void)
 {
 	struct in6_addr addr = { { } };
@@ -204,11 +433,30 @@ int main (void)
 		if (teredo_list_lookup (l, &addr, &create) != NULL)
 			return -1;
 
+		teredo_list_stats st;
+		teredo_list_get_stats (l, &st);
+		if ((st.peers != 1) || (st.peers_room < 1) || (st.queued != 0))
+			return -1;
+
+		addr.s6_addr[12] = 0;
+		if (!teredo_list_may_contain (l, &addr))
+			return -1;
+
 		teredo_list_reset (l, 1);
+		teredo_list_get_stats (l, &st);
+		if ((st.peers != 0) || teredo_list_may_contain (l, &addr))
+			return -1;
 		teredo_list_reset (l, 1);
 		teredo_list_destroy (l);
 	}
 
+	if (test_admission ())
+		return -1;
+	if (test_trusted ())
+		return -1;
+	if (test_queue ())
+		return -1;
+
 	puts ("List creation test...");
 	l = teredo_list_create (255, 2);
 	if (l == NULL)
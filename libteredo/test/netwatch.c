@@ -0,0 +1,126 @@
+/*
+ * netwatch.c - Libteredo network change notification tests
+ */
+
+/***********************************************************************
+ *  Copyright © 2007 Rémi Denis-Courmont.                              *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#undef NDEBUG
+#include <assert.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#ifdef HAVE_LINUX_RTNETLINK_H
+# include <linux/netlink.h>
+# include <linux/rtnetlink.h>
+#endif
+
+#include "netwatch.h"
+
+#ifdef HAVE_LINUX_RTNETLINK_H
+static union
+{
+	struct nlmsghdr hdr;
+	char buf[256];
+} msg;
+
+static size_t addr_msg (int type, int family, int scope)
+{
+	memset (&msg, 0, sizeof (msg));
+	msg.hdr.nlmsg_len = NLMSG_LENGTH (sizeof (struct ifaddrmsg));
+	msg.hdr.nlmsg_type = type;
+
+	struct ifaddrmsg *ifa = NLMSG_DATA (&msg.hdr);
+	ifa->ifa_family = family;
+	ifa->ifa_prefixlen = 24;
+	ifa->ifa_scope = scope;
+	return msg.hdr.nlmsg_len;
+}
+
+
+static size_t route_msg (int type, int dst_len, int table)
+{
+	memset (&msg, 0, sizeof (msg));
+	msg.hdr.nlmsg_len = NLMSG_LENGTH (sizeof (struct rtmsg));
+	msg.hdr.nlmsg_type = type;
+
+	struct rtmsg *rtm = NLMSG_DATA (&msg.hdr);
+	rtm->rtm_family = AF_INET;
+	rtm->rtm_dst_len = dst_len;
+	rtm->rtm_table = table;
+	rtm->rtm_type = RTN_UNICAST;
+	return msg.hdr.nlmsg_len;
+}
+#endif
+
+
+int main (void)
+{
+#ifdef HAVE_LINUX_RTNETLINK_H
+	size_t len;
+
+	/* IPv4 addresses */
+	len = addr_msg (RTM_NEWADDR, AF_INET, RT_SCOPE_UNIVERSE);
+	assert (teredo_netwatch_filter (msg.buf, len));
+	len = addr_msg (RTM_DELADDR, AF_INET, RT_SCOPE_LINK);
+	assert (teredo_netwatch_filter (msg.buf, len));
+	len = addr_msg (RTM_NEWADDR, AF_INET, RT_SCOPE_HOST);
+	assert (!teredo_netwatch_filter (msg.buf, len));
+	len = addr_msg (RTM_NEWADDR, AF_INET6, RT_SCOPE_UNIVERSE);
+	assert (!teredo_netwatch_filter (msg.buf, len));
+
+	/* Truncated message */
+	len = addr_msg (RTM_NEWADDR, AF_INET, RT_SCOPE_UNIVERSE);
+	assert (!teredo_netwatch_filter (msg.buf, len - 1));
+
+	/* Default routes */
+	len = route_msg (RTM_NEWROUTE, 0, RT_TABLE_MAIN);
+	assert (teredo_netwatch_filter (msg.buf, len));
+	len = route_msg (RTM_DELROUTE, 0, RT_TABLE_MAIN);
+	assert (teredo_netwatch_filter (msg.buf, len));
+	len = route_msg (RTM_NEWROUTE, 24, RT_TABLE_MAIN);
+	assert (!teredo_netwatch_filter (msg.buf, len));
+	len = route_msg (RTM_NEWROUTE, 0, RT_TABLE_LOCAL);
+	assert (!teredo_netwatch_filter (msg.buf, len));
+
+	/* Relevant message after an irrelevant one */
+	union
+	{
+		struct nlmsghdr hdr;
+		char buf[2 * NLMSG_SPACE (sizeof (struct rtmsg))];
+	} batch;
+	size_t off;
+
+	len = route_msg (RTM_NEWROUTE, 8, RT_TABLE_MAIN);
+	memcpy (batch.buf, msg.buf, len);
+	off = NLMSG_ALIGN (len);
+	assert (!teredo_netwatch_filter (batch.buf, off));
+	len = route_msg (RTM_NEWROUTE, 0, RT_TABLE_MAIN);
+	memcpy (batch.buf + off, msg.buf, len);
+	assert (teredo_netwatch_filter (batch.buf, off + len));
+	return 0;
+#else
+	return 77; /* not supported: skipped */
+#endif
+}
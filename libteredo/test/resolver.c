@@ -0,0 +1,189 @@
+/*
+ * resolver.c - Libteredo asynchronous name resolution tests
+ */
+
+/***********************************************************************
+ *  Copyright © 2007 Rémi Denis-Courmont.                              *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#undef NDEBUG
+#include <assert.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+
+#include "resolver.h"
+
+static unsigned calls;
+
+/* Stub resolver: slow, and the address changes on every query */
+static int stub_slow (const char *name, uint32_t *ipv4, unsigned *count,
+                      unsigned *ttl)
+{
+	assert (!strcmp (name, "teredo.example"));
+	nanosleep (&(struct timespec){ 0, 200000000 }, NULL);
+	ipv4[0] = htonl (0xc0000200 + __atomic_add_fetch (&calls, 1,
+	                                                   __ATOMIC_RELAXED));
+	*count = 1;
+	*ttl = 1;
+	return 0;
+}
+
+
+/* Stub resolver: round-robin DNS, rotating three addresses */
+static int stub_rr (const char *name, uint32_t *ipv4, unsigned *count,
+                    unsigned *ttl)
+{
+	unsigned n = __atomic_add_fetch (&calls, 1, __ATOMIC_RELAXED);
+
+	(void)name;
+	for (unsigned i = 0; i < 3; i++)
+		ipv4[i] = htonl (0xc0000201 + (n + i) % 3);
+	*count = 3;
+	*ttl = 1;
+	return 0;
+}
+
+
+/* Stub resolver: the DNS goes away after the first query */
+static int stub_flaky (const char *name, uint32_t *ipv4, unsigned *count,
+                       unsigned *ttl)
+{
+	(void)name;
+	if (__atomic_add_fetch (&calls, 1, __ATOMIC_RELAXED) > 1)
+		return EAI_AGAIN;
+	ipv4[0] = htonl (0xc0000201);
+	*count = 1;
+	*ttl = 0;
+	return 0;
+}
+
+
+static int stub_fail (const char *name, uint32_t *ipv4, unsigned *count,
+                      unsigned *ttl)
+{
+	(void)name; (void)ipv4; (void)count; (void)ttl;
+	return EAI_NONAME;
+}
+
+
+/* Computes a deadline some milliseconds from now */
+static void in_ms (struct timespec *ts, unsigned ms)
+{
+	clock_gettime (CLOCK_MONOTONIC, ts);
+	ts->tv_sec += ms / 1000;
+	ts->tv_nsec += (ms % 1000) * 1000000;
+	if (ts->tv_nsec >= 1000000000)
+	{
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+
+int main (void)
+{
+	teredo_resolver *r;
+	uint32_t ipv4;
+	struct timespec deadline;
+
+	/* First resolution: readers time out rather than wait for the DNS */
+	calls = 0;
+	r = teredo_resolver_start ("teredo.example", stub_slow);
+	assert (r != NULL);
+	ipv4 = 0;
+	in_ms (&deadline, 20);
+	assert (teredo_resolver_get (r, &ipv4, &deadline) == EAI_AGAIN);
+	in_ms (&deadline, 5000);
+	assert (teredo_resolver_get (r, &ipv4, &deadline) == 0);
+	assert (ipv4 == htonl (0xc0000201));
+
+	/* Cached address: no waiting, even with an expired deadline */
+	in_ms (&deadline, 0);
+	assert (teredo_resolver_get (r, &ipv4, &deadline) == 0);
+	assert (ipv4 == htonl (0xc0000201));
+
+	/* Refreshed when the time-to-live expires */
+	nanosleep (&(struct timespec){ 1, 500000000 }, NULL);
+	assert (teredo_resolver_get (r, &ipv4, &deadline) == 0);
+	assert (ipv4 == htonl (0xc0000202));
+	teredo_resolver_stop (r);
+
+	/* Round-robin DNS: the address in use is kept while it is resolved */
+	calls = 0;
+	r = teredo_resolver_start ("teredo.example", stub_rr);
+	assert (r != NULL);
+	ipv4 = 0;
+	in_ms (&deadline, 5000);
+	assert (teredo_resolver_get (r, &ipv4, &deadline) == 0);
+	assert (ipv4 == htonl (0xc0000202));
+	nanosleep (&(struct timespec){ 1, 500000000 }, NULL);
+	assert (__atomic_load_n (&calls, __ATOMIC_RELAXED) > 1);
+	assert (teredo_resolver_get (r, &ipv4, &deadline) == 0);
+	assert (ipv4 == htonl (0xc0000202));
+
+	/* Moving away from an address, e.g. an unresponsive server */
+	for (unsigned i = 0; i < 3; i++)
+	{
+		uint32_t prev = ipv4;
+
+		teredo_resolver_skip (r, &ipv4);
+		assert (ipv4 != prev);
+		assert ((ntohl (ipv4) >= 0xc0000201) && (ntohl (ipv4) <= 0xc0000203));
+		assert (teredo_resolver_get (r, &ipv4, &deadline) == 0);
+	}
+
+	/* Unknown address: replaced with the first one */
+	ipv4 = htonl (0xc0000299);
+	assert (teredo_resolver_get (r, &ipv4, &deadline) == 0);
+	assert (ntohl (ipv4) != 0xc0000299);
+	teredo_resolver_stop (r);
+
+	/* Stale address kept while the DNS fails */
+	calls = 0;
+	r = teredo_resolver_start ("teredo.example", stub_flaky);
+	assert (r != NULL);
+	in_ms (&deadline, 5000);
+	assert (teredo_resolver_get (r, &ipv4, &deadline) == 0);
+	nanosleep (&(struct timespec){ 1, 500000000 }, NULL);
+	assert (__atomic_load_n (&calls, __ATOMIC_RELAXED) > 1);
+	assert (teredo_resolver_get (r, &ipv4, &deadline) == 0);
+	assert (ipv4 == htonl (0xc0000201));
+	teredo_resolver_stop (r);
+
+	/* Resolution error */
+	r = teredo_resolver_start ("teredo.example", stub_fail);
+	assert (r != NULL);
+	in_ms (&deadline, 5000);
+	assert (teredo_resolver_get (r, &ipv4, &deadline) == EAI_NONAME);
+	teredo_resolver_stop (r);
+
+	/* System resolver with an address literal */
+	r = teredo_resolver_start ("192.0.2.1", NULL);
+	assert (r != NULL);
+	assert (teredo_resolver_get (r, &ipv4, &deadline) == 0);
+	assert (ipv4 == htonl (0xc0000201));
+	teredo_resolver_stop (r);
+
+	return 0;
+}
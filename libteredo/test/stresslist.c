@@ -34,6 +34,7 @@
 #include <sys/types.h>
 #include <netinet/in.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include "teredo.h"
 #include "clock.h"
@@ -60,6 +61,28 @@ static void alarm_handler (int sig)
 }
 
 #define STRESS_DELAY 10
+#define STRESS_THREADS 4
+#define STRESS_MT_DELAY 2
+
+static teredo_peerlist *list;
+static struct in6_addr *addrv;
+static unsigned long addrc;
+static volatile bool stop = false;
+
+static void *lookup_thread (void *data)
+{
+	unsigned long n = 0, j = (uintptr_t)data;
+
+	while (!stop)
+	{
+		if (teredo_list_lookup (list, addrv + (j++ % addrc), NULL) == NULL)
+			return NULL; /* should not happen */
+		teredo_list_release (list);
+		n++;
+	}
+	return (void *)(uintptr_t)n;
+}
+
 
 int main (void)
 {
@@ -97,6 +120,13 @@ int main (void)
 	printf ("\n%lu inserts/s\n",
 			(unsigned long)((float)i * CLOCKS_PER_SEC / t));
 
+	teredo_list_stats st;
+	teredo_list_get_stats (l, &st);
+	printf ("%u/%u peer entries, %zu bytes\n", st.peers, st.peers_room,
+	        st.bytes);
+	if (st.peers != i)
+		return -1;
+
 	// Lookup stress test
 	srand ((unsigned int)seed);
 	seed += 10;
@@ -116,6 +146,83 @@ int main (void)
 	printf ("\n%lu lookups/s\n",
 	        (unsigned long)((float)i * CLOCKS_PER_SEC / t));
 
+	// Multi-threaded lookup stress test
+	addrv = malloc (i * sizeof (*addrv));
+	if (addrv == NULL)
+		return -1;
+	srand ((unsigned int)(seed - 10));
+	for (unsigned long j = 0; j < i; j++)
+		make_address (addrv + j);
+	addrc = i;
+	list = l;
+
+	pthread_t th[STRESS_THREADS];
+	for (unsigned j = 0; j < STRESS_THREADS; j++)
+		if (pthread_create (th + j, NULL, lookup_thread,
+		                    (void *)(uintptr_t)(j * (i / STRESS_THREADS))))
+			return -1;
+
+	sleep (STRESS_MT_DELAY);
+	stop = true;
+
+	unsigned long total = 0;
+	for (unsigned j = 0; j < STRESS_THREADS; j++)
+	{
+		void *n;
+
+		pthread_join (th[j], &n);
+		if (n == NULL)
+			return -1;
+		total += (uintptr_t)n;
+	}
+	free (addrv);
+
+	printf ("\n%lu lookups/s with %u threads\n",
+	        total / STRESS_MT_DELAY, STRESS_THREADS);
+
+	teredo_list_destroy (l);
+
+	// Expiry stress test
+	l = teredo_list_create (UINT_MAX, 1);
+	if (l == NULL)
+		return -1;
+
+	for (unsigned long j = 0; j < i; j++)
+	{
+		bool create;
+
+		make_address (&addr);
+		if (teredo_list_lookup (l, &addr, &create) == NULL)
+			return -1;
+		teredo_list_release (l);
+	}
+
+	teredo_list_get_stats (l, &st);
+	size_t peak = st.bytes;
+
+	for (unsigned j = 0; j < 100; j++)
+	{
+		nanosleep (&(struct timespec){ 0, 100000000 }, NULL);
+		teredo_list_get_stats (l, &st);
+		if (st.peers == 0)
+			break;
+	}
+
+	printf ("\n%lu peers expired, longest pause %lu us\n", st.expired,
+	        st.max_pause);
+	if ((st.peers != 0) || teredo_list_may_contain (l, &addr))
+		return -1;
+
+	/* the memory of expired peers goes back to the heap */
+	for (unsigned j = 0; (j < 100) && (st.bytes > peak / 2); j++)
+	{
+		nanosleep (&(struct timespec){ 0, 100000000 }, NULL);
+		teredo_list_get_stats (l, &st);
+	}
+
+	printf ("%zu bytes after expiry, %zu bytes at peak\n", st.bytes, peak);
+	if (st.bytes > peak / 2)
+		return -1;
 	teredo_list_destroy (l);
 
 	signal (SIGALRM, SIG_IGN);
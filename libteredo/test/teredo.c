@@ -82,11 +82,33 @@ int main (void)
 	assert (pval == tunnel);
 
 	teredo_set_recv_callback (tunnel, NULL);
+	teredo_set_recvv_callback (tunnel, NULL);
 	teredo_set_icmpv6_callback (tunnel, NULL);
 	teredo_set_state_cb (tunnel, NULL, NULL);
 
+	val = teredo_run_async_n (tunnel, 0, -1);
+	assert (val == -1);
+	val = teredo_run_async_n (tunnel, 4, 0);
+	assert (val == 0);
+	val = teredo_run_async (tunnel);
+	assert (val == -1);
+
 	teredo_destroy (tunnel);
 
+	tunnel = teredo_create_shards (0, 0, 0);
+	assert (tunnel == NULL);
+
+	// Sharding is not supported everywhere
+	tunnel = teredo_create_shards (0, 0, 4);
+	if (tunnel != NULL)
+	{
+		val = teredo_set_client_mode (tunnel, "192.0.2.1", NULL);
+		assert (val == -1);
+		val = teredo_run_async_n (tunnel, 2, -1);
+		assert (val == 0);
+		teredo_destroy (tunnel);
+	}
+
 	teredo_cleanup (false);
 	return 0;
 }
@@ -102,6 +102,27 @@ typedef struct teredo_tunnel teredo_tunnel;
  */
 teredo_tunnel *teredo_create (uint32_t ipv4, uint16_t port);
 
+/**
+ * Creates a sharded teredo_tunnel instance, for use as a Teredo relay.
+ * This is the same as teredo_create(), except that @p n UDP sockets share
+ * the same address and port, each with its own list of peers. Datagrams
+ * from a given Teredo client are always received on the same socket,
+ * and packets toward that client are sent through that same socket.
+ * Receive threads started with teredo_run_async_n() are spread evenly
+ * across shards.
+ *
+ * Sharded tunnels cannot be used in Teredo client mode.
+ * Sharding is only supported on Linux (3.9 or later).
+ *
+ * Thread-safety: This function is thread-safe.
+ *
+ * @param n number of shards (1 is the same as teredo_create()).
+ *
+ * @return NULL in case of failure.
+ */
+teredo_tunnel *teredo_create_shards (uint32_t ipv4, uint16_t port,
+                                     unsigned n);
+
 /**
  * Releases all resources (sockets, memory chunks...) and terminates all
  * threads associated with a teredo_tunnel instance.
@@ -150,6 +171,22 @@ void teredo_run (teredo_tunnel *t);
  */
 int teredo_run_async (teredo_tunnel *t);
 
+/**
+ * Spawns several threads to perform Teredo packet reception in the
+ * background, all sharing the same tunnel. This is the same as
+ * teredo_run_async(), but decapsulation is spread across @p n threads.
+ *
+ * Thread-safety: see teredo_run_async().
+ *
+ * @param t Teredo tunnel instance
+ * @param n number of receive threads per shard (at least one)
+ * @param cpu if non-negative, the i-th thread (starting from 0) is bound
+ * to CPU number @p cpu + i, where supported.
+ *
+ * @return 0 on success, -1 on error (then no threads are started).
+ */
+int teredo_run_async_n (teredo_tunnel *t, unsigned n, int cpu);
+
 /**
  * Overrides the Teredo prefix of a Teredo relay.
  * Currently ignored for Teredo client (but might later restrict accepted
@@ -180,6 +217,20 @@ int teredo_set_prefix (teredo_tunnel *t, uint32_t prefix);
  */
 int teredo_set_cone_flag (teredo_tunnel *t, bool flag);
 
+/**
+ * Defines the budgets for packets queued while waiting for untrusted peers
+ * to reply to hole punching bubbles or pings. Packets are queued, and later
+ * sent or delivered, in arrival order. Packets exceeding either budget are
+ * dropped.
+ *
+ * Thread-safety: This function is thread-safe.
+ *
+ * @param t Teredo tunnel instance
+ * @param peer maximum bytes of packets queued for any single peer
+ * @param total maximum bytes of packets queued for the whole tunnel
+ */
+void teredo_set_queue_limits (teredo_tunnel *t, size_t peer, size_t total);
+
 /**
  * Enables Teredo relay mode (this is the default).
  *
@@ -294,6 +345,30 @@ typedef void (*teredo_recv_cb) (void *opaque, const void *data, size_t len);
  */
 void teredo_set_recv_callback (teredo_tunnel *restrict t, teredo_recv_cb cb);
 
+struct iovec;
+
+/**
+ * Prototype for callback to receive several decapsulated IPv6 packets.
+ *
+ * @param opaque private data pointer, set by teredo_set_privdata()
+ * @param packets IPv6 packets (one entry per packet), in reception order
+ * @param count number of packets (at least one)
+ */
+typedef void (*teredo_recvv_cb) (void *opaque, const struct iovec *packets,
+                                 size_t count);
+
+/**
+ * Sets a callback to receive IPv6 packets decapsulated from the Teredo
+ * tunnel in batches. Packets from trusted peers that were received together
+ * are then passed to it at once, rather than one by one to the callback set
+ * with teredo_set_recv_callback(), which still receives the other packets.
+ *
+ * @param t Teredo tunnel instance
+ * @param cb callback (or NULL to use the single packet callback only)
+ */
+void teredo_set_recvv_callback (teredo_tunnel *restrict t,
+                                teredo_recvv_cb cb);
+
 /**
  * Transmits a packet coming from the IPv6 Internet, toward a Teredo node
  * (as specified per paragraph 5.4.1). That's what the specification calls
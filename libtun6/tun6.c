@@ -403,6 +403,18 @@ int tun6_getId (const tun6 *t)
 }
 
 
+/**
+ * @return the file descriptor of the tunnel device, for use with poll().
+ * Packets must still be received with tun6_recv() or tun6_wait_recv().
+ */
+int tun6_getFd (const tun6 *t)
+{
+	assert (t != NULL);
+
+	return t->fd;
+}
+
+
 #if defined (USE_LINUX)
 static int
 proc_write_zero (const char *path)
@@ -903,7 +915,9 @@ tun6_recv (tun6 *t, const fd_set *readset, void *buffer, size_t maxlen)
  * @param buffer address to store packet
  * @param maxlen buffer length in bytes (should be 65535)
  *
- * This function will block until a packet arrives or an error occurs.
+ * This function will block until a packet arrives or an error occurs,
+ * unless the file descriptor was made non-blocking (see tun6_getFd()).
+ * It then fails with EAGAIN if no packet is pending.
  *
  * @return the packet length on success, -1 if no packet were to be received.
  */
@@ -114,11 +114,43 @@ static int miredo_checkconf (miredo_conf *conf)
 		if (!miredo_conf_parse_teredo_prefix (conf, "Prefix", &pref)
 		 || !miredo_conf_get_int16 (conf, "InterfaceMTU", &u16, NULL))
 			res = -1;
+
+		u16 = 1;
+		if (!miredo_conf_get_int16 (conf, "RelayShards", &u16, NULL))
+			res = -1;
+		else
+		if (u16 == 0)
+		{
+			fprintf (stderr, "%s\n", _("Invalid number of relay shards"));
+			res = -1;
+		}
 	}
 
 	if (!miredo_conf_parse_IPv4 (conf, "BindAddress", &u32)
-	 || !miredo_conf_get_int16 (conf, "BindPort", &u16, NULL))
+	 || !miredo_conf_get_int16 (conf, "BindPort", &u16, NULL)
+	 || !miredo_conf_get_int16 (conf, "TransmitDelay", &u16, NULL)
+	 || !miredo_conf_get_int16 (conf, "ReceiveCPU", &u16, NULL)
+	 || !miredo_conf_get_int16 (conf, "PeerQueueSize", &u16, NULL)
+	 || !miredo_conf_get_int16 (conf, "QueueSize", &u16, NULL))
+		res = -1;
+
+	u16 = 0;
+	if (!miredo_conf_get_int16 (conf, "TransmitBatch", &u16, NULL))
 		res = -1;
+	else
+	if (u16 > MIREDO_TX_BATCH_MAX)
+		fprintf (stderr, _("Transmit batch size too large, using %u\n"),
+		         MIREDO_TX_BATCH_MAX);
+
+	u16 = 1;
+	if (!miredo_conf_get_int16 (conf, "ReceiveThreads", &u16, NULL))
+		res = -1;
+	else
+	if (u16 == 0)
+	{
+		fprintf (stderr, "%s\n", _("Invalid number of receive threads"));
+		res = -1;
+	}
 
 	char *str = miredo_conf_get (conf, "InterfaceName", NULL);
 	if (str != NULL)
@@ -33,6 +33,9 @@
 
 typedef struct miredo_conf miredo_conf;
 
+/* Largest TransmitBatch value (the sendmmsg() limit, UIO_MAXIOV) */
+# define MIREDO_TX_BATCH_MAX 1024
+
 # ifdef __cplusplus
 extern "C"
 {
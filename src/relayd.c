@@ -30,11 +30,13 @@
 #include <stdlib.h> // free()
 #include <stdio.h> // fputs()
 #include <sys/types.h>
+#include <sys/uio.h> // struct iovec
 #include <string.h> // strcasecmp()
 #include <errno.h>
 #include <unistd.h> // close()
 #include <fcntl.h>
 #include <sys/wait.h> // wait()
+#include <poll.h> // poll()
 #include <signal.h> // sigemptyset()
 #include <syslog.h>
 #include <pthread.h>
@@ -62,6 +64,7 @@
 
 #include <libteredo/teredo.h>
 #include <libteredo/tunnel.h>
+#include <libteredo/teredo-udp.h>
 
 #include "privproc.h"
 #include "miredo.h"
@@ -88,6 +91,8 @@ typedef struct miredo_tunnel
 	tun6 *tunnel;
 	int priv_fd;
 	teredo_tunnel *relay;
+	uint16_t tx_batch, tx_delay;
+	uint16_t rx_threads, rx_cpu;
 } miredo_tunnel;
 
 static int icmp6_fd = -1;
@@ -135,6 +140,22 @@ miredo_recv_callback (void *data, const void *packet, size_t length)
 }
 
 
+/**
+ * Callback to transmit batches of decapsulated Teredo IPv6 packets to the
+ * kernel.
+ */
+static void
+miredo_recvv_callback (void *data, const struct iovec *packets, size_t count)
+{
+	assert (data != NULL);
+
+	tun6 *tunnel = ((miredo_tunnel *)data)->tunnel;
+
+	for (size_t i = 0; i < count; i++)
+		(void)tun6_send (tunnel, packets[i].iov_base, packets[i].iov_len);
+}
+
+
 /**
  * Callback to emit an ICMPv6 error message through a raw ICMPv6 socket.
  */
@@ -458,6 +479,14 @@ static LIBTEREDO_NORETURN void *miredo_encap_thread (void *d)
 	teredo_tunnel *relay = ((miredo_tunnel *)d)->relay;
 	tun6 *tunnel = ((miredo_tunnel *)d)->tunnel;
 
+	if (teredo_send_batch_start (((miredo_tunnel *)d)->tx_batch,
+	                             ((miredo_tunnel *)d)->tx_delay))
+		syslog (LOG_WARNING, _("Cannot batch Teredo packets: %m"));
+
+	/* The tunnel is read until it is drained, then waited for with poll() */
+	struct pollfd ufd = { .fd = tun6_getFd (tunnel), .events = POLLIN };
+	miredo_setup_nonblock_fd (ufd.fd);
+
 	for (;;)
 	{
 		/* Handle incoming data */
@@ -469,13 +498,25 @@ static LIBTEREDO_NORETURN void *miredo_encap_thread (void *d)
 
 		/* Forwards IPv6 packet to Teredo
 		 * (Packet transmission) */
+		errno = 0;
 		int val = tun6_wait_recv (tunnel, &pbuf.ip6, sizeof (pbuf));
+
 		if (val >= 40)
 		{
 			pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, NULL);
 			teredo_transmit (relay, &pbuf.ip6, val);
 			pthread_setcancelstate (PTHREAD_CANCEL_ENABLE, NULL);
 		}
+		else
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+		{
+			/* The tunnel is idle: send what has been batched so far.
+			 * The batch is then empty, so the wait needs no deadline. */
+			pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, NULL);
+			teredo_send_batch_flush ();
+			pthread_setcancelstate (PTHREAD_CANCEL_ENABLE, NULL);
+			poll (&ufd, 1, -1);
+		}
 		else
 			pthread_testcancel ();
 	}
@@ -490,7 +531,9 @@ static int
 run_tunnel (miredo_tunnel *tunnel)
 {
 	pthread_t encap_th;
-	if (teredo_run_async (tunnel->relay)
+	int cpu = (tunnel->rx_cpu != UINT16_MAX) ? tunnel->rx_cpu : -1;
+
+	if (teredo_run_async_n (tunnel->relay, tunnel->rx_threads, cpu)
 	 || pthread_create (&encap_th, NULL, miredo_encap_thread, tunnel))
 		return -1;
 
@@ -534,7 +577,9 @@ relay_run (miredo_conf *conf, const char *server_name)
 		.ifname_re = &preg,
 	}, *disc_params = &ldp;
 #endif
-	uint16_t mtu = 1280;
+	uint16_t mtu = 1280, tx_batch = 16, tx_delay = 500;
+	uint16_t rx_threads = 1, rx_cpu = UINT16_MAX, shards = 1;
+	uint16_t peer_queue = 8192, queue_size = 4096;
 	bool cone = false;
 
 	if (mode & TEREDO_CLIENT)
@@ -583,8 +628,16 @@ relay_run (miredo_conf *conf, const char *server_name)
 
 		if (!miredo_conf_parse_teredo_prefix (conf, "Prefix",
 		                                      &prefix.teredo.prefix)
-		 || !miredo_conf_get_int16 (conf, "InterfaceMTU", &mtu, NULL))
+		 || !miredo_conf_get_int16 (conf, "InterfaceMTU", &mtu, NULL)
+		 || !miredo_conf_get_int16 (conf, "RelayShards", &shards, NULL))
+		{
+			syslog (LOG_ALERT, _("Fatal configuration error"));
+			return -2;
+		}
+
+		if (shards == 0)
 		{
+			syslog (LOG_ALERT, _("Invalid number of relay shards"));
 			syslog (LOG_ALERT, _("Fatal configuration error"));
 			return -2;
 		}
@@ -607,12 +660,32 @@ relay_run (miredo_conf *conf, const char *server_name)
 #endif
 
 	if (!miredo_conf_parse_IPv4 (conf, "BindAddress", &bind_ip)
-	 || !miredo_conf_get_int16 (conf, "BindPort", &bind_port, NULL))
+	 || !miredo_conf_get_int16 (conf, "BindPort", &bind_port, NULL)
+	 || !miredo_conf_get_int16 (conf, "TransmitBatch", &tx_batch, NULL)
+	 || !miredo_conf_get_int16 (conf, "TransmitDelay", &tx_delay, NULL)
+	 || !miredo_conf_get_int16 (conf, "ReceiveThreads", &rx_threads, NULL)
+	 || !miredo_conf_get_int16 (conf, "ReceiveCPU", &rx_cpu, NULL)
+	 || !miredo_conf_get_int16 (conf, "PeerQueueSize", &peer_queue, NULL)
+	 || !miredo_conf_get_int16 (conf, "QueueSize", &queue_size, NULL))
 	{
 		syslog (LOG_ALERT, _("Fatal configuration error"));
 		return -2;
 	}
 
+	if (rx_threads == 0)
+	{
+		syslog (LOG_ALERT, _("Invalid number of receive threads"));
+		syslog (LOG_ALERT, _("Fatal configuration error"));
+		return -2;
+	}
+
+	if (tx_batch > MIREDO_TX_BATCH_MAX)
+	{
+		syslog (LOG_WARNING, _("Transmit batch size too large, using %u"),
+		        MIREDO_TX_BATCH_MAX);
+		tx_batch = MIREDO_TX_BATCH_MAX;
+	}
+
 	bind_port = htons (bind_port);
 
 	char *ifname = miredo_conf_get (conf, "InterfaceName", NULL);
@@ -648,12 +721,18 @@ relay_run (miredo_conf *conf, const char *server_name)
 	{
 		if (drop_privileges () == 0)
 		{
-			teredo_tunnel *relay = teredo_create (bind_ip, bind_port);
+			teredo_tunnel *relay = teredo_create_shards (bind_ip, bind_port,
+			                                             shards);
 			if (relay != NULL)
 			{
-				miredo_tunnel data = { tunnel, privfd, relay };
+				miredo_tunnel data =
+					{ tunnel, privfd, relay, tx_batch, tx_delay,
+					  rx_threads, rx_cpu };
 				teredo_set_privdata (relay, &data);
+				teredo_set_queue_limits (relay, peer_queue,
+				                         (size_t)queue_size << 10);
 				teredo_set_recv_callback (relay, miredo_recv_callback);
+				teredo_set_recvv_callback (relay, miredo_recvv_callback);
 				teredo_set_icmpv6_callback (relay, miredo_icmp6_callback);
 
 				retval = (mode & TEREDO_CLIENT)